@@ -0,0 +1,4 @@
+-- direct bulk load of the same records into the layout table
+SELECT bin_copy_into(p.relid, p.batch)
+  FROM bench_payload p
+ WHERE p.relid = :relid::regclass;
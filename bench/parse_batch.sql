@@ -0,0 +1,4 @@
+-- the batch SRF over the same records
+SELECT count(*)
+  FROM bench_payload p, bin_parse_batch(p.relid, p.batch) AS r(:coldef)
+ WHERE p.relid = :relid::regclass;
@@ -0,0 +1,4 @@
+-- bin_parse once per record: the per-row path the others are measured against
+SELECT count(*)
+  FROM bench_payload p, unnest(p.records) rec, bin_parse(p.relid, rec) AS r(:coldef)
+ WHERE p.relid = :relid::regclass;
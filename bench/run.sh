@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# Decode benchmarks: rows/s and ns/row of bin_parse, bin_parse_batch and
+# bin_copy_into for each layout in setup.sql, checked against baseline.csv.
+#
+#   bench/run.sh            measure and compare with the baseline
+#   bench/run.sh --save     measure and store the result as the baseline
+#
+# Connection settings come from the usual PG* environment variables.
+# BENCH_ROWS (records per batch, default 1000), BENCH_DURATION (seconds
+# per run, default 10) and BENCH_TOLERANCE (allowed slowdown against the
+# baseline in percent, default 10) tune the run. Baselines are only
+# comparable on the same machine and server configuration.
+
+set -eu
+
+cd "$(dirname "$0")"
+
+rows=${BENCH_ROWS:-1000}
+duration=${BENCH_DURATION:-10}
+tolerance=${BENCH_TOLERANCE:-10}
+save=no
+if [ "${1:-}" = "--save" ]; then
+    save=yes
+fi
+
+psql -X -q -v ON_ERROR_STOP=1 -v rows="$rows" -f setup.sql >/dev/null
+
+result=$(mktemp)
+trap 'rm -f "$result"' EXIT
+echo "layout,path,rows_per_s,ns_per_row,speedup" > "$result"
+
+for table in bench_narrow bench_mixed40 bench_uuid; do
+    relid=$(psql -X -At -c "SELECT '$table'::regclass::oid")
+    coldef=$(psql -X -At -c "SELECT coldef FROM bench_payload WHERE relid = $relid")
+    single=
+
+    for path in parse_single parse_batch copy_into; do
+        psql -X -q -c "TRUNCATE $table"
+        tps=$(pgbench -n -T "$duration" -f "$path.sql" -D relid="$relid" -D coldef="$coldef" |
+              sed -n 's/^tps = \([0-9.]*\).*/\1/p')
+        rps=$(awk -v tps="$tps" -v n="$rows" 'BEGIN { printf "%.0f", tps * n }')
+        if [ -z "$single" ]; then
+            single=$rps
+        fi
+        awk -v l="$table" -v p="$path" -v r="$rps" -v s="$single" \
+            'BEGIN { printf "%s,%s,%d,%.1f,%.2f\n", l, p, r, 1e9 / r, r / s }' >> "$result"
+    done
+done
+
+tr ',' '\t' < "$result"
+
+if [ "$save" = yes ]; then
+    cp "$result" baseline.csv
+    echo "saved as bench/baseline.csv"
+    exit 0
+fi
+
+# The batch SRF decodes the same records as bin_parse and must be faster
+status=0
+awk -F, '$2 == "parse_batch" && $5 <= 1 { printf "SLOWER THAN bin_parse: %s parse_batch\n", $1; bad = 1 }
+         END { exit bad }' "$result" || status=1
+
+if [ ! -f baseline.csv ]; then
+    echo "no bench/baseline.csv yet; run with --save to create one"
+    exit $status
+fi
+
+awk -F, -v tol="$tolerance" '
+    NR == FNR { if (FNR > 1) base[$1 "," $2] = $3; next }
+    FNR > 1 && ($1 "," $2) in base && $3 < base[$1 "," $2] * (1 - tol / 100) {
+        printf "REGRESSION: %s %s %d rows/s, baseline %d\n", $1, $2, $3, base[$1 "," $2]
+        bad = 1
+    }
+    END { exit bad }' baseline.csv "$result" || status=1
+
+exit $status
@@ -0,0 +1,78 @@
+-- Fixtures for bench/run.sh: three representative layouts and, for each,
+-- the same random records packed once per record and as one batch.
+--
+--   psql -v rows=1000 -f bench/setup.sql
+
+\set ON_ERROR_STOP on
+\if :{?rows}
+\else
+\set rows 1000
+\endif
+
+CREATE EXTENSION IF NOT EXISTS pg_binmapper;
+
+DROP TABLE IF EXISTS bench_narrow, bench_mixed40, bench_uuid, bench_payload;
+
+-- narrow, integers only
+CREATE TABLE bench_narrow (a int4, b int8, c int4, d int8);
+
+-- 40 mixed fixed-size columns
+DO $$
+DECLARE
+    types text[] := ARRAY['int8', 'int4', 'float8', 'int2', 'bool'];
+    cols text;
+BEGIN
+    SELECT string_agg(format('c%s %s', i, types[1 + (i - 1) % 5]), ', ' ORDER BY i)
+      INTO cols
+      FROM generate_series(1, 40) i;
+    EXECUTE format('CREATE TABLE bench_mixed40 (%s)', cols);
+END
+$$;
+
+-- UUID-heavy
+CREATE TABLE bench_uuid (id int8, u1 uuid, u2 uuid, u3 uuid, u4 uuid, ts int8);
+
+CREATE TABLE bench_payload (
+    relid regclass PRIMARY KEY,
+    coldef text NOT NULL,       -- column definition list for bin_parse and bin_parse_batch
+    nrows int NOT NULL,
+    records bytea[] NOT NULL,   -- one packed record per element
+    batch bytea NOT NULL        -- the same records back-to-back
+);
+-- keep detoasting cheap and independent of how well random bytes compress
+ALTER TABLE bench_payload ALTER COLUMN records SET STORAGE EXTERNAL;
+ALTER TABLE bench_payload ALTER COLUMN batch SET STORAGE EXTERNAL;
+
+CREATE OR REPLACE FUNCTION pg_temp.bench_fill(target regclass, nrows int)
+RETURNS void LANGUAGE plpgsql AS $fill$
+DECLARE
+    expr text;
+    coldef text;
+BEGIN
+    SELECT string_agg(CASE a.atttypid
+                          WHEN 'int2'::regtype THEN 'int2send((random() * 32000)::int2)'
+                          WHEN 'int4'::regtype THEN 'int4send((random() * 2e9 - 1e9)::int4)'
+                          WHEN 'int8'::regtype THEN 'int8send((random() * 1e15)::int8)'
+                          WHEN 'float8'::regtype THEN 'float8send(random())'
+                          WHEN 'bool'::regtype THEN 'boolsend(random() < 0.5)'
+                          WHEN 'uuid'::regtype THEN 'uuid_send(md5(random()::text)::uuid)'
+                      END, ' || ' ORDER BY a.attnum),
+           string_agg(format('%I %s', a.attname, format_type(a.atttypid, a.atttypmod)),
+                      ', ' ORDER BY a.attnum)
+      INTO expr, coldef
+      FROM pg_attribute a
+     WHERE a.attrelid = target AND a.attnum > 0 AND NOT a.attisdropped;
+
+    EXECUTE format($q$
+        INSERT INTO bench_payload (relid, coldef, nrows, records, batch)
+        SELECT %L, %L, %s, array_agg(rec), string_agg(rec, ''::bytea)
+          FROM (SELECT %s AS rec FROM generate_series(1, %s)) s
+    $q$, target, coldef, nrows, expr, nrows);
+END
+$fill$;
+
+SELECT pg_temp.bench_fill('bench_narrow', :rows);
+SELECT pg_temp.bench_fill('bench_mixed40', :rows);
+SELECT pg_temp.bench_fill('bench_uuid', :rows);
+
+ANALYZE bench_payload;
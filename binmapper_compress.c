@@ -0,0 +1,256 @@
+/*
+ * binmapper_compress.c
+ *		Распаковка сжатого тела кадра (BIN_FRAME_LZ4, BIN_FRAME_ZSTD).
+ *
+ * Сжимается тело кадра в строковом или колоночном виде, целиком, как
+ * один поток в формате кадров LZ4 (lz4frame) или zstd; несколько кадров
+ * подряд тоже допустимы. nrecords и CRC-32C в заголовке относятся к
+ * распакованному телу.
+ *
+ * bin_decompress_read распаковывает поток порциями в буфер вызывающего,
+ * так что тело можно резать на записи по мере распаковки, не держа его
+ * в памяти целиком. Распакованное тело не может быть больше, чем
+ * допускает заголовок: nrecords * total_binary_size для layout без
+ * varlena, pg_binmapper.max_decompressed_size для остальных. Иначе
+ * несколько килобайт сжатого тела заставляли бы выделять память до
+ * MaxAllocSize на каждый вызов. Контекст распаковщика выделяет сама библиотека
+ * (malloc), поэтому он освобождается и при ошибке: через callback
+ * сброса текущего контекста памяти.
+ *
+ * Поддержка есть, только если PostgreSQL собран с --with-lz4 или
+ * --with-zstd (USE_LZ4, USE_ZSTD в pg_config.h).
+ */
+#include "postgres.h"
+
+#include "lib/stringinfo.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+
+#ifdef USE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "pg_binmapper.h"
+
+struct BinDecompress {
+    uint8 method;           /* BIN_FRAME_LZ4 или BIN_FRAME_ZSTD */
+    void *ctx;              /* LZ4F_dctx или ZSTD_DCtx; NULL после bin_decompress_end */
+    const char *src;
+    Size srclen;
+    Size srcpos;
+    Size limit;             /* больше стольких байт тело быть не может */
+    Size produced;
+    bool finished;          /* поток распакован до конца */
+    MemoryContextCallback reset_cb;
+};
+
+/* pg_binmapper.max_decompressed_size, кБ */
+int bin_max_decompressed_size = 256 * 1024;
+
+void
+bin_compress_init(void)
+{
+    DefineCustomIntVariable("pg_binmapper.max_decompressed_size",
+                            "Largest decompressed body accepted for a batch with variable-length columns.",
+                            "Bodies of fixed-size layouts are limited by the record count in the frame header.",
+                            &bin_max_decompressed_size,
+                            256 * 1024, 1024, (int) (MaxAllocSize / 1024) - 1,
+                            PGC_USERSET, GUC_UNIT_KB,
+                            NULL, NULL, NULL);
+}
+
+/* Наибольший размер распакованного тела кадра frame для layout */
+Size
+bin_decompress_limit(TableBinaryLayout *layout, const BinFrame *frame)
+{
+    if (layout->nvarlena == 0)
+        return (Size) frame->nrecords * layout->total_binary_size;
+    return (Size) bin_max_decompressed_size * 1024;
+}
+
+static void
+decompress_free_ctx(void *arg)
+{
+    BinDecompress *dc = (BinDecompress *) arg;
+
+    if (dc->ctx == NULL)
+        return;
+#ifdef USE_LZ4
+    if (dc->method == BIN_FRAME_LZ4)
+        LZ4F_freeDecompressionContext((LZ4F_dctx *) dc->ctx);
+#endif
+#ifdef USE_ZSTD
+    if (dc->method == BIN_FRAME_ZSTD)
+        ZSTD_freeDCtx((ZSTD_DCtx *) dc->ctx);
+#endif
+    dc->ctx = NULL;
+}
+
+/*
+ * Начинает распаковку тела src. method - флаг сжатия из заголовка,
+ * limit - bin_decompress_limit. ERROR, если модуль собран без поддержки
+ * этого метода.
+ */
+BinDecompress *
+bin_decompress_begin(uint8 method, const char *src, Size len, Size limit)
+{
+    BinDecompress *dc = (BinDecompress *) palloc0(sizeof(BinDecompress));
+
+    dc->method = method;
+    dc->src = src;
+    dc->srclen = len;
+    dc->limit = limit;
+
+    if (method == BIN_FRAME_LZ4) {
+#ifdef USE_LZ4
+        LZ4F_dctx *ctx;
+
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)))
+            ereport(ERROR,
+                    (errcode(ERRCODE_OUT_OF_MEMORY),
+                     errmsg("could not create LZ4 decompression context")));
+        dc->ctx = ctx;
+#else
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("batch frame is compressed with lz4, but pg_binmapper was built without lz4 support")));
+#endif
+    } else {
+#ifdef USE_ZSTD
+        dc->ctx = ZSTD_createDCtx();
+        if (dc->ctx == NULL)
+            ereport(ERROR,
+                    (errcode(ERRCODE_OUT_OF_MEMORY),
+                     errmsg("could not create zstd decompression context")));
+#else
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("batch frame is compressed with zstd, but pg_binmapper was built without zstd support")));
+#endif
+    }
+
+    dc->reset_cb.func = decompress_free_ctx;
+    dc->reset_cb.arg = dc;
+    MemoryContextRegisterResetCallback(CurrentMemoryContext, &dc->reset_cb);
+
+    return dc;
+}
+
+bool
+bin_decompress_finished(BinDecompress *dc)
+{
+    return dc->finished;
+}
+
+/*
+ * Распаковывает следующую порцию в dst, пока он не заполнится или поток
+ * не кончится. В *produced - сколько байт записано. Возвращает NULL или
+ * текст ошибки, если поток повреждён, обрывается или длиннее limit.
+ */
+char *
+bin_decompress_read(BinDecompress *dc, char *dst, Size cap, Size *produced)
+{
+    Size outpos = 0;
+
+    /* Байт сверх limit достаточно, чтобы заметить превышение */
+    if (cap > dc->limit - dc->produced + 1)
+        cap = dc->limit - dc->produced + 1;
+
+    while (outpos < cap && !dc->finished) {
+        Size before = outpos;
+        size_t ret = 0;
+
+#ifdef USE_LZ4
+        if (dc->method == BIN_FRAME_LZ4) {
+            size_t dst_size = cap - outpos;
+            size_t src_size = dc->srclen - dc->srcpos;
+
+            ret = LZ4F_decompress((LZ4F_dctx *) dc->ctx, dst + outpos, &dst_size,
+                                  dc->src + dc->srcpos, &src_size, NULL);
+            if (LZ4F_isError(ret))
+                return psprintf("DECOMPRESSION ERROR: %s", LZ4F_getErrorName(ret));
+            dc->srcpos += src_size;
+            outpos += dst_size;
+        }
+#endif
+#ifdef USE_ZSTD
+        if (dc->method == BIN_FRAME_ZSTD) {
+            ZSTD_inBuffer in = {dc->src, dc->srclen, dc->srcpos};
+            ZSTD_outBuffer out = {dst, cap, outpos};
+
+            ret = ZSTD_decompressStream((ZSTD_DCtx *) dc->ctx, &out, &in);
+            if (ZSTD_isError(ret))
+                return psprintf("DECOMPRESSION ERROR: %s", ZSTD_getErrorName(ret));
+            dc->srcpos = in.pos;
+            outpos = out.pos;
+        }
+#endif
+
+        /* 0 - конец кадра сжатия; за ним может идти следующий */
+        if (ret == 0 && dc->srcpos == dc->srclen)
+            dc->finished = true;
+        else if (dc->srcpos == dc->srclen && outpos == before)
+            return pstrdup("DECOMPRESSION ERROR: compressed batch body is truncated");
+    }
+
+    dc->produced += outpos;
+    if (dc->produced > dc->limit)
+        return psprintf("DECOMPRESSION ERROR: batch body decompresses to more than " UINT64_FORMAT " bytes",
+                        (uint64) dc->limit);
+
+    *produced = outpos;
+    return NULL;
+}
+
+/* Освобождает контекст распаковщика, не дожидаясь сброса контекста памяти */
+void
+bin_decompress_end(BinDecompress *dc)
+{
+    decompress_free_ctx(dc);
+}
+
+/*
+ * Распаковывает тело кадра целиком в память текущего контекста и
+ * подменяет им frame->data. Для путей, которым тело нужно сразу всё:
+ * колоночные кадры, диапазоны записей, on_error, отличный от abort.
+ * Возвращает NULL или текст ошибки.
+ */
+char *
+bin_decompress_frame(TableBinaryLayout *layout, BinFrame *frame)
+{
+    BinDecompress *dc;
+    StringInfoData buf;
+    char *reason = NULL;
+    Size limit = bin_decompress_limit(layout, frame);
+
+    dc = bin_decompress_begin(frame->flags & BIN_FRAME_COMPRESSION, frame->data,
+                              frame->data_len, limit);
+    initStringInfo(&buf);
+
+    while (!bin_decompress_finished(dc)) {
+        Size n;
+
+        CHECK_FOR_INTERRUPTS();
+
+        /* Не больше, чем может понадобиться: limit и ещё байт для проверки */
+        enlargeStringInfo(&buf, (int) Min((Size) BIN_DECOMPRESS_CHUNK, limit - buf.len + 1));
+        reason = bin_decompress_read(dc, buf.data + buf.len, buf.maxlen - buf.len - 1, &n);
+        if (reason != NULL)
+            break;
+        buf.len += (int) n;
+    }
+    bin_decompress_end(dc);
+
+    if (reason != NULL) {
+        pfree(buf.data);
+        return reason;
+    }
+
+    frame->data = buf.data;
+    frame->data_len = buf.len;
+    frame->flags &= ~BIN_FRAME_COMPRESSION;
+    return NULL;
+}
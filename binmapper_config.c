@@ -0,0 +1,392 @@
+/*
+ * binmapper_config.c
+ *		Настройки layout, заданные через bin_register_layout().
+ *
+ * Настройки лежат в таблицах расширения bin_layout_config и
+ * bin_column_config и читаются один раз при построении layout.
+ * bin_register_layout() и bin_register_column() после записи сбрасывают
+ * relcache таблицы, так что при коммите все backend-ы (и реестр в shared
+ * memory) перестраивают её layout.
+ *
+ * Писать в эти таблицы может только их владелец (владелец расширения).
+ * Регистрировать таблицу разрешено её владельцу, поэтому функции
+ * регистрации проверяют владельца таблицы от имени вызывающего, а сам
+ * upsert выполняют от имени владельца таблицы настроек.
+ */
+#include "postgres.h"
+
+#include "catalog/namespace.h"
+#include "access/table.h"
+#include "catalog/objectaddress.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
+#include "commands/extension.h"
+#include "executor/spi.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "utils/acl.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+
+#include "pg_binmapper.h"
+
+/*
+ * Схема, в которой создано расширение, или InvalidOid, если в этой базе
+ * его нет. Расширение relocatable, поэтому схема ищется при каждом
+ * вызове. Вызывается внутри SPI_connect.
+ */
+Oid
+bin_extension_namespace(void)
+{
+    Oid extoid;
+    Oid argtypes[1] = {OIDOID};
+    Datum args[1];
+    bool isnull;
+    int ret;
+
+    extoid = get_extension_oid("pg_binmapper", true);
+    if (!OidIsValid(extoid))
+        return InvalidOid;
+
+    args[0] = ObjectIdGetDatum(extoid);
+    ret = SPI_execute_with_args("SELECT extnamespace FROM pg_catalog.pg_extension WHERE oid = $1",
+                                1, argtypes, args, NULL, true, 1);
+    if (ret != SPI_OK_SELECT || SPI_processed != 1)
+        elog(ERROR, "[BINMAPPER] could not find schema of extension pg_binmapper");
+
+    return DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc,
+                                          1, &isnull));
+}
+
+/* Живая колонка tupdesc с именем attname или NULL */
+static Form_pg_attribute
+config_find_column(TupleDesc tupdesc, const char *attname)
+{
+    int i;
+
+    for (i = 0; i < tupdesc->natts; i++) {
+        Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+
+        if (!attr->attisdropped && strcmp(NameStr(attr->attname), attname) == 0)
+            return attr;
+    }
+    return NULL;
+}
+
+/*
+ * Кодировки колонок из bin_column_config. Колонка, которой больше нет
+ * (переименована или удалена), - ошибка: иначе её поле молча читалось
+ * бы как значение в собственном формате типа.
+ */
+static void
+config_load_columns(TableBinaryLayout *layout, Oid nspoid)
+{
+    StringInfoData query;
+    Oid argtypes[1] = {REGCLASSOID};
+    Datum args[1];
+    int ret;
+    uint64 i;
+
+    if (!OidIsValid(get_relname_relid("bin_column_config", nspoid)))
+        return;
+
+    initStringInfo(&query);
+    appendStringInfo(&query, "SELECT attname::text, encoding, param FROM %s.bin_column_config WHERE relid = $1",
+                     quote_identifier(get_namespace_name(nspoid)));
+
+    args[0] = ObjectIdGetDatum(layout->relid);
+    ret = SPI_execute_with_args(query.data, 1, argtypes, args, NULL, true, 0);
+    if (ret != SPI_OK_SELECT)
+        elog(ERROR, "[BINMAPPER] could not read bin_column_config: %s", SPI_result_code_string(ret));
+
+    for (i = 0; i < SPI_processed; i++) {
+        HeapTuple tuple = SPI_tuptable->vals[i];
+        TupleDesc tupdesc = SPI_tuptable->tupdesc;
+        char *attname = SPI_getvalue(tuple, tupdesc, 1);
+        Form_pg_attribute attr = config_find_column(layout->tupdesc, attname);
+        bool param_isnull;
+        int32 param = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 3, &param_isnull));
+
+        if (attr == NULL)
+            ereport(ERROR,
+                    (errcode(ERRCODE_UNDEFINED_COLUMN),
+                     errmsg("column \"%s\" of relation \"%s\" does not exist",
+                            attname, get_rel_name(layout->relid)),
+                     errdetail("The column is listed in bin_column_config.")));
+
+        if (layout->columns == NULL)
+            layout->columns = (BinColumnConfig *)
+                MemoryContextAllocZero(layout->cxt, layout->tupdesc->natts * sizeof(BinColumnConfig));
+        bin_column_encoding(attr, SPI_getvalue(tuple, tupdesc, 2), param, param_isnull,
+                            &layout->columns[attr->attnum - 1]);
+    }
+}
+
+/*
+ * Заполняет настройки layout значениями из bin_layout_config или
+ * значениями по умолчанию, если расширение не создано в базе (модуль
+ * загружен только как библиотека) или ещё не обновлено до версии с
+ * этой таблицей.
+ */
+void
+bin_config_load(TableBinaryLayout *layout)
+{
+    Oid nspoid;
+    Oid argtypes[1] = {REGCLASSOID};
+    Datum args[1];
+    StringInfoData query;
+    bool isnull;
+    int ret;
+
+    layout->little_endian = false;
+    layout->null_bitmap = false;
+    layout->framing = BIN_FRAMING_AUTO;
+
+    if (!OidIsValid(get_extension_oid("pg_binmapper", true)))
+        return;
+
+    SPI_connect();
+
+    nspoid = bin_extension_namespace();
+    if (!OidIsValid(nspoid) || !OidIsValid(get_relname_relid("bin_layout_config", nspoid))) {
+        SPI_finish();
+        return;
+    }
+
+    initStringInfo(&query);
+    appendStringInfo(&query, "SELECT byte_order, null_bitmap, framing FROM %s.bin_layout_config WHERE relid = $1",
+                     quote_identifier(get_namespace_name(nspoid)));
+
+    args[0] = ObjectIdGetDatum(layout->relid);
+    ret = SPI_execute_with_args(query.data, 1, argtypes, args, NULL, true, 1);
+    if (ret != SPI_OK_SELECT)
+        elog(ERROR, "[BINMAPPER] could not read bin_layout_config: %s", SPI_result_code_string(ret));
+
+    if (SPI_processed == 1) {
+        char *byte_order = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+        char *framing = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 3);
+
+        layout->little_endian = (byte_order != NULL && strcmp(byte_order, "little") == 0);
+        layout->null_bitmap = DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0],
+                                                         SPI_tuptable->tupdesc, 2, &isnull));
+        if (framing != NULL && strcmp(framing, "always") == 0)
+            layout->framing = BIN_FRAMING_ALWAYS;
+        else if (framing != NULL && strcmp(framing, "never") == 0)
+            layout->framing = BIN_FRAMING_NEVER;
+    }
+
+    config_load_columns(layout, nspoid);
+
+    SPI_finish();
+}
+
+/* Разрешено только владельцу таблицы relid; проверяется текущий пользователь */
+static void
+config_check_owner(Oid relid)
+{
+#if PG_VERSION_NUM >= 160000
+    if (!object_ownercheck(RelationRelationId, relid, GetUserId()))
+#else
+    if (!pg_class_ownercheck(relid, GetUserId()))
+#endif
+        aclcheck_error(ACLCHECK_NOT_OWNER, get_relkind_objtype(get_rel_relkind(relid)),
+                       get_rel_name(relid));
+}
+
+/*
+ * Выполняет запись query_fmt в таблицу настроек table от имени её
+ * владельца. %s в query_fmt - схема расширения. Пользователь и
+ * search_path меняются только на время запроса, как для SECURITY
+ * DEFINER функции с SET search_path; при ошибке их восстанавливает
+ * откат транзакции.
+ */
+static void
+config_write(const char *table, const char *query_fmt, int nargs, Oid *argtypes,
+             Datum *args, const char *nulls)
+{
+    Oid nspoid;
+    Oid cfgrelid;
+    Oid cfgowner;
+    Oid save_userid;
+    int save_sec_context;
+    int save_nestlevel;
+    Relation cfgrel;
+    StringInfoData query;
+    int ret;
+
+    SPI_connect();
+
+    nspoid = bin_extension_namespace();
+    cfgrelid = OidIsValid(nspoid) ? get_relname_relid(table, nspoid) : InvalidOid;
+    if (!OidIsValid(cfgrelid))
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_TABLE),
+                 errmsg("relation \"%s\" does not exist", table),
+                 errhint("Update the extension with ALTER EXTENSION pg_binmapper UPDATE.")));
+
+    cfgrel = table_open(cfgrelid, AccessShareLock);
+    cfgowner = cfgrel->rd_rel->relowner;
+    table_close(cfgrel, AccessShareLock);
+
+    initStringInfo(&query);
+    appendStringInfo(&query, query_fmt, quote_identifier(get_namespace_name(nspoid)));
+
+    GetUserIdAndSecContext(&save_userid, &save_sec_context);
+    SetUserIdAndSecContext(cfgowner, save_sec_context | SECURITY_LOCAL_USERID_CHANGE |
+                           SECURITY_RESTRICTED_OPERATION);
+    save_nestlevel = NewGUCNestLevel();
+    (void) set_config_option("search_path", "pg_catalog, pg_temp", PGC_USERSET, PGC_S_SESSION,
+                             GUC_ACTION_SAVE, true, 0, false);
+
+    ret = SPI_execute_with_args(query.data, nargs, argtypes, args, nulls, false, 0);
+
+    AtEOXact_GUC(false, save_nestlevel);
+    SetUserIdAndSecContext(save_userid, save_sec_context);
+
+    if (ret != SPI_OK_INSERT)
+        elog(ERROR, "[BINMAPPER] could not write %s: %s", table, SPI_result_code_string(ret));
+
+    SPI_finish();
+}
+
+PG_FUNCTION_INFO_V1(bin_register_layout);
+
+/*
+ * bin_register_layout(regclass, text, bool, text) - записывает настройки
+ * таблицы в bin_layout_config. Допустимые значения проверяют ограничения
+ * таблицы.
+ */
+Datum
+bin_register_layout(PG_FUNCTION_ARGS)
+{
+    Oid relid = PG_GETARG_OID(0);
+    Oid argtypes[4] = {REGCLASSOID, TEXTOID, BOOLOID, TEXTOID};
+    Datum args[4];
+
+    config_check_owner(relid);
+
+    args[0] = ObjectIdGetDatum(relid);
+    args[1] = PG_GETARG_DATUM(1);
+    args[2] = PG_GETARG_DATUM(2);
+    args[3] = PG_GETARG_DATUM(3);
+    config_write("bin_layout_config",
+                 "INSERT INTO %s.bin_layout_config AS c (relid, byte_order, null_bitmap, framing) "
+                 "VALUES ($1, $2, $3, $4) "
+                 "ON CONFLICT (relid) DO UPDATE "
+                 "SET byte_order = EXCLUDED.byte_order, null_bitmap = EXCLUDED.null_bitmap, "
+                 "framing = EXCLUDED.framing",
+                 4, argtypes, args, NULL);
+
+    CacheInvalidateRelcacheByRelid(relid);
+
+    PG_RETURN_VOID();
+}
+
+/*
+ * Проверяет кодировку до записи в bin_column_config, чтобы ошибка пришла
+ * сразу, а не при первом разборе пачки.
+ */
+static void
+config_check_column(Oid relid, const char *attname, const char *encoding, int32 param,
+                    bool param_isnull)
+{
+    Relation rel;
+    Form_pg_attribute attr;
+    BinColumnConfig config;
+
+    rel = table_open(relid, AccessShareLock);
+    attr = config_find_column(RelationGetDescr(rel), attname);
+    if (attr == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_COLUMN),
+                 errmsg("column \"%s\" of relation \"%s\" does not exist",
+                        attname, RelationGetRelationName(rel))));
+
+    bin_column_encoding(attr, encoding, param, param_isnull, &config);
+
+    table_close(rel, AccessShareLock);
+}
+
+PG_FUNCTION_INFO_V1(bin_register_column);
+
+/*
+ * bin_register_column(regclass, name, text, int) - записывает кодировку
+ * колонки в bin_column_config. param может быть NULL.
+ */
+Datum
+bin_register_column(PG_FUNCTION_ARGS)
+{
+    Oid relid;
+    Oid argtypes[4] = {REGCLASSOID, NAMEOID, TEXTOID, INT4OID};
+    Datum args[4];
+    char nulls[4] = {' ', ' ', ' ', ' '};
+
+    if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2))
+        ereport(ERROR,
+                (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                 errmsg("target_table, column_name and encoding must not be NULL")));
+
+    relid = PG_GETARG_OID(0);
+    config_check_owner(relid);
+    config_check_column(relid, NameStr(*PG_GETARG_NAME(1)), text_to_cstring(PG_GETARG_TEXT_PP(2)),
+                        PG_ARGISNULL(3) ? 0 : PG_GETARG_INT32(3), PG_ARGISNULL(3));
+
+    args[0] = ObjectIdGetDatum(relid);
+    args[1] = PG_GETARG_DATUM(1);
+    args[2] = PG_GETARG_DATUM(2);
+    args[3] = PG_ARGISNULL(3) ? (Datum) 0 : PG_GETARG_DATUM(3);
+    if (PG_ARGISNULL(3))
+        nulls[3] = 'n';
+    config_write("bin_column_config",
+                 "INSERT INTO %s.bin_column_config AS c (relid, attname, encoding, param) "
+                 "VALUES ($1, $2, $3, $4) "
+                 "ON CONFLICT (relid, attname) DO UPDATE "
+                 "SET encoding = EXCLUDED.encoding, param = EXCLUDED.param",
+                 4, argtypes, args, nulls);
+
+    CacheInvalidateRelcacheByRelid(relid);
+
+    PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(bin_check_column_encoding);
+
+/*
+ * bin_check_column_encoding(regclass, name, text, int) - проверяет
+ * кодировку до записи в bin_column_config, чтобы ошибка пришла сразу, а
+ * не при первом разборе пачки. NULL в первых трёх аргументах оставляет
+ * ошибку ограничениям таблицы.
+ */
+Datum
+bin_check_column_encoding(PG_FUNCTION_ARGS)
+{
+    if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2))
+        PG_RETURN_VOID();
+
+    config_check_column(PG_GETARG_OID(0), NameStr(*PG_GETARG_NAME(1)),
+                        text_to_cstring(PG_GETARG_TEXT_PP(2)),
+                        PG_ARGISNULL(3) ? 0 : PG_GETARG_INT32(3), PG_ARGISNULL(3));
+
+    PG_RETURN_VOID();
+}
+
+
+PG_FUNCTION_INFO_V1(bin_invalidate_layout);
+
+/*
+ * bin_invalidate_layout(regclass) - сбрасывает layout таблицы во всех
+ * backend-ах после коммита. Разрешено только владельцу таблицы.
+ */
+Datum
+bin_invalidate_layout(PG_FUNCTION_ARGS)
+{
+    Oid relid = PG_GETARG_OID(0);
+
+    config_check_owner(relid);
+    CacheInvalidateRelcacheByRelid(relid);
+
+    PG_RETURN_VOID();
+}
@@ -0,0 +1,422 @@
+/*
+ * binmapper_copy.c
+ *		COPY ... FROM ... WITH (FORMAT 'binmapper').
+ *
+ * В ядре нет API для сторонних форматов COPY, поэтому оператор
+ * перехватывается в ProcessUtility_hook до standard_ProcessUtility.
+ * Протокол COPY IN (CopyInResponse, затем CopyData/CopyDone/CopyFail)
+ * обслуживается здесь же; данные режутся на записи потоком и уходят в
+ * тот же путь table_multi_insert, что и у bin_copy_into, без сборки
+ * одного большого bytea.
+ */
+#include "postgres.h"
+
+#include "access/table.h"
+#include "access/xact.h"
+#include "catalog/pg_authid.h"
+#include "commands/defrem.h"
+#include "libpq/libpq.h"
+#include "libpq/pqformat.h"
+#include "miscadmin.h"
+#include "nodes/parsenodes.h"
+#include "storage/fd.h"
+#include "tcop/cmdtag.h"
+#include "tcop/tcopprot.h"
+#include "tcop/utility.h"
+#include "utils/acl.h"
+#include "utils/rel.h"
+
+#include "pg_binmapper.h"
+
+/* Размер порции при чтении файла на сервере */
+#define BIN_COPY_FILE_CHUNK 65536
+
+static ProcessUtility_hook_type prev_ProcessUtility = NULL;
+
+typedef struct {
+    BinBulkInsert *bi;
+    BinRejects rj;
+    uint64 nrecords;            /* номер текущей записи для bin_dead_letter */
+} BinCopyState;
+
+void
+bin_stream_init(BinRecordStream *stream, TableBinaryLayout *layout,
+                BinRecordCallback callback, void *callback_arg)
+{
+    if (layout->total_binary_size <= 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("table %u has no columns to map", layout->relid)));
+
+    stream->layout = layout;
+    stream->callback = callback;
+    stream->callback_arg = callback_arg;
+    initStringInfo(&stream->carry);
+    stream->nrecords = 0;
+    stream->nbytes = 0;
+}
+
+/*
+ * Отдаёт в callback все целые записи из очередной порции. Запись,
+ * разрезанная границей порций, собирается в carry; остальные
+ * передаются указателем прямо в буфер вызывающего. Длину записи с
+ * varlena-колонками можно узнать только по её trailer, поэтому в carry
+ * сначала добирается фиксированная часть, а затем остаток записи.
+ */
+void
+bin_stream_feed(BinRecordStream *stream, const char *data, Size len)
+{
+    TableBinaryLayout *layout = stream->layout;
+    int64 rec_size;
+
+    stream->nbytes += len;
+
+    while (len > 0) {
+        CHECK_FOR_INTERRUPTS();
+
+        if (stream->carry.len > 0) {
+            Size take;
+
+            rec_size = bin_record_size(layout, stream->carry.data, stream->carry.len);
+            if (rec_size < 0)
+                rec_size = layout->total_binary_size;
+            take = Min((Size) (rec_size - stream->carry.len), len);
+
+            appendBinaryStringInfo(&stream->carry, data, (int) take);
+            data += take;
+            len -= take;
+
+            /* Фиксированная часть могла только что дополниться до конца */
+            rec_size = bin_record_size(layout, stream->carry.data, stream->carry.len);
+            if (rec_size == stream->carry.len) {
+                stream->callback(stream->callback_arg, stream->carry.data);
+                stream->nrecords++;
+                resetStringInfo(&stream->carry);
+            }
+            continue;
+        }
+
+        rec_size = bin_record_size(layout, data, len);
+        if (rec_size < 0 || (Size) rec_size > len) {
+            appendBinaryStringInfo(&stream->carry, data, (int) len);
+            break;
+        }
+
+        stream->callback(stream->callback_arg, data);
+        stream->nrecords++;
+        data += rec_size;
+        len -= rec_size;
+    }
+}
+
+/*
+ * Конец потока: недособранная запись означает обрезанные данные.
+ */
+void
+bin_stream_finish(BinRecordStream *stream)
+{
+    if (stream->carry.len > 0) {
+        bin_stats_count_error(stream->layout);
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                 errmsg("SIZE ERROR: stream of " UINT64_FORMAT " bytes ends in the middle of record " UINT64_FORMAT,
+                        stream->nbytes, stream->nrecords + 1)));
+    }
+
+    pfree(stream->carry.data);
+    stream->carry.data = NULL;
+}
+
+static void
+bin_copy_add_record(void *arg, const char *raw_ptr)
+{
+    BinCopyState *cstate = (BinCopyState *) arg;
+
+    if (!bin_reject_record(&cstate->rj, raw_ptr, ++cstate->nrecords))
+        bin_bulk_add_record(cstate->bi, raw_ptr);
+}
+
+static bool
+bin_copy_is_binmapper(CopyStmt *stmt)
+{
+    ListCell *lc;
+
+    foreach(lc, stmt->options) {
+        DefElem *defel = lfirst_node(DefElem, lc);
+
+        if (strcmp(defel->defname, "format") == 0)
+            return strcmp(defGetString(defel), "binmapper") == 0;
+    }
+    return false;
+}
+
+static void
+bin_copy_check_stmt(CopyStmt *stmt)
+{
+    ListCell *lc;
+
+    if (!stmt->is_from)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("COPY TO is not supported with FORMAT binmapper")));
+    if (stmt->relation == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("COPY FROM with FORMAT binmapper requires a table")));
+    if (stmt->attlist != NIL)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("column lists are not supported with FORMAT binmapper"),
+                 errdetail("The payload always maps onto every column of the table.")));
+    if (stmt->whereClause != NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("WHERE is not supported with FORMAT binmapper")));
+    if (stmt->is_program)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("COPY FROM PROGRAM is not supported with FORMAT binmapper")));
+
+    foreach(lc, stmt->options) {
+        DefElem *defel = lfirst_node(DefElem, lc);
+
+        if (strcmp(defel->defname, "format") != 0 && strcmp(defel->defname, "on_error") != 0)
+            ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("COPY option \"%s\" is not supported with FORMAT binmapper",
+                            defel->defname)));
+    }
+
+    if (stmt->filename != NULL &&
+        !has_privs_of_role(GetUserId(), ROLE_PG_READ_SERVER_FILES))
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("permission denied to COPY from a file"),
+                 errdetail("Only roles with privileges of the \"%s\" role may COPY from a file.",
+                           "pg_read_server_files"),
+                 errhint("Anyone can COPY from stdin. psql's \\copy command also works for anyone.")));
+}
+
+/*
+ * CopyInResponse: бинарный формат, все колонки бинарные. psql по этому
+ * флагу отправляет файл \copy как есть, без построчной обработки.
+ */
+static void
+bin_copy_send_begin(int natts)
+{
+    StringInfoData buf;
+    int i;
+
+    pq_beginmessage(&buf, 'G');
+    pq_sendbyte(&buf, 1);
+    pq_sendint16(&buf, natts);
+    for (i = 0; i < natts; i++)
+        pq_sendint16(&buf, 1);
+    pq_endmessage(&buf);
+    pq_flush();
+}
+
+/*
+ * Читает CopyData до CopyDone так же, как CopyGetData в copyfromparse.c.
+ */
+static void
+bin_copy_from_client(BinRecordStream *stream)
+{
+    StringInfoData msgbuf;
+
+    initStringInfo(&msgbuf);
+
+    for (;;) {
+        int mtype;
+        int maxmsglen;
+
+        CHECK_FOR_INTERRUPTS();
+
+        HOLD_CANCEL_INTERRUPTS();
+        pq_startmsgread();
+        mtype = pq_getbyte();
+        if (mtype == EOF)
+            ereport(ERROR,
+                    (errcode(ERRCODE_CONNECTION_FAILURE),
+                     errmsg("unexpected EOF on client connection with an open transaction")));
+        switch (mtype) {
+            case 'd':   /* CopyData */
+                maxmsglen = PQ_LARGE_MESSAGE_LIMIT;
+                break;
+            case 'c':   /* CopyDone */
+            case 'f':   /* CopyFail */
+            case 'H':   /* Flush */
+            case 'S':   /* Sync */
+                maxmsglen = PQ_SMALL_MESSAGE_LIMIT;
+                break;
+            default:
+                ereport(ERROR,
+                        (errcode(ERRCODE_PROTOCOL_VIOLATION),
+                         errmsg("unexpected message type 0x%02X during COPY from stdin",
+                                mtype)));
+                maxmsglen = 0;  /* keep compiler quiet */
+                break;
+        }
+        if (pq_getmessage(&msgbuf, maxmsglen))
+            ereport(ERROR,
+                    (errcode(ERRCODE_CONNECTION_FAILURE),
+                     errmsg("unexpected EOF on client connection with an open transaction")));
+        RESUME_CANCEL_INTERRUPTS();
+
+        switch (mtype) {
+            case 'd':
+                bin_stream_feed(stream, msgbuf.data, msgbuf.len);
+                break;
+            case 'c':
+                pfree(msgbuf.data);
+                return;
+            case 'f':
+                ereport(ERROR,
+                        (errcode(ERRCODE_QUERY_CANCELED),
+                         errmsg("COPY from stdin failed: %s",
+                                pq_getmsgstring(&msgbuf))));
+                break;
+            default:
+                /* Flush и Sync внутри COPY игнорируются, как в ядре */
+                break;
+        }
+    }
+}
+
+static void
+bin_copy_from_file(BinRecordStream *stream, const char *filename)
+{
+    FILE *fp;
+    char *buf;
+    size_t nread;
+
+    fp = AllocateFile(filename, PG_BINARY_R);
+    if (fp == NULL)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not open file \"%s\" for reading: %m", filename)));
+
+    buf = palloc(BIN_COPY_FILE_CHUNK);
+    while ((nread = fread(buf, 1, BIN_COPY_FILE_CHUNK, fp)) > 0)
+        bin_stream_feed(stream, buf, nread);
+
+    if (ferror(fp))
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not read from COPY file: %m")));
+
+    FreeFile(fp);
+    pfree(buf);
+}
+
+/*
+ * Значение ON_ERROR; по умолчанию abort, как у обычного COPY.
+ */
+static BinOnError
+bin_copy_on_error(CopyStmt *stmt)
+{
+    ListCell *lc;
+
+    foreach(lc, stmt->options) {
+        DefElem *defel = lfirst_node(DefElem, lc);
+
+        if (strcmp(defel->defname, "on_error") == 0)
+            return bin_on_error_parse(defGetString(defel));
+    }
+    return BIN_ON_ERROR_ABORT;
+}
+
+static uint64
+bin_copy_from(CopyStmt *stmt)
+{
+    Relation rel;
+    TableBinaryLayout *layout;
+    BinCopyState cstate;
+    BinRecordStream stream;
+    BinOnError on_error;
+    uint64 processed;
+    instr_time start_time;
+
+    bin_copy_check_stmt(stmt);
+    on_error = bin_copy_on_error(stmt);
+
+    if (stmt->filename == NULL && whereToSendOutput != DestRemote)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("COPY FROM STDIN with FORMAT binmapper requires a client connection")));
+
+    rel = table_openrv(stmt->relation, RowExclusiveLock);
+
+    /* Проверки, которые для обычного COPY делают standard_ProcessUtility и DoCopy */
+    if (XactReadOnly && !rel->rd_islocaltemp)
+        PreventCommandIfReadOnly("COPY FROM");
+    PreventCommandIfParallelMode("COPY FROM");
+
+    cstate.bi = bin_bulk_begin(rel);
+    cstate.nrecords = 0;
+    layout = get_or_create_layout(RelationGetRelid(rel));
+    bin_rejects_init(&cstate.rj, layout, on_error);
+    bin_stream_init(&stream, layout, bin_copy_add_record, &cstate);
+
+    INSTR_TIME_SET_ZERO(start_time);
+    if (bin_track_timing) INSTR_TIME_SET_CURRENT(start_time);
+
+    if (stmt->filename == NULL) {
+        bin_copy_send_begin(layout->nops);
+        bin_copy_from_client(&stream);
+    } else {
+        bin_copy_from_file(&stream, stmt->filename);
+    }
+
+    bin_stream_finish(&stream);
+    processed = bin_bulk_finish(cstate.bi);
+
+    if (bin_track_timing) bin_stats_count_decode_time(layout, start_time);
+
+    bin_count_parsed(layout, stream.nrecords - cstate.rj.nrejected, stream.nbytes);
+    bin_rejects_report(&cstate.rj);
+
+    table_close(rel, NoLock);
+
+    return processed;
+}
+
+static void
+bin_process_utility(PlannedStmt *pstmt, const char *queryString,
+                    bool readOnlyTree, ProcessUtilityContext context,
+                    ParamListInfo params, QueryEnvironment *queryEnv,
+                    DestReceiver *dest, QueryCompletion *qc)
+{
+    Node *parsetree = pstmt->utilityStmt;
+
+    /*
+     * Дальше по цепочке такой COPY не передаётся: standard_ProcessUtility
+     * не знает формата. Поэтому хуки, установленные до нас
+     * (pg_stat_statements, pgaudit, загруженные раньше), его не видят; хуки
+     * библиотек, загруженных позже, оборачивают этот и видят.
+     */
+    if (IsA(parsetree, CopyStmt) && bin_copy_is_binmapper((CopyStmt *) parsetree)) {
+        uint64 processed = bin_copy_from((CopyStmt *) parsetree);
+
+        if (qc)
+            SetQueryCompletion(qc, CMDTAG_COPY, processed);
+        return;
+    }
+
+    /* Цели bin_ingest_trigger держат таблицы открытыми и помешали бы DDL над ними */
+    bin_trigger_release_targets();
+
+    if (prev_ProcessUtility)
+        prev_ProcessUtility(pstmt, queryString, readOnlyTree, context,
+                            params, queryEnv, dest, qc);
+    else
+        standard_ProcessUtility(pstmt, queryString, readOnlyTree, context,
+                                params, queryEnv, dest, qc);
+}
+
+void
+bin_copy_init(void)
+{
+    prev_ProcessUtility = ProcessUtility_hook;
+    ProcessUtility_hook = bin_process_utility;
+}
@@ -0,0 +1,408 @@
+/*
+ * binmapper_encodings.c
+ *		Преобразования колонок, заданные через bin_register_column().
+ *
+ * По умолчанию поле записи - это значение типа в его внутреннем виде:
+ * timestamp в микросекундах от 2000-01-01, numeric текстом в области
+ * varlena. Продюсеру удобнее слать Unix-время, деньги целым числом
+ * копеек и строки фиксированной ширины, а переводить их в SQL
+ * (to_timestamp, деление numeric) выходит дороже самого разбора.
+ * Здесь каждому такому виду соответствует своя операция программы
+ * декодирования:
+ *
+ *   unix_days               date из int4 дней от 1970-01-01
+ *   unix_ms/unix_us/unix_ns timestamp, timestamptz из int8 Unix-времени
+ *   scaled                  numeric из int8, делённого на 10^param
+ *   fixed                   text, varchar, char(n), bytea из поля в param байт
+ *   array                   одномерный массив из param элементов 2, 4 или 8 байт
+ *
+ * Все они занимают место в фиксированной части записи, числа читаются в
+ * порядке байт layout.
+ */
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "common/int.h"
+#include "datatype/timestamp.h"
+#include "mb/pg_wchar.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/date.h"
+#include "utils/fmgrprotos.h"
+#include "utils/lsyscache.h"
+#include "utils/numeric.h"
+#include "utils/timestamp.h"
+
+#include "pg_binmapper.h"
+
+/* Разница эпох Unix и PostgreSQL */
+#define BIN_UNIX_EPOCH_DAYS (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE)
+
+static void
+encoding_mismatch(Form_pg_attribute attr, const char *encoding)
+{
+    ereport(ERROR,
+            (errcode(ERRCODE_DATATYPE_MISMATCH),
+             errmsg("encoding \"%s\" is not supported for column \"%s\" of type %s",
+                    encoding, NameStr(attr->attname), format_type_be(attr->atttypid))));
+}
+
+static int32
+encoding_param(Form_pg_attribute attr, const char *encoding, int32 param, bool param_isnull,
+               int32 min, int32 max)
+{
+    if (param_isnull || param < min || param > max)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("encoding \"%s\" of column \"%s\" requires param between %d and %d",
+                        encoding, NameStr(attr->attname), min, max)));
+    return param;
+}
+
+/*
+ * Переводит кодировку колонки из bin_column_config в операцию и ширину
+ * поля. ERROR, если кодировка не подходит к типу колонки.
+ */
+void
+bin_column_encoding(Form_pg_attribute attr, const char *encoding, int32 param,
+                    bool param_isnull, BinColumnConfig *config)
+{
+    Oid typid = attr->atttypid;
+
+    memset(config, 0, sizeof(BinColumnConfig));
+
+    if (strcmp(encoding, "native") == 0)
+        return;
+
+    config->converted = true;
+
+    if (strcmp(encoding, "unix_days") == 0) {
+        if (typid != DATEOID)
+            encoding_mismatch(attr, encoding);
+        config->opcode = BIN_OP_UNIX_DAYS;
+        config->len = 4;
+    } else if (strcmp(encoding, "unix_ms") == 0 || strcmp(encoding, "unix_us") == 0 ||
+               strcmp(encoding, "unix_ns") == 0) {
+        if (typid != TIMESTAMPOID && typid != TIMESTAMPTZOID)
+            encoding_mismatch(attr, encoding);
+        config->opcode = strcmp(encoding, "unix_ms") == 0 ? BIN_OP_UNIX_MS :
+            strcmp(encoding, "unix_us") == 0 ? BIN_OP_UNIX_US : BIN_OP_UNIX_NS;
+        config->len = 8;
+    } else if (strcmp(encoding, "scaled") == 0) {
+        if (typid != NUMERICOID)
+            encoding_mismatch(attr, encoding);
+        config->opcode = BIN_OP_SCALED;
+        config->len = 8;
+        config->arg = encoding_param(attr, encoding, param, param_isnull,
+                                     0, NUMERIC_MAX_DISPLAY_SCALE);
+    } else if (strcmp(encoding, "fixed") == 0) {
+        if (typid == BYTEAOID)
+            config->opcode = BIN_OP_FIXED_BYTEA;
+        else if (typid == TEXTOID || typid == VARCHAROID || typid == BPCHAROID)
+            config->opcode = BIN_OP_FIXED_TEXT;
+        else
+            encoding_mismatch(attr, encoding);
+        config->len = encoding_param(attr, encoding, param, param_isnull, 1, MaxAllocSize / 2);
+    } else if (strcmp(encoding, "array") == 0) {
+        Oid elemtype = get_element_type(typid);
+        int16 elemlen;
+        bool elembyval;
+        char elemalign;
+
+        if (!OidIsValid(elemtype))
+            encoding_mismatch(attr, encoding);
+        get_typlenbyvalalign(elemtype, &elemlen, &elembyval, &elemalign);
+
+        /* Элементы должны лежать в массиве впритык, как и в записи */
+        if (!elembyval ||
+            !((elemlen == 2 && elemalign == TYPALIGN_SHORT) ||
+              (elemlen == 4 && elemalign == TYPALIGN_INT) ||
+              (elemlen == 8 && elemalign == TYPALIGN_DOUBLE)))
+            encoding_mismatch(attr, encoding);
+
+        config->opcode = BIN_OP_ARRAY;
+        config->arg = encoding_param(attr, encoding, param, param_isnull, 1,
+                                     (int32) Min(MaxArraySize, MaxAllocSize / 16));
+        config->len = config->arg * elemlen;
+    } else {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid encoding \"%s\" for column \"%s\"", encoding,
+                        NameStr(attr->attname)),
+                 errhint("Valid encodings are \"native\", \"unix_days\", \"unix_ms\", \"unix_us\", "
+                         "\"unix_ns\", \"scaled\", \"fixed\" and \"array\".")));
+    }
+}
+
+/*
+ * Типы элементов для BIN_OP_ARRAY и флаг record_checks. Вызывается и
+ * для layout, взятого из реестра, как prepare_var_input.
+ */
+void
+bin_prepare_encodings(TableBinaryLayout *layout)
+{
+    int i;
+
+    layout->record_checks = false;
+
+    for (i = 0; i < layout->nops; i++) {
+        BinDecodeOp *op = &layout->ops[i];
+
+        if (op->opcode == BIN_OP_FIXED_TEXT ||
+            (op->opcode >= BIN_OP_UNIX_DAYS && op->opcode <= BIN_OP_UNIX_NS))
+            layout->record_checks = true;
+        if (op->opcode != BIN_OP_ARRAY)
+            continue;
+
+        if (layout->elem_types == NULL)
+            layout->elem_types = (Oid *) MemoryContextAllocZero(layout->cxt,
+                                                                layout->tupdesc->natts * sizeof(Oid));
+        layout->elem_types[op->attnum] =
+            get_element_type(TupleDescAttr(layout->tupdesc, op->attnum)->atttypid);
+    }
+}
+
+static inline bool
+encoding_swap(TableBinaryLayout *layout)
+{
+    return layout->little_endian != BIN_HOST_LITTLE_ENDIAN;
+}
+
+static inline int64
+read_int64(TableBinaryLayout *layout, const char *ptr)
+{
+    uint64 v;
+
+    memcpy(&v, ptr, 8);
+    return (int64) (encoding_swap(layout) ? pg_bswap64(v) : v);
+}
+
+static inline int32
+read_int32(TableBinaryLayout *layout, const char *ptr)
+{
+    uint32 v;
+
+    memcpy(&v, ptr, 4);
+    return (int32) (encoding_swap(layout) ? pg_bswap32(v) : v);
+}
+
+/* Unix-время поля в Timestamp; false, если результат вне диапазона timestamp */
+static bool
+unix_timestamp(TableBinaryLayout *layout, const BinDecodeOp *op, const char *field_ptr,
+               Timestamp *result)
+{
+    int64 v = read_int64(layout, field_ptr);
+
+    if (op->opcode == BIN_OP_UNIX_MS) {
+        if (pg_mul_s64_overflow(v, 1000, &v))
+            return false;
+    } else if (op->opcode == BIN_OP_UNIX_NS) {
+        /* С округлением вниз, чтобы и до 1970 года доли микросекунды отбрасывались к прошлому */
+        v = v / 1000 - (v % 1000 < 0 ? 1 : 0);
+    }
+
+    if (pg_sub_s64_overflow(v, BIN_UNIX_EPOCH_DAYS * USECS_PER_DAY, &v))
+        return false;
+
+    *result = v;
+    return IS_VALID_TIMESTAMP(v);
+}
+
+static bool
+unix_date(TableBinaryLayout *layout, const char *field_ptr, DateADT *result)
+{
+    int32 v;
+
+    if (pg_sub_s32_overflow(read_int32(layout, field_ptr), BIN_UNIX_EPOCH_DAYS, &v))
+        return false;
+
+    *result = v;
+    return IS_VALID_DATE(v);
+}
+
+/*
+ * Длина строки fixed-поля без хвостовых NUL (и пробелов для char(n)) и
+ * сколько пробелов дописать до char(n). Возвращает NULL или текст
+ * ошибки, её код - в *sqlstate.
+ */
+static char *
+fixed_text_length(Form_pg_attribute attr, const char *ptr, int32 *len, int32 *pad,
+                  int *sqlstate)
+{
+    int32 maxchars = attr->atttypmod - (int32) VARHDRSZ;
+    bool bpchar = (attr->atttypid == BPCHAROID);
+    int32 n = *len;
+    int nchars;
+
+    while (n > 0 && (ptr[n - 1] == '\0' || (bpchar && ptr[n - 1] == ' ')))
+        n--;
+    *len = n;
+    *pad = 0;
+
+    *sqlstate = ERRCODE_CHARACTER_NOT_IN_REPERTOIRE;
+    if (!pg_verifymbstr(ptr, n, true))
+        return psprintf("invalid byte sequence for encoding \"%s\"", GetDatabaseEncodingName());
+
+    if (attr->atttypmod < (int32) VARHDRSZ)
+        return NULL;
+
+    *sqlstate = ERRCODE_STRING_DATA_RIGHT_TRUNCATION;
+    nchars = pg_mbstrlen_with_len(ptr, n);
+    if (nchars > maxchars)
+        return psprintf("value too long for type %s(%d)",
+                        bpchar ? "character" : "character varying", maxchars);
+    if (bpchar)
+        *pad = maxchars - nchars;
+
+    return NULL;
+}
+
+static Datum
+decode_array(TableBinaryLayout *layout, const BinDecodeOp *op, const char *field_ptr)
+{
+    int width = op->len / op->arg;
+    Size nbytes = ARR_OVERHEAD_NONULLS(1) + op->len;
+    ArrayType *result = (ArrayType *) palloc(nbytes);
+    char *dst;
+
+    memset(result, 0, ARR_OVERHEAD_NONULLS(1));
+    SET_VARSIZE(result, nbytes);
+    result->ndim = 1;
+    result->dataoffset = 0;
+    result->elemtype = layout->elem_types[op->attnum];
+    ARR_DIMS(result)[0] = op->arg;
+    ARR_LBOUND(result)[0] = 1;
+    dst = ARR_DATA_PTR(result);
+
+    if (!encoding_swap(layout))
+        memcpy(dst, field_ptr, op->len);
+    else if (width == 8)
+        bin_bswap64_run(dst, field_ptr, op->arg);
+    else if (width == 4)
+        bin_bswap32_run(dst, field_ptr, op->arg);
+    else {
+        int i;
+
+        for (i = 0; i < op->arg; i++) {
+            uint16 v;
+
+            memcpy(&v, field_ptr + i * 2, 2);
+            v = pg_bswap16(v);
+            memcpy(dst + i * 2, &v, 2);
+        }
+    }
+
+    return PointerGetDatum(result);
+}
+
+/*
+ * Значение поля для операций преобразования. Память под by-reference
+ * значения выделяется в текущем контексте.
+ */
+Datum
+bin_decode_converted(TableBinaryLayout *layout, const BinDecodeOp *op, const char *field_ptr)
+{
+    Form_pg_attribute attr = TupleDescAttr(layout->tupdesc, op->attnum);
+
+    switch (op->opcode) {
+        case BIN_OP_UNIX_DAYS: {
+            DateADT d;
+
+            if (!unix_date(layout, field_ptr, &d))
+                ereport(ERROR,
+                        (errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+                         errmsg("date out of range")));
+            return DateADTGetDatum(d);
+        }
+        case BIN_OP_UNIX_MS:
+        case BIN_OP_UNIX_US:
+        case BIN_OP_UNIX_NS: {
+            Timestamp ts;
+
+            if (!unix_timestamp(layout, op, field_ptr, &ts))
+                ereport(ERROR,
+                        (errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+                         errmsg("timestamp out of range")));
+            return TimestampGetDatum(ts);
+        }
+        case BIN_OP_SCALED: {
+            Datum result = NumericGetDatum(int64_div_fast_to_numeric(read_int64(layout, field_ptr),
+                                                                     op->arg));
+
+            /* numeric(p, s): округление и проверка точности, как при приведении типа */
+            if (attr->atttypmod >= 0)
+                result = DirectFunctionCall2(numeric, result, Int32GetDatum(attr->atttypmod));
+            return result;
+        }
+        case BIN_OP_FIXED_TEXT: {
+            int32 len = op->len;
+            int32 pad;
+            int sqlstate;
+            char *reason = fixed_text_length(attr, field_ptr, &len, &pad, &sqlstate);
+            text *result;
+
+            if (reason != NULL)
+                ereport(ERROR, (errcode(sqlstate), errmsg("%s", reason)));
+
+            result = (text *) palloc(VARHDRSZ + len + pad);
+            SET_VARSIZE(result, VARHDRSZ + len + pad);
+            memcpy(VARDATA(result), field_ptr, len);
+            memset(VARDATA(result) + len, ' ', pad);
+            return PointerGetDatum(result);
+        }
+        case BIN_OP_FIXED_BYTEA: {
+            bytea *result = (bytea *) palloc(VARHDRSZ + op->len);
+
+            SET_VARSIZE(result, VARHDRSZ + op->len);
+            memcpy(VARDATA(result), field_ptr, op->len);
+            return PointerGetDatum(result);
+        }
+        case BIN_OP_ARRAY:
+            return decode_array(layout, op, field_ptr);
+    }
+
+    elog(ERROR, "[BINMAPPER] unexpected conversion opcode %d", op->opcode);
+    return (Datum) 0;
+}
+
+/*
+ * Мягкая проверка поля для bin_record_check: NULL или текст ошибки.
+ * Переполнение numeric(p, s) по-прежнему прерывает пачку.
+ */
+char *
+bin_check_converted(TableBinaryLayout *layout, const BinDecodeOp *op, const char *field_ptr)
+{
+    Form_pg_attribute attr = TupleDescAttr(layout->tupdesc, op->attnum);
+    char *reason = NULL;
+
+    switch (op->opcode) {
+        case BIN_OP_UNIX_DAYS: {
+            DateADT d;
+
+            if (!unix_date(layout, field_ptr, &d))
+                reason = "date out of range";
+            break;
+        }
+        case BIN_OP_UNIX_MS:
+        case BIN_OP_UNIX_US:
+        case BIN_OP_UNIX_NS: {
+            Timestamp ts;
+
+            if (!unix_timestamp(layout, op, field_ptr, &ts))
+                reason = "timestamp out of range";
+            break;
+        }
+        case BIN_OP_FIXED_TEXT: {
+            int32 len = op->len;
+            int32 pad;
+            int sqlstate;
+
+            reason = fixed_text_length(attr, field_ptr, &len, &pad, &sqlstate);
+            break;
+        }
+    }
+
+    if (reason == NULL)
+        return NULL;
+    return psprintf("%s in column \"%s\"", reason, NameStr(attr->attname));
+}
@@ -0,0 +1,599 @@
+/*
+ * binmapper_insert.c
+ *		Пакетная вставка разобранных записей прямо в таблицу.
+ *
+ * Записи раскладываются в переиспользуемые слоты и пишутся через
+ * table_multi_insert с BulkInsertState, как это делает COPY FROM.
+ * Индексы и ограничения (NOT NULL, CHECK) обслуживаются, триггеры нет:
+ * таблицы с триггерами на INSERT отклоняются в bin_target_check. Те же
+ * проверки и EState использует bin_ingest_trigger.
+ *
+ * Секционированную таблицу записи не проходят через ExecFindPartition:
+ * из записи читается только колонка ключа секционирования, по ней
+ * двоичным поиском по границам выбирается секция, и у каждой секции
+ * свой буфер слотов, который сбрасывается одним table_multi_insert.
+ * Открытые секции кэшируются на всё время вставки, а для секций по
+ * диапазону ещё и последняя найденная граница: записи временного ряда
+ * обычно идут в ту же секцию, что и предыдущая.
+ */
+#include "postgres.h"
+
+#include "access/heapam.h"
+#include "access/table.h"
+#include "access/tableam.h"
+#include "access/tupconvert.h"
+#include "access/xact.h"
+#include "catalog/catalog.h"
+#include "catalog/objectaddress.h"
+#include "executor/executor.h"
+#include "miscadmin.h"
+#include "nodes/parsenodes.h"
+#if PG_VERSION_NUM >= 160000
+#include "parser/parse_relation.h"
+#endif
+#include "partitioning/partbounds.h"
+#include "partitioning/partdesc.h"
+#include "utils/acl.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/partcache.h"
+#include "utils/rel.h"
+#include "utils/rls.h"
+
+#include "pg_binmapper.h"
+
+/* Столько же, сколько буферизует COPY FROM перед сбросом, на все секции вместе */
+#define BIN_BULK_MAX_BUFFERED 1000
+
+/* Таблица, в которую пишутся строки: сама цель или её секция */
+typedef struct BinBulkTarget {
+    Relation rel;
+    ResultRelInfo *resultRelInfo;
+    BulkInsertState bistate;
+    TupleConversionMap *map;    /* строка цели -> строка секции, NULL если совпадают */
+    bool direct;                /* слоты heap-кортежей из bin_form_tuple */
+    TupleTableSlot **slots;     /* BIN_BULK_MAX_BUFFERED штук */
+    int nslots;                 /* сколько слотов уже создано */
+    int nbuffered;
+} BinBulkTarget;
+
+/* Секционированная таблица: цель или промежуточный уровень */
+typedef struct BinPartRoute {
+    Relation rel;
+    PartitionKey key;
+    PartitionDesc desc;
+    int keyopno;                /* op колонки ключа в layout цели */
+    int last_offset;            /* последняя найденная граница диапазона, -2 - нет */
+    void **children;            /* по индексу секции: BinBulkTarget или BinPartRoute */
+} BinPartRoute;
+
+struct BinBulkInsert {
+    Relation rel;
+    TableBinaryLayout *layout;
+    EState *estate;
+    CommandId mycid;
+    MemoryContext cxt;          /* цели и маршруты, до bin_bulk_finish */
+    MemoryContext batch_cxt;    /* by-reference значения и кортежи до сброса буфера */
+    BinBulkTarget *target;      /* если цель - обычная таблица */
+    BinPartRoute *route;        /* если секционированная */
+    List *targets;              /* все открытые BinBulkTarget */
+    List *routes;               /* промежуточные уровни, кроме корня */
+    TupleTableSlot *root_slot;  /* строка цели перед преобразованием для секции */
+    int nbuffered;
+    uint64 processed;
+    uint64 insert_ns;           /* время сбросов буферов, с pg_binmapper.track_latency */
+};
+
+/*
+ * Триггеры и генерируемые колонки - то, что executor сделал бы при
+ * вставке, а прямая запись не делает. Проверяется и у каждой секции.
+ */
+static void
+target_check_insert(Relation rel)
+{
+    TriggerDesc *trigdesc = rel->trigdesc;
+
+    if (trigdesc &&
+        (trigdesc->trig_insert_before_row || trigdesc->trig_insert_after_row ||
+         trigdesc->trig_insert_instead_row || trigdesc->trig_insert_before_statement ||
+         trigdesc->trig_insert_after_statement))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("cannot bulk load into \"%s\" because it has INSERT triggers",
+                        RelationGetRelationName(rel)),
+                 errhint("Use INSERT ... SELECT FROM bin_parse_batch() instead.")));
+
+    if (rel->rd_att->constr && rel->rd_att->constr->has_generated_stored)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("cannot bulk load into \"%s\" because it has generated columns",
+                        RelationGetRelationName(rel))));
+}
+
+/*
+ * Проверяет, что в таблицу можно писать в обход executor-а.
+ * Секционированная таблица допустима, только если allow_partitioned:
+ * её секции проверяются, когда в них приходит первая запись.
+ */
+void
+bin_target_check(Relation rel, bool allow_partitioned)
+{
+    AclResult aclresult;
+    char relkind = rel->rd_rel->relkind;
+
+    if (relkind != RELKIND_RELATION &&
+        !(allow_partitioned && relkind == RELKIND_PARTITIONED_TABLE))
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("cannot bulk load into \"%s\"", RelationGetRelationName(rel)),
+                 errdetail(allow_partitioned ? "Only plain and partitioned tables are supported." :
+                           "Only plain tables are supported.")));
+
+    /* Суперпользователя ACL не остановит, а строки в каталог мимо DDL - порча */
+    if (IsCatalogRelation(rel))
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("cannot bulk load into system catalog \"%s\"",
+                        RelationGetRelationName(rel))));
+
+    aclresult = pg_class_aclcheck(RelationGetRelid(rel), GetUserId(), ACL_INSERT);
+    if (aclresult != ACLCHECK_OK)
+        aclcheck_error(aclresult, get_relkind_objtype(rel->rd_rel->relkind),
+                       RelationGetRelationName(rel));
+
+    if (check_enable_rls(RelationGetRelid(rel), InvalidOid, false) == RLS_ENABLED)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("cannot bulk load into \"%s\" with row-level security enabled",
+                        RelationGetRelationName(rel))));
+
+    target_check_insert(rel);
+}
+
+/*
+ * Можно ли вставлять в rel кортежи из bin_form_tuple как есть. Готовый
+ * HeapTuple без преобразования принимает только heap AM.
+ */
+bool
+bin_target_direct(Relation rel, TableBinaryLayout *layout)
+{
+    return layout->direct_form && rel->rd_tableam == GetHeapamTableAmRoutine();
+}
+
+/*
+ * EState с единственной целевой таблицей и открытыми индексами. Range
+ * table из одной таблицы нужен ExecConstraints для текста ошибок; так
+ * же поступает apply worker логической репликации.
+ */
+EState *
+bin_target_estate(Relation rel, CommandId mycid, ResultRelInfo **resultRelInfo)
+{
+    EState *estate;
+    ResultRelInfo *rri;
+    RangeTblEntry *rte;
+    List *perminfos = NIL;
+
+    estate = CreateExecutorState();
+
+    rte = makeNode(RangeTblEntry);
+    rte->rtekind = RTE_RELATION;
+    rte->relid = RelationGetRelid(rel);
+    rte->relkind = rel->rd_rel->relkind;
+    rte->rellockmode = RowExclusiveLock;
+#if PG_VERSION_NUM >= 180000
+    addRTEPermissionInfo(&perminfos, rte);
+    ExecInitRangeTable(estate, list_make1(rte), perminfos, bms_make_singleton(1));
+#elif PG_VERSION_NUM >= 160000
+    addRTEPermissionInfo(&perminfos, rte);
+    ExecInitRangeTable(estate, list_make1(rte), perminfos);
+#else
+    (void) perminfos;
+    ExecInitRangeTable(estate, list_make1(rte));
+#endif
+
+    rri = makeNode(ResultRelInfo);
+    InitResultRelInfo(rri, rel, 1, NULL, 0);
+    estate->es_opened_result_relations = lappend(estate->es_opened_result_relations, rri);
+    estate->es_output_cid = mycid;
+
+    if (rel->rd_rel->relkind == RELKIND_RELATION)
+        ExecOpenIndices(rri, false);
+
+    *resultRelInfo = rri;
+    return estate;
+}
+
+/*
+ * Состояние вставки в rel: сама цель (rri уже есть) или её секция.
+ */
+static BinBulkTarget *
+bulk_target_open(BinBulkInsert *bi, Relation rel, ResultRelInfo *rri)
+{
+    BinBulkTarget *target;
+    MemoryContext oldcxt = MemoryContextSwitchTo(bi->cxt);
+
+    target = (BinBulkTarget *) palloc0(sizeof(BinBulkTarget));
+    target->rel = rel;
+    target->slots = (TupleTableSlot **) palloc0(BIN_BULK_MAX_BUFFERED * sizeof(TupleTableSlot *));
+    target->bistate = GetBulkInsertState();
+
+    if (rri == NULL) {
+        /* Секция: в ошибках ограничений строка показывается в терминах цели */
+        rri = makeNode(ResultRelInfo);
+        InitResultRelInfo(rri, rel, 1, linitial(bi->estate->es_opened_result_relations), 0);
+        bi->estate->es_opened_result_relations =
+            lappend(bi->estate->es_opened_result_relations, rri);
+        ExecOpenIndices(rri, false);
+        target->map = convert_tuples_by_name(RelationGetDescr(bi->rel), RelationGetDescr(rel));
+    }
+    target->resultRelInfo = rri;
+
+    /* Строку секции с другим порядком колонок надо сначала преобразовать */
+    target->direct = target->map == NULL && bin_target_direct(rel, bi->layout);
+
+    bi->targets = lappend(bi->targets, target);
+    MemoryContextSwitchTo(oldcxt);
+
+    return target;
+}
+
+/*
+ * Маршрут по секционированной таблице rel. Ключ должен быть одной
+ * колонкой цели: её значение читается прямо из записи.
+ */
+static BinPartRoute *
+part_route_open(BinBulkInsert *bi, Relation rel)
+{
+    BinPartRoute *route;
+    PartitionKey key = RelationGetPartitionKey(rel);
+    AttrNumber attnum;
+    char *attname;
+    MemoryContext oldcxt;
+    int i;
+
+    if (key->partnatts != 1 || key->partattrs[0] == 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("cannot bulk load into \"%s\"", RelationGetRelationName(rel)),
+                 errdetail("Only partition keys made of a single column are supported."),
+                 errhint("Use INSERT ... SELECT FROM bin_parse_batch() instead.")));
+
+    oldcxt = MemoryContextSwitchTo(bi->cxt);
+
+    route = (BinPartRoute *) palloc0(sizeof(BinPartRoute));
+    route->rel = rel;
+    route->key = key;
+    route->desc = RelationGetPartitionDesc(rel, true);
+    route->children = (void **) palloc0(Max(route->desc->nparts, 1) * sizeof(void *));
+    route->last_offset = -2;
+
+    /* Номера колонок у уровней могут различаться, имена - нет */
+    attname = get_attname(RelationGetRelid(rel), key->partattrs[0], false);
+    attnum = get_attnum(RelationGetRelid(bi->rel), attname);
+    route->keyopno = -1;
+    for (i = 0; i < bi->layout->nops; i++)
+        if (bi->layout->ops[i].attnum == attnum - 1)
+            route->keyopno = i;
+    if (route->keyopno < 0)
+        elog(ERROR, "[BINMAPPER] partition key \"%s\" of \"%s\" is not in the layout",
+             attname, RelationGetRelationName(rel));
+
+    MemoryContextSwitchTo(oldcxt);
+
+    return route;
+}
+
+/*
+ * Индекс секции для значения ключа, как в get_partition_for_tuple, или
+ * -1. Если значение лежит между теми же границами диапазона, что и
+ * предыдущее, двоичный поиск не нужен.
+ */
+static int
+part_route_index(BinPartRoute *route, Datum value, bool isnull)
+{
+    PartitionKey key = route->key;
+    PartitionBoundInfo boundinfo = route->desc->boundinfo;
+    int part_index = -1;
+    int offset;
+    bool equal;
+
+    switch (key->strategy) {
+        case PARTITION_STRATEGY_HASH: {
+            uint64 hash = compute_partition_hash_value(1, key->partsupfunc, key->partcollation,
+                                                       &value, &isnull);
+
+            part_index = boundinfo->indexes[hash % boundinfo->nindexes];
+            break;
+        }
+        case PARTITION_STRATEGY_LIST:
+            if (isnull) {
+                part_index = boundinfo->null_index;
+                break;
+            }
+            offset = partition_list_bsearch(key->partsupfunc, key->partcollation, boundinfo,
+                                            value, &equal);
+            if (offset >= 0 && equal)
+                part_index = boundinfo->indexes[offset];
+            break;
+        case PARTITION_STRATEGY_RANGE:
+            if (isnull)
+                break;
+            offset = route->last_offset;
+            if (offset == -2 ||
+                (offset >= 0 &&
+                 partition_rbound_datum_cmp(key->partsupfunc, key->partcollation,
+                                            boundinfo->datums[offset], boundinfo->kind[offset],
+                                            &value, 1) > 0) ||
+                (offset + 1 < boundinfo->ndatums &&
+                 partition_rbound_datum_cmp(key->partsupfunc, key->partcollation,
+                                            boundinfo->datums[offset + 1],
+                                            boundinfo->kind[offset + 1], &value, 1) <= 0)) {
+                offset = partition_range_datum_bsearch(key->partsupfunc, key->partcollation,
+                                                       boundinfo, 1, &value, &equal);
+                route->last_offset = offset;
+            }
+            part_index = boundinfo->indexes[offset + 1];
+            break;
+    }
+
+    if (part_index < 0)
+        part_index = boundinfo->default_index;
+
+    return part_index;
+}
+
+/*
+ * Секция, в которую идёт запись, начиная с корня. Секции и
+ * промежуточные уровни открываются при первой записи в них.
+ */
+static BinBulkTarget *
+part_route_find(BinBulkInsert *bi, const char *raw_ptr)
+{
+    BinPartRoute *route = bi->route;
+
+    for (;;) {
+        Datum value;
+        bool isnull;
+        int part_index;
+        Relation rel;
+
+        value = bin_decode_column(bi->layout, raw_ptr, route->keyopno, &isnull);
+        part_index = part_route_index(route, value, isnull);
+        if (part_index < 0) {
+            Oid typoutput;
+            bool typisvarlena;
+
+            getTypeOutputInfo(route->key->parttypid[0], &typoutput, &typisvarlena);
+            ereport(ERROR,
+                    (errcode(ERRCODE_CHECK_VIOLATION),
+                     errmsg("no partition of relation \"%s\" found for row",
+                            RelationGetRelationName(route->rel)),
+                     errdetail("Partition key of the failing row contains (%s) = (%s).",
+                               get_attname(RelationGetRelid(route->rel),
+                                           route->key->partattrs[0], false),
+                               isnull ? "null" : OidOutputFunctionCall(typoutput, value))));
+        }
+
+        if (route->children[part_index] != NULL) {
+            if (route->desc->is_leaf[part_index])
+                return (BinBulkTarget *) route->children[part_index];
+            route = (BinPartRoute *) route->children[part_index];
+            continue;
+        }
+
+        rel = table_open(route->desc->oids[part_index], RowExclusiveLock);
+        if (route->desc->is_leaf[part_index]) {
+            if (rel->rd_rel->relkind != RELKIND_RELATION)
+                ereport(ERROR,
+                        (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                         errmsg("cannot bulk load into partition \"%s\" of \"%s\"",
+                                RelationGetRelationName(rel), RelationGetRelationName(bi->rel)),
+                         errdetail("Only plain tables are supported.")));
+            target_check_insert(rel);
+            route->children[part_index] = bulk_target_open(bi, rel, NULL);
+            return (BinBulkTarget *) route->children[part_index];
+        }
+
+        route->children[part_index] = part_route_open(bi, rel);
+        bi->routes = lappend(bi->routes, route->children[part_index]);
+        route = (BinPartRoute *) route->children[part_index];
+    }
+}
+
+/*
+ * Проверяет таблицу и готовит состояние вставки. rel должна быть
+ * открыта с RowExclusiveLock.
+ */
+BinBulkInsert *
+bin_bulk_begin(Relation rel)
+{
+    BinBulkInsert *bi;
+    ResultRelInfo *rri;
+
+    bin_target_check(rel, true);
+
+    bi = (BinBulkInsert *) palloc0(sizeof(BinBulkInsert));
+    bi->rel = rel;
+    bi->cxt = CurrentMemoryContext;
+    bi->layout = get_or_create_layout(RelationGetRelid(rel));
+    bi->mycid = GetCurrentCommandId(true);
+    bi->batch_cxt = AllocSetContextCreate(CurrentMemoryContext,
+                                          "bin_bulk_insert batch",
+                                          ALLOCSET_DEFAULT_SIZES);
+    bi->estate = bin_target_estate(rel, bi->mycid, &rri);
+
+    if (rel->rd_rel->relkind == RELKIND_PARTITIONED_TABLE)
+        bi->route = part_route_open(bi, rel);
+    else
+        bi->target = bulk_target_open(bi, rel, rri);
+
+    return bi;
+}
+
+static void
+bulk_target_flush(BinBulkInsert *bi, BinBulkTarget *target)
+{
+    ResultRelInfo *resultRelInfo = target->resultRelInfo;
+    MemoryContext oldcxt;
+    int i;
+
+    if (target->nbuffered == 0)
+        return;
+
+    oldcxt = MemoryContextSwitchTo(GetPerTupleMemoryContext(bi->estate));
+    table_multi_insert(target->rel, target->slots, target->nbuffered, bi->mycid, 0,
+                       target->bistate);
+    MemoryContextSwitchTo(oldcxt);
+
+    for (i = 0; i < target->nbuffered; i++) {
+        if (resultRelInfo->ri_NumIndices > 0) {
+            List *recheckIndexes;
+
+            recheckIndexes = ExecInsertIndexTuples(resultRelInfo, target->slots[i], bi->estate,
+                                                   false, false, NULL, NIL
+#if PG_VERSION_NUM >= 160000
+                                                   , false
+#endif
+                                                   );
+            list_free(recheckIndexes);
+        }
+        ExecClearTuple(target->slots[i]);
+    }
+
+    ResetPerTupleExprContext(bi->estate);
+    target->nbuffered = 0;
+}
+
+/* Сбрасывает буферы всех секций: значения в них живут в общем batch_cxt */
+static void
+bin_bulk_flush(BinBulkInsert *bi)
+{
+    ListCell *lc;
+    instr_time start_time;
+
+    if (bi->nbuffered == 0)
+        return;
+
+    BIN_PROBE2(bulk__flush, RelationGetRelid(bi->rel), bi->nbuffered);
+    bin_latency_mark(&start_time);
+
+    foreach(lc, bi->targets)
+        bulk_target_flush(bi, (BinBulkTarget *) lfirst(lc));
+
+    if (!INSTR_TIME_IS_ZERO(start_time)) {
+        instr_time elapsed;
+
+        INSTR_TIME_SET_CURRENT(elapsed);
+        INSTR_TIME_SUBTRACT(elapsed, start_time);
+        bi->insert_ns += BIN_INSTR_TIME_GET_NANOSEC(elapsed);
+    }
+
+    MemoryContextReset(bi->batch_cxt);
+    bi->nbuffered = 0;
+}
+
+/*
+ * Раскладывает запись в очередной слот её таблицы; когда буферы всех
+ * секций вместе заполнены, сбрасывает их, по table_multi_insert на каждую.
+ */
+void
+bin_bulk_add_record(BinBulkInsert *bi, const char *raw_ptr)
+{
+    BinBulkTarget *target;
+    TupleTableSlot *slot;
+    MemoryContext oldcxt;
+
+    if (bi->target)
+        target = bi->target;
+    else {
+        /* Ключ секционирования by-reference тоже живёт только до сброса буфера */
+        oldcxt = MemoryContextSwitchTo(bi->batch_cxt);
+        target = part_route_find(bi, raw_ptr);
+        MemoryContextSwitchTo(oldcxt);
+    }
+
+    /* Слоты живут до bin_bulk_finish, а batch_cxt сбрасывается при каждом сбросе буфера */
+    oldcxt = MemoryContextSwitchTo(bi->cxt);
+    if (target->nbuffered == target->nslots)
+        target->slots[target->nslots++] = target->direct ?
+            MakeSingleTupleTableSlot(RelationGetDescr(target->rel), &TTSOpsHeapTuple) :
+            table_slot_create(target->rel, NULL);
+    if (target->map && bi->root_slot == NULL)
+        bi->root_slot = MakeSingleTupleTableSlot(RelationGetDescr(bi->rel), &TTSOpsVirtual);
+    MemoryContextSwitchTo(bi->batch_cxt);
+
+    slot = target->slots[target->nbuffered];
+    ExecClearTuple(slot);
+    if (target->direct) {
+        /* Слот владеет кортежем, так что heap_multi_insert не копирует его ещё раз */
+        ExecStoreHeapTuple(bin_form_tuple(bi->layout, raw_ptr), slot, true);
+    } else if (target->map) {
+        /* Колонки секции идут в другом порядке, чем у цели */
+        ExecClearTuple(bi->root_slot);
+        bin_decode_record(bi->layout, raw_ptr, bi->root_slot->tts_values,
+                          bi->root_slot->tts_isnull, false);
+        ExecStoreVirtualTuple(bi->root_slot);
+        execute_attr_map_slot(target->map->attrMap, bi->root_slot, slot);
+    } else {
+        /* Запись может не дожить до сброса буфера (COPY), поэтому без inplace */
+        bin_decode_record(bi->layout, raw_ptr, slot->tts_values, slot->tts_isnull, false);
+        ExecStoreVirtualTuple(slot);
+    }
+    MemoryContextSwitchTo(oldcxt);
+
+    if (target->rel->rd_att->constr)
+        ExecConstraints(target->resultRelInfo, slot, bi->estate);
+
+    target->nbuffered++;
+    bi->processed++;
+    if (++bi->nbuffered == BIN_BULK_MAX_BUFFERED)
+        bin_bulk_flush(bi);
+}
+
+/* Сколько наносекунд ушло на сбросы буферов до сих пор */
+uint64
+bin_bulk_insert_ns(BinBulkInsert *bi)
+{
+    return bi->insert_ns;
+}
+
+/*
+ * Сбрасывает остаток буферов и освобождает состояние. Цель закрывает
+ * вызывающий, открытые здесь секции закрываются здесь. Время всех
+ * сбросов попадает в этап insert. Возвращает число вставленных строк.
+ */
+uint64
+bin_bulk_finish(BinBulkInsert *bi)
+{
+    uint64 processed;
+    ListCell *lc;
+
+    bin_bulk_flush(bi);
+    if (bin_track_latency && bi->processed > 0)
+        bin_stats_count_latency(bi->layout, BIN_STAGE_INSERT, bi->insert_ns);
+
+    foreach(lc, bi->targets) {
+        BinBulkTarget *target = (BinBulkTarget *) lfirst(lc);
+        int i;
+
+        for (i = 0; i < target->nslots; i++)
+            ExecDropSingleTupleTableSlot(target->slots[i]);
+        FreeBulkInsertState(target->bistate);
+        table_finish_bulk_insert(target->rel, 0);
+        ExecCloseIndices(target->resultRelInfo);
+        if (target->rel != bi->rel)
+            table_close(target->rel, NoLock);
+    }
+    foreach(lc, bi->routes)
+        table_close(((BinPartRoute *) lfirst(lc))->rel, NoLock);
+
+    if (bi->root_slot)
+        ExecDropSingleTupleTableSlot(bi->root_slot);
+    FreeExecutorState(bi->estate);
+    MemoryContextDelete(bi->batch_cxt);
+
+    processed = bi->processed;
+    pfree(bi);
+
+    return processed;
+}
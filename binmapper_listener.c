@@ -0,0 +1,686 @@
+/*
+ * binmapper_listener.c
+ *		Фоновый процесс, принимающий пачки через Unix-сокет, минуя SQL.
+ *
+ * На пути Kafka Connect -> JDBC -> bin_copy_into основное время уходит
+ * на протокол и разбор SQL, а не на саму вставку. Здесь сайдкар
+ * подключается к сокету pg_binmapper.listen_socket и шлёт сообщения
+ *
+ *   length u32 BE | relid u32 BE | пачка
+ *
+ * где length - длина relid и пачки, а пачка - то же, что payload у
+ * bin_copy_into: записи подряд или кадр BinFrame. Каждая пачка пишется
+ * через bin_copy_batch в своей подтранзакции, так что ошибка в ней не
+ * отменяет остальные. Пачки всех соединений копятся в одной транзакции
+ * (group commit): она фиксируется, как только набралось
+ * pg_binmapper.listen_batch_rows строк или прошло
+ * pg_binmapper.listen_flush_interval с первой пачки в ней.
+ *
+ * Ответы идут в порядке сообщений и только после фиксации транзакции:
+ *
+ *   'K' | rows u64 BE              - пачка вставлена и зафиксирована
+ *   'E' | length u32 BE | текст    - пачка отвергнута
+ *
+ * После 'K' сайдкар может подтверждать offset. Если соединение рвётся
+ * до ответа, уже принятые пачки всё равно фиксируются, так что доставка
+ * "хотя бы один раз", как и у JDBC sink.
+ *
+ * TCP нет намеренно: на сокете нет аутентификации, и доступ к нему
+ * задаётся правами файла (pg_binmapper.listen_socket_permissions).
+ * Права на таблицы проверяются от имени pg_binmapper.listen_role; роль
+ * обязательна и не может быть суперпользователем, иначе любой, кто
+ * может писать в сокет, обходит права и пишет хоть в каталоги.
+ */
+#include "postgres.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "access/xact.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#if PG_VERSION_NUM >= 180000
+#include "storage/waiteventset.h"
+#endif
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+
+#include "pg_binmapper.h"
+
+#define BIN_LISTEN_MAX_CLIENTS  64
+#define BIN_LISTEN_READ_CHUNK   (64 * 1024)
+/* relid и пачка; с запасом до MaxAllocSize на varlena и недочитанный хвост */
+#define BIN_LISTEN_MAX_MESSAGE  ((uint32) (MaxAllocSize / 2))
+
+typedef struct {
+    pgsocket sock;
+    StringInfoData in;          /* принятые байты; in.cursor - начало неразобранных */
+    StringInfoData out;         /* ответы к отправке; out.cursor - уже отправлено */
+    StringInfoData held;        /* ответы на пачки открытой транзакции */
+    int nheld;
+    bool want_write;            /* out не ушёл целиком, ждём WL_SOCKET_WRITEABLE */
+    bool broken;                /* закрыть в конце итерации цикла */
+} BinListenClient;
+
+static char *bin_listen_socket = NULL;
+static int bin_listen_socket_permissions = 0600;
+static char *bin_listen_database = NULL;
+static char *bin_listen_role = NULL;
+static int bin_listen_batch_rows = 10000;
+static int bin_listen_flush_interval = 100;
+
+static pgsocket listen_sock = PGINVALID_SOCKET;
+static BinListenClient *listen_clients[BIN_LISTEN_MAX_CLIENTS];
+static int listen_nclients = 0;
+static bool listen_set_dirty = true;    /* набор событий надо собрать заново */
+
+static MemoryContext listener_cxt = NULL;
+static MemoryContext listen_batch_cxt = NULL;
+
+/* Открытая транзакция группы */
+static bool listen_in_xact = false;
+static instr_time listen_group_start;
+static uint64 listen_group_rows = 0;
+
+static const char *
+show_listen_socket_permissions(void)
+{
+    static char buf[12];
+
+    snprintf(buf, sizeof(buf), "%04o", bin_listen_socket_permissions);
+    return buf;
+}
+
+void
+bin_listener_init(void)
+{
+    BackgroundWorker worker;
+
+    DefineCustomStringVariable("pg_binmapper.listen_socket",
+                               "Path of the Unix socket the ingest listener accepts batches on.",
+                               "Empty disables the listener.",
+                               &bin_listen_socket,
+                               "",
+                               PGC_POSTMASTER, 0,
+                               NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_binmapper.listen_socket_permissions",
+                            "Access permissions of the ingest listener socket.",
+                            NULL,
+                            &bin_listen_socket_permissions,
+                            0600, 0000, 0777,
+                            PGC_POSTMASTER, 0,
+                            NULL, NULL, show_listen_socket_permissions);
+
+    DefineCustomStringVariable("pg_binmapper.listen_database",
+                               "Database the ingest listener connects to.",
+                               NULL,
+                               &bin_listen_database,
+                               "postgres",
+                               PGC_POSTMASTER, 0,
+                               NULL, NULL, NULL);
+
+    DefineCustomStringVariable("pg_binmapper.listen_role",
+                               "Role the ingest listener inserts as.",
+                               "Must be set to a role that is not a superuser.",
+                               &bin_listen_role,
+                               "",
+                               PGC_POSTMASTER, 0,
+                               NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_binmapper.listen_batch_rows",
+                            "Rows after which the ingest listener commits.",
+                            NULL,
+                            &bin_listen_batch_rows,
+                            10000, 1, INT_MAX,
+                            PGC_SIGHUP, 0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_binmapper.listen_flush_interval",
+                            "Longest time the ingest listener holds a transaction open.",
+                            "Zero commits after every wakeup.",
+                            &bin_listen_flush_interval,
+                            100, 0, 3600 * 1000,
+                            PGC_SIGHUP, GUC_UNIT_MS,
+                            NULL, NULL, NULL);
+
+    if (!process_shared_preload_libraries_in_progress ||
+        bin_listen_socket == NULL || bin_listen_socket[0] == '\0')
+        return;
+
+    if (bin_listen_role == NULL || bin_listen_role[0] == '\0') {
+        ereport(WARNING,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("ingest listener not started: pg_binmapper.listen_role is not set"),
+                 errhint("Set pg_binmapper.listen_role to a role that is not a superuser.")));
+        return;
+    }
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    worker.bgw_restart_time = 5;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_binmapper");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "bin_listener_main");
+    snprintf(worker.bgw_name, BGW_MAXLEN, "pg_binmapper listener");
+    snprintf(worker.bgw_type, BGW_MAXLEN, "pg_binmapper listener");
+    RegisterBackgroundWorker(&worker);
+}
+
+static void
+listen_close_socket(int code, Datum arg)
+{
+    if (listen_sock == PGINVALID_SOCKET)
+        return;
+    closesocket(listen_sock);
+    listen_sock = PGINVALID_SOCKET;
+    unlink(bin_listen_socket);
+}
+
+/*
+ * Создаёт сокет. Оставшийся от прошлого запуска файл сокета удаляется,
+ * но только если это действительно сокет.
+ */
+static void
+listen_open_socket(void)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if (strlen(bin_listen_socket) >= sizeof(addr.sun_path))
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("pg_binmapper.listen_socket path \"%s\" is too long (maximum %d bytes)",
+                        bin_listen_socket, (int) sizeof(addr.sun_path) - 1)));
+
+    if (lstat(bin_listen_socket, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode))
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("pg_binmapper.listen_socket \"%s\" exists and is not a socket",
+                            bin_listen_socket)));
+        unlink(bin_listen_socket);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strlcpy(addr.sun_path, bin_listen_socket, sizeof(addr.sun_path));
+
+    listen_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_sock == PGINVALID_SOCKET)
+        ereport(ERROR,
+                (errcode_for_socket_access(),
+                 errmsg("could not create Unix socket: %m")));
+    on_proc_exit(listen_close_socket, (Datum) 0);
+
+    if (bind(listen_sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        ereport(ERROR,
+                (errcode_for_socket_access(),
+                 errmsg("could not bind Unix socket \"%s\": %m", bin_listen_socket)));
+    if (chmod(bin_listen_socket, bin_listen_socket_permissions) < 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not set permissions of socket \"%s\": %m", bin_listen_socket)));
+    if (listen(listen_sock, BIN_LISTEN_MAX_CLIENTS) < 0)
+        ereport(ERROR,
+                (errcode_for_socket_access(),
+                 errmsg("could not listen on Unix socket \"%s\": %m", bin_listen_socket)));
+    if (!pg_set_noblock(listen_sock))
+        ereport(ERROR,
+                (errcode_for_socket_access(),
+                 errmsg("could not set socket to nonblocking mode: %m")));
+
+    ereport(LOG,
+            (errmsg("pg_binmapper listener accepting batches on \"%s\"", bin_listen_socket)));
+}
+
+static void
+listen_accept(void)
+{
+    BinListenClient *client;
+    pgsocket sock;
+
+    sock = accept(listen_sock, NULL, NULL);
+    if (sock == PGINVALID_SOCKET) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            ereport(LOG,
+                    (errcode_for_socket_access(),
+                     errmsg("could not accept connection: %m")));
+        return;
+    }
+    if (!pg_set_noblock(sock)) {
+        ereport(LOG,
+                (errcode_for_socket_access(),
+                 errmsg("could not set socket to nonblocking mode: %m")));
+        closesocket(sock);
+        return;
+    }
+
+    client = (BinListenClient *) MemoryContextAllocZero(listener_cxt, sizeof(BinListenClient));
+    client->sock = sock;
+    MemoryContextSwitchTo(listener_cxt);
+    initStringInfo(&client->in);
+    initStringInfo(&client->out);
+    initStringInfo(&client->held);
+
+    listen_clients[listen_nclients++] = client;
+    listen_set_dirty = true;
+}
+
+/*
+ * Закрывает соединение. Его пачки в открытой транзакции остаются и
+ * будут зафиксированы вместе с остальными.
+ */
+static void
+listen_close_client(int i)
+{
+    BinListenClient *client = listen_clients[i];
+
+    closesocket(client->sock);
+    pfree(client->in.data);
+    pfree(client->out.data);
+    pfree(client->held.data);
+    pfree(client);
+
+    listen_clients[i] = listen_clients[--listen_nclients];
+    listen_set_dirty = true;
+}
+
+/* Отправляет сколько получится из out; false, если соединение мертво */
+static bool
+listen_send(BinListenClient *client)
+{
+    while (client->out.cursor < client->out.len) {
+        ssize_t n = send(client->sock, client->out.data + client->out.cursor,
+                         client->out.len - client->out.cursor, 0);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!client->want_write)
+                    listen_set_dirty = true;
+                client->want_write = true;
+                return true;
+            }
+            return false;
+        }
+        client->out.cursor += (int) n;
+    }
+
+    resetStringInfo(&client->out);
+    if (client->want_write)
+        listen_set_dirty = true;
+    client->want_write = false;
+    return true;
+}
+
+static void
+listen_hold_error(BinListenClient *client, const char *message)
+{
+    uint32 len = (uint32) strlen(message);
+    uint32 len_be = pg_hton32(len);
+
+    appendStringInfoChar(&client->held, 'E');
+    appendBinaryStringInfo(&client->held, (char *) &len_be, 4);
+    appendBinaryStringInfo(&client->held, message, (int) len);
+    client->nheld++;
+}
+
+static void
+listen_begin_group(void)
+{
+    if (listen_in_xact)
+        return;
+
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    MemoryContextSwitchTo(listener_cxt);
+
+    pgstat_report_activity(STATE_RUNNING, "ingesting batches");
+    INSTR_TIME_SET_CURRENT(listen_group_start);
+    listen_group_rows = 0;
+    listen_in_xact = true;
+}
+
+/*
+ * Фиксирует транзакцию группы и отдаёт клиентам отложенные ответы. Если
+ * фиксация не удалась, отвергнуты все пачки группы.
+ */
+static void
+listen_commit_group(void)
+{
+    char *volatile failure = NULL;
+    int i;
+
+    if (!listen_in_xact)
+        return;
+
+    PG_TRY();
+    {
+        PopActiveSnapshot();
+        CommitTransactionCommand();
+    }
+    PG_CATCH();
+    {
+        ErrorData *edata;
+
+        MemoryContextSwitchTo(listener_cxt);
+        edata = CopyErrorData();
+        FlushErrorState();
+        AbortCurrentTransaction();
+
+        ereport(WARNING,
+                (errmsg("pg_binmapper listener could not commit " UINT64_FORMAT " rows: %s",
+                        listen_group_rows, edata->message)));
+        failure = pstrdup(edata->message);
+        FreeErrorData(edata);
+    }
+    PG_END_TRY();
+
+    MemoryContextSwitchTo(listener_cxt);
+    listen_in_xact = false;
+
+    for (i = 0; i < listen_nclients; i++) {
+        BinListenClient *client = listen_clients[i];
+
+        if (failure != NULL) {
+            int n = client->nheld;
+
+            resetStringInfo(&client->held);
+            client->nheld = 0;
+            while (n-- > 0)
+                listen_hold_error(client, failure);
+        }
+
+        appendBinaryStringInfo(&client->out, client->held.data, client->held.len);
+        resetStringInfo(&client->held);
+        client->nheld = 0;
+
+        if (!listen_send(client))
+            client->broken = true;
+    }
+
+    if (failure != NULL)
+        pfree(failure);
+
+    pgstat_report_stat(false);
+    pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+/* Пора ли фиксировать группу: набрались строки или истёк интервал */
+static long
+listen_group_timeout(void)
+{
+    instr_time elapsed;
+    double ms;
+
+    if (!listen_in_xact)
+        return -1;
+    if (listen_group_rows >= (uint64) bin_listen_batch_rows)
+        return 0;
+
+    INSTR_TIME_SET_CURRENT(elapsed);
+    INSTR_TIME_SUBTRACT(elapsed, listen_group_start);
+    ms = INSTR_TIME_GET_MILLISEC(elapsed);
+
+    return ms >= bin_listen_flush_interval ? 0 : (long) (bin_listen_flush_interval - ms) + 1;
+}
+
+/* Вставляет одну пачку в подтранзакции, ответ откладывается до фиксации */
+static void
+listen_process_batch(BinListenClient *client, const char *msg, uint32 len)
+{
+    ResourceOwner oldowner;
+    struct varlena *payload;
+    volatile uint64 rows = 0;
+    char *volatile reason = NULL;
+    uint32 relid_be;
+    Oid relid;
+
+    memcpy(&relid_be, msg, 4);
+    relid = (Oid) pg_ntoh32(relid_be);
+
+    listen_begin_group();
+    oldowner = CurrentResourceOwner;
+
+    MemoryContextSwitchTo(listen_batch_cxt);
+    payload = (struct varlena *) palloc(VARHDRSZ + len - 4);
+    SET_VARSIZE(payload, VARHDRSZ + len - 4);
+    memcpy(VARDATA(payload), msg + 4, len - 4);
+
+    BeginInternalSubTransaction(NULL);
+    MemoryContextSwitchTo(listen_batch_cxt);
+
+    PG_TRY();
+    {
+        rows = bin_copy_batch(relid, payload, BIN_ON_ERROR_ABORT);
+
+        ReleaseCurrentSubTransaction();
+        CurrentResourceOwner = oldowner;
+    }
+    PG_CATCH();
+    {
+        ErrorData *edata;
+
+        MemoryContextSwitchTo(listen_batch_cxt);
+        edata = CopyErrorData();
+        FlushErrorState();
+        RollbackAndReleaseCurrentSubTransaction();
+        CurrentResourceOwner = oldowner;
+
+        reason = edata->message;
+    }
+    PG_END_TRY();
+
+    MemoryContextSwitchTo(listener_cxt);
+
+    if (reason != NULL)
+        listen_hold_error(client, reason);
+    else {
+        uint64 rows_be = pg_hton64(rows);
+
+        appendStringInfoChar(&client->held, 'K');
+        appendBinaryStringInfo(&client->held, (char *) &rows_be, 8);
+        client->nheld++;
+        listen_group_rows += rows;
+    }
+
+    MemoryContextReset(listen_batch_cxt);
+}
+
+/*
+ * Читает из соединения и обрабатывает все целые сообщения в буфере.
+ * false, если соединение закрыто или нарушило протокол.
+ */
+static bool
+listen_receive(BinListenClient *client)
+{
+    StringInfo in = &client->in;
+    uint32 need = 0;
+    ssize_t n;
+
+    enlargeStringInfo(in, BIN_LISTEN_READ_CHUNK);
+    n = recv(client->sock, in->data + in->len, in->maxlen - in->len - 1, 0);
+    if (n == 0)
+        return false;
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return true;
+        ereport(LOG,
+                (errcode_for_socket_access(),
+                 errmsg("could not receive data from ingest client: %m")));
+        return false;
+    }
+    in->len += (int) n;
+    in->data[in->len] = '\0';
+
+    while (in->len - in->cursor >= 4) {
+        uint32 len_be;
+        uint32 len;
+
+        memcpy(&len_be, in->data + in->cursor, 4);
+        len = pg_ntoh32(len_be);
+        if (len < 4 || len > BIN_LISTEN_MAX_MESSAGE) {
+            ereport(LOG,
+                    (errcode(ERRCODE_PROTOCOL_VIOLATION),
+                     errmsg("invalid ingest message length %u", len)));
+            return false;
+        }
+        if ((uint32) (in->len - in->cursor - 4) < len) {
+            need = 4 + len;
+            break;
+        }
+
+        CHECK_FOR_INTERRUPTS();
+        listen_process_batch(client, in->data + in->cursor + 4, len);
+        in->cursor += 4 + (int) len;
+
+        /*
+         * Здесь только предел строк; интервал проверяет основной цикл раз
+         * за пробуждение, иначе при нулевом интервале каждая пачка
+         * фиксировалась бы отдельно.
+         */
+        if (listen_group_rows >= (uint64) bin_listen_batch_rows)
+            listen_commit_group();
+    }
+
+    /* Недочитанный хвост - в начало буфера, и место под всё его сообщение сразу */
+    if (in->cursor > 0) {
+        memmove(in->data, in->data + in->cursor, in->len - in->cursor);
+        in->len -= in->cursor;
+        in->cursor = 0;
+        in->data[in->len] = '\0';
+    }
+    if (need > (uint32) in->len)
+        enlargeStringInfo(in, (int) (need - (uint32) in->len));
+
+    return true;
+}
+
+static WaitEventSet *
+listen_build_wait_set(void)
+{
+    WaitEventSet *set;
+    int i;
+
+#if PG_VERSION_NUM >= 170000
+    set = CreateWaitEventSet(NULL, BIN_LISTEN_MAX_CLIENTS + 3);
+#else
+    set = CreateWaitEventSet(listener_cxt, BIN_LISTEN_MAX_CLIENTS + 3);
+#endif
+    AddWaitEventToSet(set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+    AddWaitEventToSet(set, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET, NULL, NULL);
+    if (listen_nclients < BIN_LISTEN_MAX_CLIENTS)
+        AddWaitEventToSet(set, WL_SOCKET_READABLE, listen_sock, NULL, NULL);
+
+    for (i = 0; i < listen_nclients; i++) {
+        BinListenClient *client = listen_clients[i];
+
+        AddWaitEventToSet(set, WL_SOCKET_READABLE | (client->want_write ? WL_SOCKET_WRITEABLE : 0),
+                          client->sock, NULL, client);
+    }
+
+    listen_set_dirty = false;
+    return set;
+}
+
+/*
+ * Точка входа фонового процесса. По SIGTERM фиксирует открытую группу,
+ * отдаёт ответы и завершается.
+ */
+void
+bin_listener_main(Datum main_arg)
+{
+    WaitEventSet *set = NULL;
+
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+    BackgroundWorkerUnblockSignals();
+    BackgroundWorkerInitializeConnection(bin_listen_database, bin_listen_role, 0);
+
+    /* Выход с кодом 0 снимает процесс с регистрации, без перезапусков раз в 5 секунд */
+    StartTransactionCommand();
+    if (superuser()) {
+        ereport(LOG,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("ingest listener not started: pg_binmapper.listen_role \"%s\" is a superuser",
+                        bin_listen_role),
+                 errhint("Set pg_binmapper.listen_role to a role that is not a superuser.")));
+        proc_exit(0);
+    }
+    CommitTransactionCommand();
+
+    listener_cxt = AllocSetContextCreate(TopMemoryContext,
+                                         "pg_binmapper listener",
+                                         ALLOCSET_DEFAULT_SIZES);
+    listen_batch_cxt = AllocSetContextCreate(listener_cxt,
+                                             "pg_binmapper listener batch",
+                                             ALLOCSET_DEFAULT_SIZES);
+    MemoryContextSwitchTo(listener_cxt);
+
+    listen_open_socket();
+
+    while (!ShutdownRequestPending) {
+        WaitEvent events[BIN_LISTEN_MAX_CLIENTS + 3];
+        int nevents;
+        int e;
+
+        if (listen_set_dirty) {
+            if (set != NULL)
+                FreeWaitEventSet(set);
+            set = listen_build_wait_set();
+        }
+
+        nevents = WaitEventSetWait(set, listen_group_timeout(), events, lengthof(events),
+                                   PG_WAIT_EXTENSION);
+
+        for (e = 0; e < nevents; e++) {
+            WaitEvent *ev = &events[e];
+            BinListenClient *client = (BinListenClient *) ev->user_data;
+
+            if (ev->events & WL_LATCH_SET) {
+                ResetLatch(MyLatch);
+                continue;
+            }
+            if (client == NULL) {
+                if (ev->events & WL_SOCKET_READABLE && listen_nclients < BIN_LISTEN_MAX_CLIENTS)
+                    listen_accept();
+                continue;
+            }
+
+            /* Соединение могло сломаться при фиксации группы выше по списку */
+            if (client->broken)
+                continue;
+            if ((ev->events & WL_SOCKET_WRITEABLE) && !listen_send(client))
+                client->broken = true;
+            else if ((ev->events & WL_SOCKET_READABLE) && !listen_receive(client))
+                client->broken = true;
+        }
+
+        /* Закрываются только здесь: в events могут оставаться ссылки на клиентов */
+        for (e = listen_nclients - 1; e >= 0; e--)
+            if (listen_clients[e]->broken)
+                listen_close_client(e);
+
+        CHECK_FOR_INTERRUPTS();
+
+        if (ConfigReloadPending) {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        if (listen_group_timeout() == 0)
+            listen_commit_group();
+    }
+
+    listen_commit_group();
+    proc_exit(0);
+}
@@ -0,0 +1,226 @@
+/*
+ * binmapper_prewarm.c
+ *		Построение layout заранее: bin_prewarm() и фоновый процесс при старте.
+ *
+ * Первый вызов после рестарта или переключения на реплику строит layout
+ * каждой таблицы заново, и при сотнях таблиц это совпадает с потоком
+ * накопившихся в Kafka сообщений. bin_prewarm() строит layout перечисленных
+ * таблиц и публикует их в общий реестр (binmapper_registry.c), откуда их
+ * потом копируют backend-ы. Если библиотека загружена через
+ * shared_preload_libraries и задан pg_binmapper.prewarm_tables, то же
+ * самое один раз делает фоновый процесс, как только сервер начинает
+ * принимать подключения, в том числе на горячей реплике.
+ */
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_type.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "tcop/tcopprot.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/regproc.h"
+#include "utils/snapmgr.h"
+
+#include "pg_binmapper.h"
+
+static char *bin_prewarm_tables = NULL;
+static char *bin_prewarm_database = NULL;
+
+void
+bin_prewarm_init(void)
+{
+    BackgroundWorker worker;
+
+    DefineCustomStringVariable("pg_binmapper.prewarm_tables",
+                               "Tables whose layouts are built at server start.",
+                               "Comma-separated list of table names, optionally schema-qualified.",
+                               &bin_prewarm_tables,
+                               "",
+                               PGC_SIGHUP, 0,
+                               NULL, NULL, NULL);
+
+    DefineCustomStringVariable("pg_binmapper.prewarm_database",
+                               "Database the prewarm worker connects to.",
+                               NULL,
+                               &bin_prewarm_database,
+                               "postgres",
+                               PGC_SIGHUP, 0,
+                               NULL, NULL, NULL);
+
+    if (!process_shared_preload_libraries_in_progress ||
+        bin_prewarm_tables == NULL || bin_prewarm_tables[0] == '\0')
+        return;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_ConsistentState;
+    worker.bgw_restart_time = BGW_NEVER_RESTART;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_binmapper");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "bin_prewarm_main");
+    snprintf(worker.bgw_name, BGW_MAXLEN, "pg_binmapper prewarm");
+    snprintf(worker.bgw_type, BGW_MAXLEN, "pg_binmapper prewarm");
+    RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * Имена из pg_binmapper.prewarm_tables в порядке перечисления. Частям
+ * имени разрешены кавычки, но не запятые внутри них.
+ */
+static List *
+prewarm_table_names(void)
+{
+    List *result = NIL;
+    char *list = pstrdup(bin_prewarm_tables);
+    char *item;
+    char *save;
+
+    for (item = strtok_r(list, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        char *end;
+
+        while (*item == ' ' || *item == '\t')
+            item++;
+        end = item + strlen(item);
+        while (end > item && (end[-1] == ' ' || end[-1] == '\t'))
+            *--end = '\0';
+
+        if (*item != '\0')
+            result = lappend(result, item);
+    }
+
+    return result;
+}
+
+/* Таблица по имени из pg_binmapper.prewarm_tables; ERROR, если её нет */
+static Oid
+prewarm_relid(const char *name)
+{
+    List *names;
+
+#if PG_VERSION_NUM >= 160000
+    names = stringToQualifiedNameList(name, NULL);
+#else
+    names = stringToQualifiedNameList(name);
+#endif
+    return RangeVarGetRelid(makeRangeVarFromNameList(names), NoLock, false);
+}
+
+/*
+ * Строит layout одной таблицы в отдельной транзакции. Ошибка (таблицы
+ * нет, тип колонки не поддерживается) выводится как WARNING и не мешает
+ * остальным таблицам.
+ */
+static bool
+prewarm_one(const char *name)
+{
+    MemoryContext oldcxt = CurrentMemoryContext;
+    volatile bool ok = false;
+
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+
+    PG_TRY();
+    {
+        get_or_create_layout(prewarm_relid(name));
+
+        PopActiveSnapshot();
+        CommitTransactionCommand();
+        ok = true;
+    }
+    PG_CATCH();
+    {
+        ErrorData *edata;
+
+        MemoryContextSwitchTo(oldcxt);
+        edata = CopyErrorData();
+        FlushErrorState();
+        AbortCurrentTransaction();
+
+        ereport(WARNING,
+                (errmsg("could not prewarm layout of \"%s\": %s", name, edata->message)));
+        FreeErrorData(edata);
+    }
+    PG_END_TRY();
+
+    MemoryContextSwitchTo(oldcxt);
+
+    return ok;
+}
+
+/*
+ * Точка входа фонового процесса: строит layout всех таблиц из
+ * pg_binmapper.prewarm_tables и завершается.
+ */
+void
+bin_prewarm_main(Datum main_arg)
+{
+    List *names;
+    ListCell *lc;
+    int nwarmed = 0;
+
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+    BackgroundWorkerInitializeConnection(bin_prewarm_database, NULL, 0);
+
+    pgstat_report_activity(STATE_RUNNING, "prewarming layouts");
+
+    names = prewarm_table_names();
+    foreach(lc, names) {
+        CHECK_FOR_INTERRUPTS();
+        if (prewarm_one((const char *) lfirst(lc)))
+            nwarmed++;
+    }
+
+    ereport(LOG,
+            (errmsg("pg_binmapper prewarmed %d of %d layouts in database \"%s\"",
+                    nwarmed, list_length(names), bin_prewarm_database)));
+
+    pgstat_report_activity(STATE_IDLE, NULL);
+    proc_exit(0);
+}
+
+PG_FUNCTION_INFO_V1(bin_prewarm);
+
+/*
+ * bin_prewarm(regclass[] DEFAULT NULL) returns int - строит и публикует
+ * layout перечисленных таблиц, без аргумента - таблиц из
+ * pg_binmapper.prewarm_tables. Возвращает число таблиц.
+ */
+Datum
+bin_prewarm(PG_FUNCTION_ARGS)
+{
+    int nwarmed = 0;
+
+    if (PG_ARGISNULL(0)) {
+        ListCell *lc;
+
+        foreach(lc, prewarm_table_names()) {
+            get_or_create_layout(prewarm_relid((const char *) lfirst(lc)));
+            nwarmed++;
+        }
+    } else {
+        ArrayType *tables = PG_GETARG_ARRAYTYPE_P(0);
+        Datum *relids;
+        bool *nulls;
+        int n;
+        int i;
+
+        deconstruct_array(tables, REGCLASSOID, sizeof(Oid), true, TYPALIGN_INT,
+                          &relids, &nulls, &n);
+        for (i = 0; i < n; i++) {
+            if (nulls[i])
+                continue;
+            CHECK_FOR_INTERRUPTS();
+            get_or_create_layout(DatumGetObjectId(relids[i]));
+            nwarmed++;
+        }
+    }
+
+    PG_RETURN_INT32(nwarmed);
+}
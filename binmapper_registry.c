@@ -0,0 +1,346 @@
+/*
+ * binmapper_registry.c
+ *		Общий для всех backend-ов реестр скомпилированных layout.
+ *
+ * Backend, первым построивший layout таблицы, публикует его offsets и
+ * программу декодирования в shared memory; новые backend-ы (например,
+ * после переподключения через PgBouncer) копируют готовый результат
+ * вместо повторного обхода атрибутов и компиляции. Открытие таблицы и
+ * чтение её настроек (bin_config_load) остаются за каждым backend-ом.
+ *
+ * Согласованность держится на счётчиках поколений. Relcache инвалидация
+ * таблицы удаляет её запись и увеличивает счётчик её полосы
+ * (BIN_REGISTRY_STRIPES счётчиков, таблица попадает в полосу по хешу
+ * базы и relid); публикация разрешена, только если счётчик полосы не
+ * менялся с момента, когда строящий backend открыл таблицу. Так запись,
+ * собранная по старому каталогу, не может пережить DDL над таблицей, а
+ * ANALYZE и DDL над другими таблицами мешают публикации, только если
+ * попали в ту же полосу.
+ *
+ * Программа зависит и от bin_layout_config/bin_column_config, поэтому
+ * вместе с ней хранятся порядок байт, размер битовой карты и отпечаток
+ * кодировок колонок. Присоединяющийся backend сравнивает их со своими
+ * настройками: правка таблиц конфигурации в обход bin_register_* не
+ * должна дать ему программу, собранную под другую конфигурацию.
+ */
+#include "postgres.h"
+
+#include "access/tupdesc.h"
+#include "common/hashfn.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+#include "pg_binmapper.h"
+
+/* Таблицы шире этого числа атрибутов в реестр не попадают */
+#define BIN_SHARED_MAX_ATTS 128
+
+/* Число счётчиков поколений; полный сброс relcache увеличивает все */
+#define BIN_REGISTRY_STRIPES 64
+
+typedef struct {
+    LWLock *lock;
+    pg_atomic_uint64 generation[BIN_REGISTRY_STRIPES];
+} BinRegistryShared;
+
+typedef struct {
+    BinMapperSharedKey key;
+    int natts;
+    int total_binary_size;
+    int nvarlena;
+    int nops;
+    bool little_endian;
+    int bitmap_size;
+    uint32 encodings_hash;  /* bin_registry_encodings_hash() при публикации */
+    Oid atttypids[BIN_SHARED_MAX_ATTS];     /* InvalidOid для удалённых колонок */
+    int32 offsets[BIN_SHARED_MAX_ATTS];
+    BinDecodeOp ops[BIN_SHARED_MAX_ATTS];
+} BinSharedLayout;
+
+static bool bin_shared_layouts = true;
+
+static BinRegistryShared *bin_registry = NULL;
+static HTAB *bin_registry_hash = NULL;
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static Size
+bin_registry_shmem_size(void)
+{
+    return add_size(MAXALIGN(sizeof(BinRegistryShared)),
+                    hash_estimate_size(bin_max_tables, sizeof(BinSharedLayout)));
+}
+
+static void
+bin_registry_shmem_request(void)
+{
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+
+    RequestAddinShmemSpace(bin_registry_shmem_size());
+    RequestNamedLWLockTranche("pg_binmapper_registry", 1);
+}
+
+static void
+bin_registry_shmem_startup(void)
+{
+    HASHCTL info;
+    bool found;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    bin_registry = ShmemInitStruct("pg_binmapper_registry",
+                                   sizeof(BinRegistryShared), &found);
+    if (!found) {
+        int i;
+
+        bin_registry->lock = &(GetNamedLWLockTranche("pg_binmapper_registry"))->lock;
+        for (i = 0; i < BIN_REGISTRY_STRIPES; i++)
+            pg_atomic_init_u64(&bin_registry->generation[i], 0);
+    }
+
+    memset(&info, 0, sizeof(info));
+    info.keysize = sizeof(BinMapperSharedKey);
+    info.entrysize = sizeof(BinSharedLayout);
+    bin_registry_hash = ShmemInitHash("pg_binmapper layout registry",
+                                      bin_max_tables, bin_max_tables,
+                                      &info, HASH_ELEM | HASH_BLOBS);
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+void
+bin_registry_init(void)
+{
+    DefineCustomBoolVariable("pg_binmapper.shared_layouts",
+                             "Shares compiled layouts between backends through shared memory.",
+                             "Only effective when loaded via shared_preload_libraries.",
+                             &bin_shared_layouts,
+                             true,
+                             PGC_POSTMASTER, 0,
+                             NULL, NULL, NULL);
+
+    if (!process_shared_preload_libraries_in_progress || !bin_shared_layouts)
+        return;
+
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = bin_registry_shmem_request;
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = bin_registry_shmem_startup;
+}
+
+static void
+bin_registry_make_key(BinMapperSharedKey *key, Oid relid)
+{
+    memset(key, 0, sizeof(*key));
+    key->dbid = MyDatabaseId;
+    key->relid = relid;
+}
+
+/* Счётчик поколений полосы, в которую попадает relid текущей базы */
+static pg_atomic_uint64 *
+bin_registry_stripe(Oid relid)
+{
+    uint32 h = hash_combine(hash_uint32(MyDatabaseId), hash_uint32(relid));
+
+    return &bin_registry->generation[h % BIN_REGISTRY_STRIPES];
+}
+
+/*
+ * Текущее поколение таблицы relid. Читать нужно после table_open, когда
+ * backend уже принял все инвалидации.
+ */
+uint64
+bin_registry_generation(Oid relid)
+{
+    if (bin_registry == NULL)
+        return 0;
+    return pg_atomic_read_u64(bin_registry_stripe(relid));
+}
+
+/*
+ * Отпечаток кодировок из bin_column_config. Поля хешируются по одному,
+ * чтобы выравнивание BinColumnConfig не попало в результат.
+ */
+static uint32
+bin_registry_encodings_hash(TableBinaryLayout *layout)
+{
+    uint32 h = 0;
+    int i;
+
+    if (layout->columns == NULL)
+        return 0;
+
+    for (i = 0; i < layout->tupdesc->natts; i++) {
+        BinColumnConfig *col = &layout->columns[i];
+
+        if (!col->converted)
+            continue;
+        h = hash_combine(h, hash_uint32((uint32) i));
+        h = hash_combine(h, hash_uint32(col->opcode));
+        h = hash_combine(h, hash_uint32((uint32) col->len));
+        h = hash_combine(h, hash_uint32((uint32) col->arg));
+    }
+    return h;
+}
+
+/*
+ * Заполняет offsets/ops/null_template из реестра. layout->tupdesc уже
+ * должен быть скопирован, а layout->offsets выделен на natts элементов.
+ * Запись принимается, только если типы всех колонок совпадают с
+ * дескриптором этого backend-а, а конфигурация, под которую собрана
+ * программа, - с уже загруженной bin_config_load.
+ */
+bool
+bin_registry_attach(TableBinaryLayout *layout)
+{
+    BinMapperSharedKey key;
+    BinSharedLayout *entry;
+    TupleDesc tupdesc = layout->tupdesc;
+    int natts = tupdesc->natts;
+    bool ok = false;
+    uint32 encodings_hash;
+    int i;
+
+    if (bin_registry_hash == NULL || natts > BIN_SHARED_MAX_ATTS)
+        return false;
+
+    encodings_hash = bin_registry_encodings_hash(layout);
+
+    bin_registry_make_key(&key, layout->relid);
+
+    LWLockAcquire(bin_registry->lock, LW_SHARED);
+
+    entry = (BinSharedLayout *) hash_search(bin_registry_hash, &key, HASH_FIND, NULL);
+    if (entry && entry->natts == natts &&
+        entry->little_endian == layout->little_endian &&
+        entry->bitmap_size == layout->bitmap_size &&
+        entry->encodings_hash == encodings_hash) {
+        ok = true;
+        for (i = 0; i < natts && ok; i++) {
+            Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+            Oid typid = attr->attisdropped ? InvalidOid : attr->atttypid;
+
+            ok = (entry->atttypids[i] == typid);
+        }
+    }
+
+    if (ok) {
+        layout->total_binary_size = entry->total_binary_size;
+        layout->nvarlena = entry->nvarlena;
+        layout->nops = entry->nops;
+        layout->ops = (BinDecodeOp *) MemoryContextAlloc(layout->cxt,
+                                                         Max(natts, 1) * sizeof(BinDecodeOp));
+        layout->null_template = (bool *) MemoryContextAllocZero(layout->cxt,
+                                                                Max(natts, 1) * sizeof(bool));
+        memcpy(layout->ops, entry->ops, entry->nops * sizeof(BinDecodeOp));
+        for (i = 0; i < natts; i++) {
+            layout->offsets[i] = entry->offsets[i];
+            layout->null_template[i] = (entry->offsets[i] == -1);
+        }
+    }
+
+    LWLockRelease(bin_registry->lock);
+
+    return ok;
+}
+
+/*
+ * Публикует только что скомпилированный layout. generation - значение
+ * bin_registry_generation(), прочитанное до построения; если с тех пор
+ * прошла инвалидация, публикация пропускается.
+ */
+void
+bin_registry_publish(TableBinaryLayout *layout, uint64 generation)
+{
+    BinMapperSharedKey key;
+    BinSharedLayout *entry;
+    TupleDesc tupdesc = layout->tupdesc;
+    int natts = tupdesc->natts;
+    bool found;
+    uint32 encodings_hash;
+    int i;
+
+    if (bin_registry_hash == NULL || natts > BIN_SHARED_MAX_ATTS)
+        return;
+
+    bin_registry_make_key(&key, layout->relid);
+    encodings_hash = bin_registry_encodings_hash(layout);
+
+    LWLockAcquire(bin_registry->lock, LW_EXCLUSIVE);
+
+    if (pg_atomic_read_u64(bin_registry_stripe(layout->relid)) == generation) {
+        entry = (BinSharedLayout *) hash_search(bin_registry_hash, &key, HASH_ENTER_NULL, &found);
+        if (entry) {
+            entry->natts = natts;
+            entry->total_binary_size = layout->total_binary_size;
+            entry->nvarlena = layout->nvarlena;
+            entry->nops = layout->nops;
+            entry->little_endian = layout->little_endian;
+            entry->bitmap_size = layout->bitmap_size;
+            entry->encodings_hash = encodings_hash;
+            for (i = 0; i < natts; i++) {
+                Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+
+                entry->atttypids[i] = attr->attisdropped ? InvalidOid : attr->atttypid;
+                entry->offsets[i] = layout->offsets[i];
+            }
+            memcpy(entry->ops, layout->ops, layout->nops * sizeof(BinDecodeOp));
+        }
+    }
+
+    LWLockRelease(bin_registry->lock);
+}
+
+/*
+ * Вызывается из relcache callback. InvalidOid означает сброс всего
+ * relcache, тогда удаляются все записи текущей базы.
+ */
+void
+bin_registry_invalidate(Oid relid)
+{
+    BinMapperSharedKey key;
+    bool found;
+
+    if (bin_registry_hash == NULL)
+        return;
+
+    if (OidIsValid(relid)) {
+        pg_atomic_fetch_add_u64(bin_registry_stripe(relid), 1);
+        bin_registry_make_key(&key, relid);
+
+        LWLockAcquire(bin_registry->lock, LW_SHARED);
+        found = (hash_search(bin_registry_hash, &key, HASH_FIND, NULL) != NULL);
+        LWLockRelease(bin_registry->lock);
+
+        if (found) {
+            LWLockAcquire(bin_registry->lock, LW_EXCLUSIVE);
+            hash_search(bin_registry_hash, &key, HASH_REMOVE, NULL);
+            LWLockRelease(bin_registry->lock);
+        }
+    } else {
+        HASH_SEQ_STATUS hash_seq;
+        BinSharedLayout *entry;
+        int i;
+
+        for (i = 0; i < BIN_REGISTRY_STRIPES; i++)
+            pg_atomic_fetch_add_u64(&bin_registry->generation[i], 1);
+
+        LWLockAcquire(bin_registry->lock, LW_EXCLUSIVE);
+        hash_seq_init(&hash_seq, bin_registry_hash);
+        while ((entry = hash_seq_search(&hash_seq)) != NULL) {
+            if (entry->key.dbid == MyDatabaseId)
+                hash_search(bin_registry_hash, &entry->key, HASH_REMOVE, NULL);
+        }
+        LWLockRelease(bin_registry->lock);
+    }
+}
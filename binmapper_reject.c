@@ -0,0 +1,178 @@
+/*
+ * binmapper_reject.c
+ *		Политика on_error для пачек и COPY: abort, skip, dead_letter.
+ *
+ * Целостность пачки (CRC кадра, длина тела, число записей) проверяется
+ * один раз до разбора. Если она нарушена, отвергается вся пачка: границам
+ * записей в ней верить нельзя. Значения, на которых разбор может упасть
+ * посреди пачки, проверяются у каждой записи (bin_record_check), и
+ * отвергается только сама запись. Отвергнутое пропускается с WARNING в
+ * конце пачки, а при dead_letter ещё и сохраняется в bin_dead_letter.
+ */
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+
+#include "pg_binmapper.h"
+
+BinOnError
+bin_on_error_parse(const char *value)
+{
+    if (strcmp(value, "abort") == 0)
+        return BIN_ON_ERROR_ABORT;
+    if (strcmp(value, "skip") == 0)
+        return BIN_ON_ERROR_SKIP;
+    if (strcmp(value, "dead_letter") == 0)
+        return BIN_ON_ERROR_DEAD_LETTER;
+
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("invalid value for on_error: \"%s\"", value),
+             errhint("Valid values are \"abort\", \"skip\" and \"dead_letter\".")));
+    return BIN_ON_ERROR_ABORT;  /* keep compiler quiet */
+}
+
+void
+bin_rejects_init(BinRejects *rj, TableBinaryLayout *layout, BinOnError on_error)
+{
+    /* INSERT в bin_dead_letter в параллельном режиме запрещён */
+    if (on_error == BIN_ON_ERROR_DEAD_LETTER && IsInParallelMode())
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_TRANSACTION_STATE),
+                 errmsg("on_error \"dead_letter\" cannot be used in a parallel query"),
+                 errhint("Use \"skip\", or disable parallel query for this statement.")));
+
+    memset(rj, 0, sizeof(*rj));
+    rj->layout = layout;
+    rj->on_error = on_error;
+    rj->cxt = CurrentMemoryContext;
+}
+
+/*
+ * Сохраняет отвергнутые данные в bin_dead_letter. record_no 0 означает
+ * всю пачку.
+ */
+static void
+dead_letter_insert(TableBinaryLayout *layout, uint64 record_no, const char *reason,
+                   const char *data, Size len)
+{
+    Oid nspoid;
+    Oid argtypes[4] = {REGCLASSOID, INT8OID, TEXTOID, BYTEAOID};
+    Datum args[4];
+    char argnulls[4] = {' ', ' ', ' ', ' '};
+    StringInfoData query;
+    bytea *payload;
+    int ret;
+
+    SPI_connect();
+
+    nspoid = bin_extension_namespace();
+    if (!OidIsValid(nspoid) || !OidIsValid(get_relname_relid("bin_dead_letter", nspoid)))
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_TABLE),
+                 errmsg("on_error \"dead_letter\" requires table bin_dead_letter"),
+                 errhint("Run ALTER EXTENSION pg_binmapper UPDATE.")));
+
+    payload = (bytea *) palloc(len + VARHDRSZ);
+    SET_VARSIZE(payload, len + VARHDRSZ);
+    memcpy(VARDATA(payload), data, len);
+
+    args[0] = ObjectIdGetDatum(layout->relid);
+    args[1] = Int64GetDatum((int64) record_no);
+    args[2] = CStringGetTextDatum(reason);
+    args[3] = PointerGetDatum(payload);
+    if (record_no == 0)
+        argnulls[1] = 'n';
+
+    initStringInfo(&query);
+    appendStringInfo(&query,
+                     "INSERT INTO %s.bin_dead_letter (relid, record_no, reason, payload) "
+                     "VALUES ($1, $2, $3, $4)",
+                     quote_identifier(get_namespace_name(nspoid)));
+
+    ret = SPI_execute_with_args(query.data, 4, argtypes, args, argnulls, false, 0);
+    if (ret != SPI_OK_INSERT)
+        elog(ERROR, "[BINMAPPER] could not write to bin_dead_letter: %s", SPI_result_code_string(ret));
+
+    SPI_finish();
+}
+
+static void
+reject_remember(BinRejects *rj, const char *reason)
+{
+    bin_stats_count_error(rj->layout);
+    if (rj->first_reason == NULL)
+        rj->first_reason = MemoryContextStrdup(rj->cxt, reason);
+}
+
+/*
+ * Проверяет запись номер record_no (с 1) перед разбором. Возвращает
+ * true, если запись отвергнута и её нужно пропустить. При abort ничего
+ * не проверяет: ошибку в значении выдаст сам разбор.
+ */
+bool
+bin_reject_record(BinRejects *rj, const char *raw_ptr, uint64 record_no)
+{
+    char *reason;
+
+    if (rj->on_error == BIN_ON_ERROR_ABORT)
+        return false;
+
+    reason = bin_record_check(rj->layout, raw_ptr);
+    if (reason == NULL)
+        return false;
+
+    reject_remember(rj, reason);
+    rj->nrejected++;
+    if (rj->on_error == BIN_ON_ERROR_DEAD_LETTER)
+        dead_letter_insert(rj->layout, record_no, reason, raw_ptr,
+                           (Size) bin_record_size(rj->layout, raw_ptr, MaxAllocSize));
+    pfree(reason);
+
+    return true;
+}
+
+/*
+ * Отвергает пачку целиком. Ни одна её запись не разбирается.
+ */
+void
+bin_reject_batch(BinRejects *rj, const char *reason, const char *payload, Size len)
+{
+    Assert(rj->on_error != BIN_ON_ERROR_ABORT);
+
+    reject_remember(rj, reason);
+    rj->batch_rejected = true;
+    if (rj->on_error == BIN_ON_ERROR_DEAD_LETTER)
+        dead_letter_insert(rj->layout, 0, reason, payload, len);
+}
+
+/*
+ * Одно WARNING на пачку, если в ней что-то отвергнуто.
+ */
+void
+bin_rejects_report(BinRejects *rj)
+{
+    const char *relname = get_rel_name(rj->layout->relid);
+
+    if (rj->batch_rejected)
+        ereport(WARNING,
+                (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                 errmsg("batch for table \"%s\" rejected: %s", relname, rj->first_reason),
+                 rj->on_error == BIN_ON_ERROR_DEAD_LETTER ?
+                 errdetail("The batch was saved to bin_dead_letter.") : 0));
+    else if (rj->nrejected > 0)
+        ereport(WARNING,
+                (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                 errmsg_plural(UINT64_FORMAT " record for table \"%s\" rejected",
+                               UINT64_FORMAT " records for table \"%s\" rejected",
+                               rj->nrejected, rj->nrejected, relname),
+                 errdetail("First error: %s", rj->first_reason),
+                 rj->on_error == BIN_ON_ERROR_DEAD_LETTER ?
+                 errhint("Rejected records were saved to bin_dead_letter.") : 0));
+}
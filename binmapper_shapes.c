@@ -0,0 +1,146 @@
+/*
+ * binmapper_shapes.c
+ *		Развёрнутые сборщики кортежей для частых форм layout.
+ *
+ * bin_form_tuple проходит по heap_ops и на каждом участке выбирает
+ * операцию. Для самых частых форм - K подряд идущих 8- или 4-байтных
+ * big-endian полей и int4, за которым идут K 8-байтных (id + метрики) -
+ * здесь макросами сгенерированы функции, где все смещения константы и
+ * цикл развёрнут целиком. Форма подбирается один раз при построении
+ * layout (bin_shape_select); если ничего не подошло, остаётся общий
+ * путь через heap_ops.
+ */
+#include "postgres.h"
+
+#include "port/pg_bswap.h"
+
+#include "pg_binmapper.h"
+
+/* Длиннее участок выгоднее отдать векторному ядру bin_bswap*_run */
+#define BIN_SHAPE_MAX_RUN 16
+
+#define BIN_SHAPE_SIZES(X) \
+    X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8) \
+    X(9) X(10) X(11) X(12) X(13) X(14) X(15) X(16)
+
+#define BIN_SWAP64_AT(dst, src, i) \
+    do { \
+        uint64 v_; \
+        memcpy(&v_, (src) + (i) * 8, 8); \
+        v_ = pg_bswap64(v_); \
+        memcpy((dst) + (i) * 8, &v_, 8); \
+    } while (0)
+
+#define BIN_SWAP32_AT(dst, src, i) \
+    do { \
+        uint32 v_; \
+        memcpy(&v_, (src) + (i) * 4, 4); \
+        v_ = pg_bswap32(v_); \
+        memcpy((dst) + (i) * 4, &v_, 4); \
+    } while (0)
+
+/* M(dst, src, i) для i = 0 .. K-1 */
+#define BIN_REP1(M, d, s) M(d, s, 0);
+#define BIN_REP2(M, d, s) BIN_REP1(M, d, s) M(d, s, 1);
+#define BIN_REP3(M, d, s) BIN_REP2(M, d, s) M(d, s, 2);
+#define BIN_REP4(M, d, s) BIN_REP3(M, d, s) M(d, s, 3);
+#define BIN_REP5(M, d, s) BIN_REP4(M, d, s) M(d, s, 4);
+#define BIN_REP6(M, d, s) BIN_REP5(M, d, s) M(d, s, 5);
+#define BIN_REP7(M, d, s) BIN_REP6(M, d, s) M(d, s, 6);
+#define BIN_REP8(M, d, s) BIN_REP7(M, d, s) M(d, s, 7);
+#define BIN_REP9(M, d, s) BIN_REP8(M, d, s) M(d, s, 8);
+#define BIN_REP10(M, d, s) BIN_REP9(M, d, s) M(d, s, 9);
+#define BIN_REP11(M, d, s) BIN_REP10(M, d, s) M(d, s, 10);
+#define BIN_REP12(M, d, s) BIN_REP11(M, d, s) M(d, s, 11);
+#define BIN_REP13(M, d, s) BIN_REP12(M, d, s) M(d, s, 12);
+#define BIN_REP14(M, d, s) BIN_REP13(M, d, s) M(d, s, 13);
+#define BIN_REP15(M, d, s) BIN_REP14(M, d, s) M(d, s, 14);
+#define BIN_REP16(M, d, s) BIN_REP15(M, d, s) M(d, s, 15);
+
+/* K полей int8/float8/timestamp подряд */
+#define BIN_DEFINE_SWAP64(K) \
+    static void \
+    form_swap64_##K(char *dst, const char *src) \
+    { \
+        BIN_REP##K(BIN_SWAP64_AT, dst, src) \
+    }
+
+/* K полей int4/float4/date подряд */
+#define BIN_DEFINE_SWAP32(K) \
+    static void \
+    form_swap32_##K(char *dst, const char *src) \
+    { \
+        BIN_REP##K(BIN_SWAP32_AT, dst, src) \
+    }
+
+/* int4 и K 8-байтных полей: в кортеже между ними 4 байта выравнивания */
+#define BIN_DEFINE_INT4_SWAP64(K) \
+    static void \
+    form_int4_swap64_##K(char *dst, const char *src) \
+    { \
+        BIN_SWAP32_AT(dst, src, 0); \
+        BIN_REP##K(BIN_SWAP64_AT, dst + 8, src + 4) \
+    }
+
+BIN_SHAPE_SIZES(BIN_DEFINE_SWAP64)
+BIN_SHAPE_SIZES(BIN_DEFINE_SWAP32)
+BIN_SHAPE_SIZES(BIN_DEFINE_INT4_SWAP64)
+
+#define BIN_ENTRY_SWAP64(K) form_swap64_##K,
+#define BIN_ENTRY_SWAP32(K) form_swap32_##K,
+#define BIN_ENTRY_INT4_SWAP64(K) form_int4_swap64_##K,
+
+static const BinFormShapeFunc swap64_shapes[BIN_SHAPE_MAX_RUN + 1] = {
+    NULL, BIN_SHAPE_SIZES(BIN_ENTRY_SWAP64)
+};
+static const BinFormShapeFunc swap32_shapes[BIN_SHAPE_MAX_RUN + 1] = {
+    NULL, BIN_SHAPE_SIZES(BIN_ENTRY_SWAP32)
+};
+static const BinFormShapeFunc int4_swap64_shapes[BIN_SHAPE_MAX_RUN + 1] = {
+    NULL, BIN_SHAPE_SIZES(BIN_ENTRY_INT4_SWAP64)
+};
+
+/*
+ * Подбирает развёрнутый сборщик по heap_ops layout с direct_form.
+ * Поля формы должны начинаться с начала данных кортежа; в записи перед
+ * ними может стоять битовая карта NULL, её пропускает shape_offset.
+ */
+void
+bin_shape_select(TableBinaryLayout *layout)
+{
+    const BinDecodeOp *ops = layout->heap_ops;
+    const char *name = NULL;
+    int k = 0;
+
+    layout->form_shape = NULL;
+    layout->shape_offset = 0;
+
+    if (!layout->direct_form || layout->nheap_ops == 0 || layout->nheap_ops > 2 ||
+        ops[0].heap_offset != 0)
+        return;
+
+    if (layout->nheap_ops == 1 && ops[0].len <= BIN_SHAPE_MAX_RUN) {
+        k = ops[0].len;
+        if (ops[0].opcode == BIN_OP_BSWAP64_RUN) {
+            layout->form_shape = swap64_shapes[k];
+            name = "int8";
+        } else if (ops[0].opcode == BIN_OP_BSWAP32_RUN) {
+            layout->form_shape = swap32_shapes[k];
+            name = "int4";
+        }
+    } else if (layout->nheap_ops == 2 &&
+               ops[0].opcode == BIN_OP_BSWAP32_RUN && ops[0].len == 1 &&
+               ops[1].opcode == BIN_OP_BSWAP64_RUN && ops[1].len <= BIN_SHAPE_MAX_RUN &&
+               ops[1].offset == ops[0].offset + 4 && ops[1].heap_offset == 8) {
+        k = ops[1].len;
+        layout->form_shape = int4_swap64_shapes[k];
+        name = "int4 + int8";
+    }
+
+    if (layout->form_shape == NULL)
+        return;
+
+    layout->shape_offset = ops[0].offset;
+    elog(DEBUG1, "[BINMAPPER] table %u uses unrolled decoder: %s x %d",
+         layout->relid, name, k);
+}
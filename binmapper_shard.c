@@ -0,0 +1,148 @@
+/*
+ * binmapper_shard.c
+ *		Карта шардов hash-распределённой таблицы Citus.
+ *
+ * Citus маршрутизирует строки, которые вернула функция на координаторе,
+ * по одной, декодируя каждую целиком. bin_shard_split вместо этого
+ * читает из записи только колонку распределения, хэширует её так же,
+ * как Citus (функция хэширования opclass по умолчанию для типа колонки),
+ * и раскладывает записи по шардам, не разбирая остальные поля.
+ *
+ * C API Citus не стабилен между версиями, поэтому метаданные читаются
+ * через SPI из pg_dist_partition, pg_dist_shard, pg_dist_placement и
+ * pg_dist_node. Отправка пачек на узлы остаётся вызывающему: для
+ * каждого шарда возвращаются имя таблицы-шарда и узел его размещения.
+ */
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "commands/extension.h"
+#include "executor/spi.h"
+#include "nodes/primnodes.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/typcache.h"
+
+#include "pg_binmapper.h"
+
+static const char *const bin_shards_query =
+    "SELECT * FROM ("
+    " SELECT DISTINCT ON (s.shardid) s.shardid, s.shardminvalue::int4, s.shardmaxvalue::int4,"
+    "        pg_catalog.shard_name(s.logicalrelid, s.shardid), n.nodename, n.nodeport"
+    " FROM pg_catalog.pg_dist_shard s"
+    " JOIN pg_catalog.pg_dist_placement p ON p.shardid = s.shardid"
+    " JOIN pg_catalog.pg_dist_node n ON n.groupid = p.groupid"
+    " WHERE s.logicalrelid = $1 AND n.noderole = 'primary' AND n.isactive"
+    " ORDER BY s.shardid, p.placementid) x "
+    "ORDER BY 2";
+
+/*
+ * Читает колонку распределения и шарды таблицы. Карта выделяется в
+ * текущем контексте.
+ */
+BinShardMap *
+bin_shard_map_load(Oid relid)
+{
+    MemoryContext cxt = CurrentMemoryContext;
+    BinShardMap *map;
+    Oid argtypes[1] = {REGCLASSOID};
+    Datum args[1];
+    TypeCacheEntry *typentry;
+    Var *partkey;
+    char *partmethod;
+    bool isnull;
+    int ret;
+    uint64 i;
+
+    if (!OidIsValid(get_extension_oid("citus", true)))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("bin_shard_split requires the citus extension")));
+
+    map = (BinShardMap *) palloc0(sizeof(BinShardMap));
+    args[0] = ObjectIdGetDatum(relid);
+
+    SPI_connect();
+
+    ret = SPI_execute_with_args("SELECT partmethod::text, partkey FROM pg_catalog.pg_dist_partition"
+                                " WHERE logicalrelid = $1",
+                                1, argtypes, args, NULL, true, 1);
+    if (ret != SPI_OK_SELECT)
+        elog(ERROR, "[BINMAPPER] could not read pg_dist_partition: %s", SPI_result_code_string(ret));
+
+    partmethod = SPI_processed == 1 ?
+        SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1) : NULL;
+    if (partmethod == NULL || strcmp(partmethod, "h") != 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("table \"%s\" is not hash-distributed", get_rel_name(relid))));
+
+    /* partkey - Var в виде nodeToString, так его читает и сам Citus */
+    partkey = (Var *) stringToNode(SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2));
+    if (!IsA(partkey, Var))
+        elog(ERROR, "[BINMAPPER] unexpected distribution key of table %u", relid);
+    map->distattno = partkey->varattno - 1;
+
+    typentry = lookup_type_cache(partkey->vartype, TYPECACHE_HASH_PROC_FINFO);
+    if (!OidIsValid(typentry->hash_proc))
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_FUNCTION),
+                 errmsg("could not identify a hash function for type %s",
+                        format_type_be(partkey->vartype))));
+    fmgr_info_copy(&map->hash_finfo, &typentry->hash_proc_finfo, cxt);
+    map->collation = partkey->varcollid;
+
+    ret = SPI_execute_with_args(bin_shards_query, 1, argtypes, args, NULL, true, 0);
+    if (ret != SPI_OK_SELECT)
+        elog(ERROR, "[BINMAPPER] could not read shards: %s", SPI_result_code_string(ret));
+    if (SPI_processed == 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("table \"%s\" has no active shard placements", get_rel_name(relid))));
+
+    map->nshards = (int) SPI_processed;
+    map->shards = (BinShardInterval *) MemoryContextAllocZero(cxt, map->nshards * sizeof(BinShardInterval));
+    for (i = 0; i < SPI_processed; i++) {
+        HeapTuple tuple = SPI_tuptable->vals[i];
+        TupleDesc tupdesc = SPI_tuptable->tupdesc;
+        BinShardInterval *shard = &map->shards[i];
+
+        shard->shardid = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+        shard->minvalue = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+        shard->maxvalue = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 3, &isnull));
+        shard->shard_name = MemoryContextStrdup(cxt, SPI_getvalue(tuple, tupdesc, 4));
+        shard->nodename = MemoryContextStrdup(cxt, SPI_getvalue(tuple, tupdesc, 5));
+        shard->nodeport = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 6, &isnull));
+    }
+
+    SPI_finish();
+
+    return map;
+}
+
+/*
+ * Номер шарда для значения колонки распределения или -1, если хэш не
+ * попал ни в один интервал. Шарды отсортированы по minvalue.
+ */
+int
+bin_shard_map_find(BinShardMap *map, Datum value)
+{
+    int32 hash = DatumGetInt32(FunctionCall1Coll(&map->hash_finfo, map->collation, value));
+    int lo = 0;
+    int hi = map->nshards - 1;
+
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        BinShardInterval *shard = &map->shards[mid];
+
+        if (hash < shard->minvalue)
+            hi = mid - 1;
+        else if (hash > shard->maxvalue)
+            lo = mid + 1;
+        else
+            return mid;
+    }
+
+    return -1;
+}
@@ -0,0 +1,182 @@
+/*
+ * binmapper_simd.c
+ *		Векторные ядра перестановки байт для участков однотипных полей.
+ *
+ * Ядро переводит n подряд идущих big-endian значений по 4 или 8 байт в
+ * порядок байт хоста. Вариант выбирается один раз в _PG_init: AVX2 или
+ * SSSE3 (pshufb) на x86-64 по результату проверки CPU, NEON (vrev) на
+ * aarch64, где он есть всегда. Иначе остаётся скалярный pg_bswap.
+ * Источник и приёмник могут быть не выровнены.
+ */
+#include "postgres.h"
+
+#include "port/pg_bswap.h"
+
+#include "pg_binmapper.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define BIN_USE_X86_SIMD 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define BIN_USE_NEON 1
+#include <arm_neon.h>
+#endif
+
+static void bswap32_run_scalar(char *dst, const char *src, int n);
+static void bswap64_run_scalar(char *dst, const char *src, int n);
+
+BinBswapRunFunc bin_bswap32_run = bswap32_run_scalar;
+BinBswapRunFunc bin_bswap64_run = bswap64_run_scalar;
+
+static void
+bswap32_run_scalar(char *dst, const char *src, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        uint32 v;
+
+        memcpy(&v, src + i * 4, 4);
+        v = pg_bswap32(v);
+        memcpy(dst + i * 4, &v, 4);
+    }
+}
+
+static void
+bswap64_run_scalar(char *dst, const char *src, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        uint64 v;
+
+        memcpy(&v, src + i * 8, 8);
+        v = pg_bswap64(v);
+        memcpy(dst + i * 8, &v, 8);
+    }
+}
+
+#ifdef BIN_USE_X86_SIMD
+
+__attribute__((target("ssse3")))
+static void
+bswap32_run_ssse3(char *dst, const char *src, int n)
+{
+    const __m128i mask = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                                       11, 10, 9, 8, 15, 14, 13, 12);
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + i * 4));
+
+        _mm_storeu_si128((__m128i *) (dst + i * 4), _mm_shuffle_epi8(v, mask));
+    }
+    bswap32_run_scalar(dst + i * 4, src + i * 4, n - i);
+}
+
+__attribute__((target("ssse3")))
+static void
+bswap64_run_ssse3(char *dst, const char *src, int n)
+{
+    const __m128i mask = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0,
+                                       15, 14, 13, 12, 11, 10, 9, 8);
+    int i = 0;
+
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + i * 8));
+
+        _mm_storeu_si128((__m128i *) (dst + i * 8), _mm_shuffle_epi8(v, mask));
+    }
+    bswap64_run_scalar(dst + i * 8, src + i * 8, n - i);
+}
+
+/* vpshufb переставляет байты внутри каждой 128-битной половины */
+__attribute__((target("avx2")))
+static void
+bswap32_run_avx2(char *dst, const char *src, int n)
+{
+    const __m256i mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                                          11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4,
+                                          11, 10, 9, 8, 15, 14, 13, 12);
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (src + i * 4));
+
+        _mm256_storeu_si256((__m256i *) (dst + i * 4), _mm256_shuffle_epi8(v, mask));
+    }
+    bswap32_run_scalar(dst + i * 4, src + i * 4, n - i);
+}
+
+__attribute__((target("avx2")))
+static void
+bswap64_run_avx2(char *dst, const char *src, int n)
+{
+    const __m256i mask = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0,
+                                          15, 14, 13, 12, 11, 10, 9, 8,
+                                          7, 6, 5, 4, 3, 2, 1, 0,
+                                          15, 14, 13, 12, 11, 10, 9, 8);
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (src + i * 8));
+
+        _mm256_storeu_si256((__m256i *) (dst + i * 8), _mm256_shuffle_epi8(v, mask));
+    }
+    bswap64_run_scalar(dst + i * 8, src + i * 8, n - i);
+}
+
+#endif							/* BIN_USE_X86_SIMD */
+
+#ifdef BIN_USE_NEON
+
+static void
+bswap32_run_neon(char *dst, const char *src, int n)
+{
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4)
+        vst1q_u8((uint8_t *) (dst + i * 4), vrev32q_u8(vld1q_u8((const uint8_t *) (src + i * 4))));
+    bswap32_run_scalar(dst + i * 4, src + i * 4, n - i);
+}
+
+static void
+bswap64_run_neon(char *dst, const char *src, int n)
+{
+    int i = 0;
+
+    for (; i + 2 <= n; i += 2)
+        vst1q_u8((uint8_t *) (dst + i * 8), vrev64q_u8(vld1q_u8((const uint8_t *) (src + i * 8))));
+    bswap64_run_scalar(dst + i * 8, src + i * 8, n - i);
+}
+
+#endif							/* BIN_USE_NEON */
+
+/*
+ * Выбирает ядра под текущий CPU. Вызывается из _PG_init.
+ */
+void
+bin_simd_init(void)
+{
+    const char *impl = "scalar";
+
+#if defined(BIN_USE_X86_SIMD)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        bin_bswap32_run = bswap32_run_avx2;
+        bin_bswap64_run = bswap64_run_avx2;
+        impl = "avx2";
+    } else if (__builtin_cpu_supports("ssse3")) {
+        bin_bswap32_run = bswap32_run_ssse3;
+        bin_bswap64_run = bswap64_run_ssse3;
+        impl = "ssse3";
+    }
+#elif defined(BIN_USE_NEON)
+    bin_bswap32_run = bswap32_run_neon;
+    bin_bswap64_run = bswap64_run_neon;
+    impl = "neon";
+#endif
+
+    elog(DEBUG1, "[BINMAPPER] byte-swap kernel: %s", impl);
+}
@@ -0,0 +1,396 @@
+/*
+ * binmapper_stats.c
+ *		Счётчики загрузки по таблицам в shared memory (pg_stat_binmapper).
+ *
+ * Хэш создаётся только при загрузке через shared_preload_libraries.
+ * Запись таблицы заводится один раз при построении layout, дальше
+ * backend-ы обновляют её атомиками без блокировок.
+ *
+ * С pg_binmapper.track_latency каждый этап вызова ещё и попадает в
+ * гистограмму с корзинами по степеням двойки (pg_stat_binmapper_latency).
+ * Перцентили считаются при чтении: внутри корзины значения полагаются
+ * распределёнными равномерно, так что ошибка не больше ширины корзины.
+ */
+#include "postgres.h"
+
+#include <math.h>
+
+#include "catalog/pg_type.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "port/pg_bitutils.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/tuplestore.h"
+
+#include "pg_binmapper.h"
+
+typedef struct {
+    LWLock *lock;           /* защищает вставку в хэш */
+} BinMapperStatsShared;
+
+int bin_max_tables = 1000;
+
+static const char *const bin_stage_names[BIN_NSTAGES] = {
+    "lookup", "detoast", "decode", "insert", "total"
+};
+
+static BinMapperStatsShared *bin_stats_shared = NULL;
+static HTAB *bin_stats_hash = NULL;
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static Size
+bin_stats_shmem_size(void)
+{
+    return add_size(MAXALIGN(sizeof(BinMapperStatsShared)),
+                    hash_estimate_size(bin_max_tables, sizeof(BinMapperTableStats)));
+}
+
+static void
+bin_stats_shmem_request(void)
+{
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+
+    RequestAddinShmemSpace(bin_stats_shmem_size());
+    RequestNamedLWLockTranche("pg_binmapper_stats", 1);
+}
+
+static void
+bin_stats_shmem_startup(void)
+{
+    HASHCTL info;
+    bool found;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    bin_stats_shared = ShmemInitStruct("pg_binmapper_stats",
+                                       sizeof(BinMapperStatsShared), &found);
+    if (!found)
+        bin_stats_shared->lock = &(GetNamedLWLockTranche("pg_binmapper_stats"))->lock;
+
+    memset(&info, 0, sizeof(info));
+    info.keysize = sizeof(BinMapperSharedKey);
+    info.entrysize = sizeof(BinMapperTableStats);
+    bin_stats_hash = ShmemInitHash("pg_binmapper table stats",
+                                   bin_max_tables, bin_max_tables,
+                                   &info, HASH_ELEM | HASH_BLOBS);
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+void
+bin_stats_init(void)
+{
+    DefineCustomIntVariable("pg_binmapper.max_tables",
+                            "Maximum number of tables tracked in shared memory.",
+                            "Sizes both pg_stat_binmapper and the shared layout registry.",
+                            &bin_max_tables,
+                            1000, 16, INT_MAX / 2,
+                            PGC_POSTMASTER, 0,
+                            NULL, NULL, NULL);
+
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = bin_stats_shmem_request;
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = bin_stats_shmem_startup;
+}
+
+/*
+ * Возвращает запись таблицы, создавая её при необходимости.
+ * NULL, если библиотека не в shared_preload_libraries или хэш заполнен.
+ * Вызывается только при построении layout, не на каждой строке.
+ */
+BinMapperTableStats *
+bin_stats_get_entry(Oid relid)
+{
+    BinMapperTableStats *entry;
+    BinMapperSharedKey key;
+    bool found;
+
+    if (bin_stats_hash == NULL)
+        return NULL;
+
+    memset(&key, 0, sizeof(key));
+    key.dbid = MyDatabaseId;
+    key.relid = relid;
+
+    LWLockAcquire(bin_stats_shared->lock, LW_SHARED);
+    entry = (BinMapperTableStats *) hash_search(bin_stats_hash, &key, HASH_FIND, NULL);
+    LWLockRelease(bin_stats_shared->lock);
+
+    if (entry)
+        return entry;
+
+    LWLockAcquire(bin_stats_shared->lock, LW_EXCLUSIVE);
+    entry = (BinMapperTableStats *) hash_search(bin_stats_hash, &key, HASH_ENTER_NULL, &found);
+    if (entry && !found) {
+        int stage;
+        int k;
+
+        pg_atomic_init_u64(&entry->rows, 0);
+        pg_atomic_init_u64(&entry->bytes, 0);
+        pg_atomic_init_u64(&entry->errors, 0);
+        pg_atomic_init_u64(&entry->decode_ns, 0);
+        pg_atomic_init_u64(&entry->layout_builds, 0);
+        for (stage = 0; stage < BIN_NSTAGES; stage++) {
+            for (k = 0; k < BIN_LATENCY_BUCKETS; k++)
+                pg_atomic_init_u64(&entry->latency[stage][k], 0);
+            pg_atomic_init_u64(&entry->latency_ns[stage], 0);
+        }
+    }
+    LWLockRelease(bin_stats_shared->lock);
+
+    return entry;
+}
+
+/* Одна длительность этапа в гистограмму таблицы */
+void
+bin_stats_count_latency(TableBinaryLayout *layout, BinStage stage, uint64 ns)
+{
+    int k;
+
+    if (layout->stats == NULL)
+        return;
+
+    k = (ns == 0) ? 0 : pg_leftmost_one_pos64(ns);
+    if (k >= BIN_LATENCY_BUCKETS)
+        k = BIN_LATENCY_BUCKETS - 1;
+
+    pg_atomic_fetch_add_u64(&layout->stats->latency[stage][k], 1);
+    pg_atomic_fetch_add_u64(&layout->stats->latency_ns[stage], ns);
+}
+
+/*
+ * Перцентиль q (0..1) в микросекундах по корзинам гистограммы:
+ * линейная интерполяция внутри корзины, в которую он попал.
+ */
+static double
+latency_percentile(const uint64 *buckets, uint64 calls, double q)
+{
+    double rank = q * (double) calls;
+    uint64 seen = 0;
+    int k;
+
+    for (k = 0; k < BIN_LATENCY_BUCKETS; k++) {
+        double lo;
+        double hi;
+
+        if (buckets[k] == 0)
+            continue;
+        if ((double) (seen + buckets[k]) >= rank) {
+            lo = (k == 0) ? 0.0 : ldexp(1.0, k);
+            hi = ldexp(1.0, k + 1);
+            return (lo + (hi - lo) * (rank - (double) seen) / (double) buckets[k]) / 1000.0;
+        }
+        seen += buckets[k];
+    }
+
+    return ldexp(1.0, BIN_LATENCY_BUCKETS) / 1000.0;
+}
+
+static void
+bin_stats_check_available(void)
+{
+    if (bin_stats_hash == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_binmapper must be loaded via shared_preload_libraries")));
+}
+
+
+PG_FUNCTION_INFO_V1(pg_stat_binmapper);
+
+Datum
+pg_stat_binmapper(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    TupleDesc tupdesc;
+    Tuplestorestate *tupstore;
+    MemoryContext oldcxt;
+    HASH_SEQ_STATUS hash_seq;
+    BinMapperTableStats *entry;
+
+    bin_stats_check_available();
+
+    if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("set-valued function called in context that cannot accept a set")));
+    if (!(rsinfo->allowedModes & SFRM_Materialize))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("materialize mode required, but it is not allowed in this context")));
+
+    oldcxt = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+    tupstore = tuplestore_begin_heap(rsinfo->allowedModes & SFRM_Materialize_Random,
+                                     false, work_mem);
+    MemoryContextSwitchTo(oldcxt);
+
+    LWLockAcquire(bin_stats_shared->lock, LW_SHARED);
+
+    hash_seq_init(&hash_seq, bin_stats_hash);
+    while ((entry = hash_seq_search(&hash_seq)) != NULL) {
+        Datum values[7];
+        bool nulls[7];
+
+        memset(nulls, 0, sizeof(nulls));
+        values[0] = ObjectIdGetDatum(entry->key.dbid);
+        values[1] = ObjectIdGetDatum(entry->key.relid);
+        values[2] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->rows));
+        values[3] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->bytes));
+        values[4] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->errors));
+        values[5] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->decode_ns));
+        values[6] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->layout_builds));
+
+        tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+    }
+
+    LWLockRelease(bin_stats_shared->lock);
+
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupstore;
+    rsinfo->setDesc = tupdesc;
+
+    return (Datum) 0;
+}
+
+
+PG_FUNCTION_INFO_V1(pg_stat_binmapper_reset);
+
+/*
+ * Обнуляет счётчики. Записи остаются на месте: на них ссылаются
+ * layout-ы в других backend-ах.
+ */
+Datum
+pg_stat_binmapper_reset(PG_FUNCTION_ARGS)
+{
+    HASH_SEQ_STATUS hash_seq;
+    BinMapperTableStats *entry;
+
+    bin_stats_check_available();
+
+    LWLockAcquire(bin_stats_shared->lock, LW_SHARED);
+
+    hash_seq_init(&hash_seq, bin_stats_hash);
+    while ((entry = hash_seq_search(&hash_seq)) != NULL) {
+        int stage;
+        int k;
+
+        pg_atomic_write_u64(&entry->rows, 0);
+        pg_atomic_write_u64(&entry->bytes, 0);
+        pg_atomic_write_u64(&entry->errors, 0);
+        pg_atomic_write_u64(&entry->decode_ns, 0);
+        pg_atomic_write_u64(&entry->layout_builds, 0);
+        for (stage = 0; stage < BIN_NSTAGES; stage++) {
+            for (k = 0; k < BIN_LATENCY_BUCKETS; k++)
+                pg_atomic_write_u64(&entry->latency[stage][k], 0);
+            pg_atomic_write_u64(&entry->latency_ns[stage], 0);
+        }
+    }
+
+    LWLockRelease(bin_stats_shared->lock);
+
+    PG_RETURN_VOID();
+}
+
+
+PG_FUNCTION_INFO_V1(pg_stat_binmapper_latency);
+
+/*
+ * Строка на таблицу и этап, в котором был хоть один вызов. Счётчики
+ * читаются по одному, не снимком, поэтому у идущей прямо сейчас загрузки
+ * сумма корзин может чуть разойтись с latency_ns.
+ */
+Datum
+pg_stat_binmapper_latency(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    TupleDesc tupdesc;
+    Tuplestorestate *tupstore;
+    MemoryContext oldcxt;
+    HASH_SEQ_STATUS hash_seq;
+    BinMapperTableStats *entry;
+
+    bin_stats_check_available();
+
+    if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("set-valued function called in context that cannot accept a set")));
+    if (!(rsinfo->allowedModes & SFRM_Materialize))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("materialize mode required, but it is not allowed in this context")));
+
+    oldcxt = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+    tupstore = tuplestore_begin_heap(rsinfo->allowedModes & SFRM_Materialize_Random,
+                                     false, work_mem);
+
+    LWLockAcquire(bin_stats_shared->lock, LW_SHARED);
+
+    hash_seq_init(&hash_seq, bin_stats_hash);
+    while ((entry = hash_seq_search(&hash_seq)) != NULL) {
+        int stage;
+
+        for (stage = 0; stage < BIN_NSTAGES; stage++) {
+            uint64 buckets[BIN_LATENCY_BUCKETS];
+            Datum bucket_datums[BIN_LATENCY_BUCKETS];
+            uint64 calls = 0;
+            Datum values[9];
+            bool nulls[9];
+            int k;
+
+            for (k = 0; k < BIN_LATENCY_BUCKETS; k++) {
+                buckets[k] = pg_atomic_read_u64(&entry->latency[stage][k]);
+                bucket_datums[k] = Int64GetDatum((int64) buckets[k]);
+                calls += buckets[k];
+            }
+            if (calls == 0)
+                continue;
+
+            memset(nulls, 0, sizeof(nulls));
+            values[0] = ObjectIdGetDatum(entry->key.dbid);
+            values[1] = ObjectIdGetDatum(entry->key.relid);
+            values[2] = CStringGetTextDatum(bin_stage_names[stage]);
+            values[3] = Int64GetDatum((int64) calls);
+            values[4] = Float8GetDatum((double) pg_atomic_read_u64(&entry->latency_ns[stage]) /
+                                       (double) calls / 1000.0);
+            values[5] = Float8GetDatum(latency_percentile(buckets, calls, 0.5));
+            values[6] = Float8GetDatum(latency_percentile(buckets, calls, 0.99));
+            values[7] = Float8GetDatum(latency_percentile(buckets, calls, 0.999));
+            values[8] = PointerGetDatum(construct_array(bucket_datums, BIN_LATENCY_BUCKETS,
+                                                        INT8OID, sizeof(int64),
+                                                        FLOAT8PASSBYVAL, TYPALIGN_DOUBLE));
+
+            tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+        }
+    }
+
+    LWLockRelease(bin_stats_shared->lock);
+    MemoryContextSwitchTo(oldcxt);
+
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupstore;
+    rsinfo->setDesc = tupdesc;
+
+    return (Datum) 0;
+}
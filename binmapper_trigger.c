@@ -0,0 +1,457 @@
+/*
+ * binmapper_trigger.c
+ *		bin_ingest_trigger('target') - приём записей через INSERT во view
+ *		или в промежуточную таблицу.
+ *
+ * Замена PL/pgSQL-триггера из README: NEW.payload разбирается layout-ом
+ * целевой таблицы и пишется в неё через table_tuple_insert, без SPI и
+ * плана на каждую строку. Целевая таблица, её индексы, EState и слот
+ * открываются при первом срабатывании триггера в транзакции и живут до
+ * её конца: JDBC sink шлёт тысячи однострочных вставок подряд, и каждая
+ * из них стоит теперь только разбора и вставки.
+ *
+ * Всё это держится в TopTransactionContext и на TopTransactionResourceOwner,
+ * поэтому переживает конец оператора. При коммите таблицы закрываются в
+ * XACT_EVENT_PRE_COMMIT, при откате их освобождает resource owner. Перед
+ * любой служебной командой цели тоже закрываются: открытая таблица не
+ * даёт выполнить над ней ALTER TABLE или TRUNCATE в той же транзакции.
+ * Проверки цели те же, что у bin_copy_into (bin_target_check), только
+ * секционированная цель построчному режиму не подходит: ExecFindPartition
+ * на каждую строку съел бы весь выигрыш. Операторный режим её принимает.
+ *
+ * Операторный вариант (AFTER INSERT ... REFERENCING NEW TABLE на
+ * промежуточной таблице) нужен для пакетных вставок JDBC: он читает
+ * transition table целиком и пишет её через bin_bulk_*. У view
+ * transition table не бывает, поэтому строки оседают в промежуточной
+ * таблице, и очищать её приходится отдельно.
+ */
+#include "postgres.h"
+
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/table.h"
+#include "access/tableam.h"
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_type.h"
+#include "commands/trigger.h"
+#include "executor/executor.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/resowner.h"
+#include "utils/tuplestore.h"
+#include "utils/varlena.h"
+
+#include "pg_binmapper.h"
+
+/* Открытая цель одного триггера, ключ - OID триггера */
+typedef struct {
+    Oid tgoid;
+    Oid relid;
+    Relation rel;               /* NULL, пока цель не открыта */
+    EState *estate;
+    ResultRelInfo *resultRelInfo;
+    TupleTableSlot *slot;
+    bool direct;                /* слот heap-кортежей для bin_form_tuple */
+    Oid userid;                 /* для кого проверены права */
+    bool stale;                 /* пришла инвалидация таблицы */
+} BinIngestTarget;
+
+/* Цели текущей транзакции; NULL вне транзакции или до первого срабатывания */
+static HTAB *bin_ingest_targets = NULL;
+
+static void ingest_target_close(BinIngestTarget *target);
+
+static void
+ingest_target_open(BinIngestTarget *target)
+{
+    ResourceOwner oldowner = CurrentResourceOwner;
+    MemoryContext oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+
+    CurrentResourceOwner = TopTransactionResourceOwner;
+    PG_TRY();
+    {
+        Relation rel = table_open(target->relid, RowExclusiveLock);
+        TableBinaryLayout *layout;
+
+        target->rel = rel;
+        bin_target_check(rel, false);
+
+        layout = get_or_create_layout(target->relid);
+        target->direct = bin_target_direct(rel, layout);
+        target->estate = bin_target_estate(rel, GetCurrentCommandId(true), &target->resultRelInfo);
+        target->slot = target->direct ?
+            MakeSingleTupleTableSlot(RelationGetDescr(rel), &TTSOpsHeapTuple) :
+            table_slot_create(rel, NULL);
+        target->userid = GetUserId();
+        target->stale = false;
+    }
+    PG_CATCH();
+    {
+        /* Наполовину открытая цель не должна пережить ошибку */
+        CurrentResourceOwner = oldowner;
+        MemoryContextSwitchTo(oldcxt);
+        ingest_target_close(target);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    CurrentResourceOwner = oldowner;
+    MemoryContextSwitchTo(oldcxt);
+}
+
+static void
+ingest_target_close(BinIngestTarget *target)
+{
+    ResourceOwner oldowner = CurrentResourceOwner;
+
+    if (target->rel == NULL)
+        return;
+
+    CurrentResourceOwner = TopTransactionResourceOwner;
+    if (target->slot)
+        ExecDropSingleTupleTableSlot(target->slot);
+    if (target->estate) {
+        ExecCloseIndices(target->resultRelInfo);
+        FreeExecutorState(target->estate);
+    }
+    /* Блокировка остаётся до конца транзакции, как у table_close в executor-е */
+    table_close(target->rel, NoLock);
+    CurrentResourceOwner = oldowner;
+
+    target->rel = NULL;
+    target->estate = NULL;
+    target->resultRelInfo = NULL;
+    target->slot = NULL;
+}
+
+/*
+ * Запись цели триггера. При первом срабатывании в транзакции аргумент
+ * триггера разрешается в таблицу; открывает её ingest_target_get.
+ */
+static BinIngestTarget *
+ingest_target_lookup(Trigger *trigger)
+{
+    BinIngestTarget *target;
+    bool found;
+
+    if (bin_ingest_targets == NULL) {
+        HASHCTL ctl;
+
+        memset(&ctl, 0, sizeof(ctl));
+        ctl.keysize = sizeof(Oid);
+        ctl.entrysize = sizeof(BinIngestTarget);
+        ctl.hcxt = TopTransactionContext;
+        bin_ingest_targets = hash_create("pg_binmapper ingest targets", 16, &ctl,
+                                         HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    target = (BinIngestTarget *) hash_search(bin_ingest_targets, &trigger->tgoid,
+                                             HASH_ENTER, &found);
+    if (!found) {
+        List *names;
+
+        target->relid = InvalidOid;
+        target->rel = NULL;
+        target->estate = NULL;
+        target->resultRelInfo = NULL;
+        target->slot = NULL;
+
+        if (trigger->tgnargs != 1) {
+            hash_search(bin_ingest_targets, &trigger->tgoid, HASH_REMOVE, NULL);
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("trigger \"%s\" must pass the target table to bin_ingest_trigger",
+                            trigger->tgname),
+                     errhint("Use EXECUTE FUNCTION bin_ingest_trigger('target_table').")));
+        }
+
+        PG_TRY();
+        {
+#if PG_VERSION_NUM >= 160000
+            names = stringToQualifiedNameList(trigger->tgargs[0], NULL);
+#else
+            names = stringToQualifiedNameList(trigger->tgargs[0]);
+#endif
+            target->relid = RangeVarGetRelid(makeRangeVarFromNameList(names),
+                                             RowExclusiveLock, false);
+        }
+        PG_CATCH();
+        {
+            hash_search(bin_ingest_targets, &trigger->tgoid, HASH_REMOVE, NULL);
+            PG_RE_THROW();
+        }
+        PG_END_TRY();
+    }
+
+    return target;
+}
+
+/*
+ * Открытая цель строчного триггера. После инвалидации таблицы или смены
+ * роли цель открывается заново.
+ */
+static BinIngestTarget *
+ingest_target_get(Trigger *trigger)
+{
+    BinIngestTarget *target = ingest_target_lookup(trigger);
+
+    if (target->rel && (target->stale || target->userid != GetUserId()))
+        ingest_target_close(target);
+    if (target->rel == NULL)
+        ingest_target_open(target);
+
+    return target;
+}
+
+static void
+ingest_insert(BinIngestTarget *target, TableBinaryLayout *layout, const char *raw_ptr)
+{
+    EState *estate = target->estate;
+    ResultRelInfo *resultRelInfo = target->resultRelInfo;
+    TupleTableSlot *slot = target->slot;
+    CommandId mycid = GetCurrentCommandId(true);
+    MemoryContext oldcxt;
+
+    estate->es_output_cid = mycid;
+    oldcxt = MemoryContextSwitchTo(GetPerTupleMemoryContext(estate));
+
+    ExecClearTuple(slot);
+    if (target->direct) {
+        ExecStoreHeapTuple(bin_form_tuple(layout, raw_ptr), slot, false);
+    } else {
+        /* payload живёт до конца срабатывания, а запись вставляется сразу */
+        bin_decode_record(layout, raw_ptr, slot->tts_values, slot->tts_isnull, true);
+        ExecStoreVirtualTuple(slot);
+    }
+
+    if (target->rel->rd_att->constr)
+        ExecConstraints(resultRelInfo, slot, estate);
+
+    table_tuple_insert(target->rel, slot, mycid, 0, NULL);
+
+    if (resultRelInfo->ri_NumIndices > 0)
+        list_free(ExecInsertIndexTuples(resultRelInfo, slot, estate,
+                                        false, false, NULL, NIL
+#if PG_VERSION_NUM >= 160000
+                                        , false
+#endif
+                                        ));
+
+    ExecClearTuple(slot);
+    MemoryContextSwitchTo(oldcxt);
+    ResetPerTupleExprContext(estate);
+}
+
+
+/*
+ * Операторный режим: все payload из transition table вставляются одним
+ * проходом через bin_bulk_*, как у bin_copy_into, так что пачка JDBC
+ * превращается в table_multi_insert по 1000 строк.
+ */
+static void
+ingest_transition_table(TriggerData *trigdata, int attnum)
+{
+    Oid relid = ingest_target_lookup(trigdata->tg_trigger)->relid;
+    Tuplestorestate *newtable = trigdata->tg_newtable;
+    TupleTableSlot *slot;
+    MemoryContext row_cxt;
+    MemoryContext oldcxt;
+    Relation rel;
+    BinBulkInsert *bi;
+    TableBinaryLayout *layout;
+    uint64 nrecords = 0;
+    uint64 nbytes = 0;
+    instr_time start_time;
+
+    rel = table_open(relid, RowExclusiveLock);
+    bi = bin_bulk_begin(rel);
+    layout = get_or_create_layout(relid);
+
+    slot = MakeSingleTupleTableSlot(RelationGetDescr(trigdata->tg_relation), &TTSOpsMinimalTuple);
+    row_cxt = AllocSetContextCreate(CurrentMemoryContext,
+                                    "bin_ingest_trigger row",
+                                    ALLOCSET_DEFAULT_SIZES);
+
+    INSTR_TIME_SET_ZERO(start_time);
+    if (bin_track_timing) INSTR_TIME_SET_CURRENT(start_time);
+
+    /* Transition table могут читать и другие триггеры оператора */
+    tuplestore_rescan(newtable);
+    while (tuplestore_gettupleslot(newtable, true, false, slot)) {
+        Datum datum;
+        bool isnull;
+        bytea *payload;
+
+        CHECK_FOR_INTERRUPTS();
+
+        datum = slot_getattr(slot, attnum, &isnull);
+        if (isnull)
+            continue;
+
+        /*
+         * Распакованный payload живёт до следующей строки: запись
+         * bin_bulk_add_record копирует. Сам вызов остаётся в текущем
+         * контексте, там создаются его слоты.
+         */
+        oldcxt = MemoryContextSwitchTo(row_cxt);
+        payload = DatumGetByteaPP(datum);
+        MemoryContextSwitchTo(oldcxt);
+
+        bin_check_record_size(layout, VARDATA_ANY(payload), VARSIZE_ANY_EXHDR(payload));
+        bin_bulk_add_record(bi, VARDATA_ANY(payload));
+        nrecords++;
+        nbytes += VARSIZE_ANY_EXHDR(payload);
+        MemoryContextReset(row_cxt);
+    }
+
+    bin_bulk_finish(bi);
+
+    if (bin_track_timing) bin_stats_count_decode_time(layout, start_time);
+    bin_count_parsed(layout, nrecords, nbytes);
+
+    ExecDropSingleTupleTableSlot(slot);
+    MemoryContextDelete(row_cxt);
+    table_close(rel, NoLock);
+}
+
+
+PG_FUNCTION_INFO_V1(bin_ingest_trigger);
+
+/*
+ * Триггер на INSERT. Колонка payload (bytea) новой строки - одна запись
+ * целевой таблицы; строки с NULL в payload пропускаются.
+ *
+ * Строчный: INSTEAD OF на view возвращает NEW, чтобы INSERT сообщал
+ * число принятых строк; BEFORE на таблице возвращает NULL, и
+ * строка-носитель не сохраняется. Операторный AFTER INSERT с
+ * REFERENCING NEW TABLE разбирает все строки оператора разом.
+ */
+Datum
+bin_ingest_trigger(PG_FUNCTION_ARGS)
+{
+    TriggerData *trigdata = (TriggerData *) fcinfo->context;
+    TupleDesc tupdesc;
+    BinIngestTarget *target;
+    TableBinaryLayout *layout;
+    Datum datum;
+    bool isnull;
+    bytea *payload;
+    int attnum;
+
+    if (!CALLED_AS_TRIGGER(fcinfo))
+        ereport(ERROR,
+                (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+                 errmsg("bin_ingest_trigger: not called by trigger manager")));
+
+    if (!TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+        ereport(ERROR,
+                (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+                 errmsg("bin_ingest_trigger must be fired for INSERT")));
+
+    tupdesc = RelationGetDescr(trigdata->tg_relation);
+    attnum = SPI_fnumber(tupdesc, "payload");
+    if (attnum <= 0 || SPI_gettypeid(tupdesc, attnum) != BYTEAOID)
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_COLUMN),
+                 errmsg("relation \"%s\" has no bytea column \"payload\"",
+                        RelationGetRelationName(trigdata->tg_relation))));
+
+    if (TRIGGER_FIRED_FOR_STATEMENT(trigdata->tg_event)) {
+        if (trigdata->tg_newtable == NULL)
+            ereport(ERROR,
+                    (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+                     errmsg("statement-level bin_ingest_trigger requires a transition table"),
+                     errhint("Declare the trigger AFTER INSERT with REFERENCING NEW TABLE.")));
+
+        ingest_transition_table(trigdata, attnum);
+        return PointerGetDatum(NULL);
+    }
+
+    datum = heap_getattr(trigdata->tg_trigtuple, attnum, tupdesc, &isnull);
+    if (!isnull) {
+        target = ingest_target_get(trigdata->tg_trigger);
+        layout = get_or_create_layout(target->relid);
+
+        payload = DatumGetByteaPP(datum);
+        bin_check_record_size(layout, VARDATA_ANY(payload), VARSIZE_ANY_EXHDR(payload));
+        ingest_insert(target, layout, VARDATA_ANY(payload));
+        bin_count_parsed(layout, 1, VARSIZE_ANY_EXHDR(payload));
+    }
+
+    if (TRIGGER_FIRED_INSTEAD(trigdata->tg_event))
+        return PointerGetDatum(trigdata->tg_trigtuple);
+    return PointerGetDatum(NULL);
+}
+
+/*
+ * Закрывает открытые цели; следующее срабатывание триггера откроет их
+ * снова. Вызывается из ProcessUtility_hook и перед коммитом.
+ */
+void
+bin_trigger_release_targets(void)
+{
+    HASH_SEQ_STATUS status;
+    BinIngestTarget *target;
+
+    if (bin_ingest_targets == NULL)
+        return;
+
+    hash_seq_init(&status, bin_ingest_targets);
+    while ((target = (BinIngestTarget *) hash_seq_search(&status)) != NULL)
+        ingest_target_close(target);
+}
+
+/*
+ * При коммите закрывает открытые цели, пока resource owner ещё не
+ * проверяет утечки; при откате их освобождает он сам.
+ */
+static void
+bin_trigger_xact_callback(XactEvent event, void *arg)
+{
+    switch (event) {
+        case XACT_EVENT_PRE_COMMIT:
+        case XACT_EVENT_PRE_PREPARE:
+            bin_trigger_release_targets();
+            break;
+        case XACT_EVENT_COMMIT:
+        case XACT_EVENT_ABORT:
+        case XACT_EVENT_PREPARE:
+            /* Память уходит вместе с TopTransactionContext */
+            bin_ingest_targets = NULL;
+            break;
+        default:
+            break;
+    }
+}
+
+static void
+bin_trigger_relcache_callback(Datum arg, Oid relid)
+{
+    HASH_SEQ_STATUS status;
+    BinIngestTarget *target;
+
+    if (bin_ingest_targets == NULL)
+        return;
+
+    hash_seq_init(&status, bin_ingest_targets);
+    while ((target = (BinIngestTarget *) hash_seq_search(&status)) != NULL) {
+        if (!OidIsValid(relid) || target->relid == relid)
+            target->stale = true;
+    }
+}
+
+/*
+ * Вызывается из _PG_init.
+ */
+void
+bin_trigger_init(void)
+{
+    RegisterXactCallback(bin_trigger_xact_callback, NULL);
+    CacheRegisterRelcacheCallback(bin_trigger_relcache_callback, (Datum) 0);
+}
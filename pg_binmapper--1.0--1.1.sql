@@ -0,0 +1,215 @@
+\echo Use "ALTER EXTENSION pg_binmapper UPDATE TO '1.1'" to load this file. \quit
+
+CREATE OR REPLACE FUNCTION bin_parse_batch(
+    target_table regclass,
+    payload bytea,
+    on_error text DEFAULT 'abort')
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'parse_binary_batch'
+LANGUAGE C STRICT PARALLEL SAFE;
+
+-- Records [start_rec, start_rec + n_rec) of the batch only, so that a large
+-- batch can be split between parallel workers or sessions
+CREATE OR REPLACE FUNCTION bin_parse_batch(
+    target_table regclass,
+    payload bytea,
+    start_rec bigint,
+    n_rec bigint,
+    on_error text DEFAULT 'abort')
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'parse_binary_batch_range'
+LANGUAGE C STRICT PARALLEL SAFE;
+
+ALTER FUNCTION bin_parse(regclass, bytea) PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION bin_stats(
+    OUT rows_parsed bigint,
+    OUT bytes_parsed bigint,
+    OUT size_errors bigint,
+    OUT cache_hits bigint,
+    OUT cache_misses bigint,
+    OUT layout_build_time_ns bigint)
+RETURNS record
+AS 'MODULE_PATHNAME', 'binmapper_backend_stats'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION pg_stat_binmapper(
+    OUT dbid oid,
+    OUT relid oid,
+    OUT rows bigint,
+    OUT bytes bigint,
+    OUT errors bigint,
+    OUT decode_time_ns bigint,
+    OUT layout_builds bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_stat_binmapper'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION pg_stat_binmapper_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'pg_stat_binmapper_reset'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION pg_stat_binmapper_reset() FROM PUBLIC;
+
+CREATE VIEW pg_stat_binmapper AS
+    SELECT s.relid,
+           s.relid::regclass AS relname,
+           s.rows,
+           s.bytes,
+           s.errors,
+           s.decode_time_ns,
+           s.layout_builds
+    FROM pg_stat_binmapper() s
+    WHERE s.dbid = (SELECT oid FROM pg_database WHERE datname = current_database());
+
+-- Per-stage latency histograms, collected with pg_binmapper.track_latency;
+-- bucket k counts calls that took [2^k, 2^(k+1)) nanoseconds
+CREATE OR REPLACE FUNCTION pg_stat_binmapper_latency(
+    OUT dbid oid,
+    OUT relid oid,
+    OUT stage text,
+    OUT calls bigint,
+    OUT mean_us float8,
+    OUT p50_us float8,
+    OUT p99_us float8,
+    OUT p999_us float8,
+    OUT buckets bigint[])
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_stat_binmapper_latency'
+LANGUAGE C STRICT;
+
+CREATE VIEW pg_stat_binmapper_latency AS
+    SELECT s.relid,
+           s.relid::regclass AS relname,
+           s.stage,
+           s.calls,
+           s.mean_us,
+           s.p50_us,
+           s.p99_us,
+           s.p999_us,
+           s.buckets
+    FROM pg_stat_binmapper_latency() s
+    WHERE s.dbid = (SELECT oid FROM pg_database WHERE datname = current_database());
+
+CREATE OR REPLACE FUNCTION bin_copy_into(
+    target_table regclass,
+    payload bytea,
+    on_error text DEFAULT 'abort')
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'copy_binary_batch'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION bin_copy_into(
+    target_table regclass,
+    payload bytea,
+    start_rec bigint,
+    n_rec bigint,
+    on_error text DEFAULT 'abort')
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'copy_binary_batch_range'
+LANGUAGE C STRICT;
+
+-- Per-table layout options, read when the layout is built
+CREATE TABLE bin_layout_config (
+    relid regclass PRIMARY KEY,
+    byte_order text NOT NULL DEFAULT 'big'
+        CHECK (byte_order IN ('big', 'little')),
+    null_bitmap boolean NOT NULL DEFAULT false,
+    framing text NOT NULL DEFAULT 'auto'
+        CHECK (framing IN ('auto', 'always', 'never'))
+);
+
+SELECT pg_catalog.pg_extension_config_dump('bin_layout_config', '');
+
+GRANT SELECT ON bin_layout_config TO PUBLIC;
+
+CREATE OR REPLACE FUNCTION bin_invalidate_layout(target_table regclass)
+RETURNS void
+AS 'MODULE_PATHNAME', 'bin_invalidate_layout'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION bin_register_layout(
+    target_table regclass,
+    byte_order text DEFAULT 'big',
+    null_bitmap boolean DEFAULT false,
+    framing text DEFAULT 'auto')
+RETURNS void
+AS 'MODULE_PATHNAME', 'bin_register_layout'
+LANGUAGE C STRICT;
+
+-- Per-column wire encodings, read when the layout is built
+CREATE TABLE bin_column_config (
+    relid regclass NOT NULL,
+    attname name NOT NULL,
+    encoding text NOT NULL
+        CHECK (encoding IN ('native', 'unix_days', 'unix_ms', 'unix_us', 'unix_ns',
+                            'scaled', 'fixed', 'array')),
+    param integer,
+    PRIMARY KEY (relid, attname)
+);
+
+SELECT pg_catalog.pg_extension_config_dump('bin_column_config', '');
+
+GRANT SELECT ON bin_column_config TO PUBLIC;
+
+CREATE OR REPLACE FUNCTION bin_check_column_encoding(
+    target_table regclass,
+    column_name name,
+    encoding text,
+    param integer)
+RETURNS void
+AS 'MODULE_PATHNAME', 'bin_check_column_encoding'
+LANGUAGE C;
+
+-- param: decimal digits for 'scaled', field length in bytes for 'fixed',
+-- element count for 'array'
+CREATE OR REPLACE FUNCTION bin_register_column(
+    target_table regclass,
+    column_name name,
+    encoding text,
+    param integer DEFAULT NULL)
+RETURNS void
+AS 'MODULE_PATHNAME', 'bin_register_column'
+LANGUAGE C;
+
+-- Batches and records rejected with on_error => 'dead_letter'
+CREATE TABLE bin_dead_letter (
+    id bigint GENERATED ALWAYS AS IDENTITY PRIMARY KEY,
+    relid regclass NOT NULL,
+    received_at timestamptz NOT NULL DEFAULT now(),
+    record_no bigint,           -- NULL when the whole batch was rejected
+    reason text NOT NULL,
+    payload bytea NOT NULL
+);
+
+SELECT pg_catalog.pg_extension_config_dump('bin_dead_letter', '');
+
+-- Ingest trigger for views (FOR EACH ROW) and staging tables (FOR EACH STATEMENT
+-- with a NEW transition table); the argument is the target table
+CREATE OR REPLACE FUNCTION bin_ingest_trigger()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'bin_ingest_trigger'
+LANGUAGE C;
+
+-- Citus: groups a batch by shard of a hash-distributed table, reading only
+-- the distribution column of each record
+CREATE OR REPLACE FUNCTION bin_shard_split(
+    target_table regclass,
+    payload bytea,
+    OUT shardid bigint,
+    OUT shard_name text,
+    OUT nodename text,
+    OUT nodeport int,
+    OUT nrecords bigint,
+    OUT batch bytea)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'shard_split_batch'
+LANGUAGE C STRICT;
+
+-- Builds and publishes layouts ahead of the first batch; with no argument,
+-- the tables listed in pg_binmapper.prewarm_tables
+CREATE OR REPLACE FUNCTION bin_prewarm(tables regclass[] DEFAULT NULL)
+RETURNS integer
+AS 'MODULE_PATHNAME', 'bin_prewarm'
+LANGUAGE C;
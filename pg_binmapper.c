@@ -1,6 +1,8 @@
 #include "postgres.h"
 #include "fmgr.h"
+#include "access/detoast.h"
 #include "access/table.h"
+#include "access/xact.h"
 #include "access/htup_details.h"
 #include "catalog/pg_type.h"
 #include "funcapi.h"
@@ -11,67 +13,455 @@
 #include "utils/uuid.h"
 #include "port/pg_bswap.h"
 #include "funcapi.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#if PG_VERSION_NUM >= 160000
+#include "nodes/miscnodes.h"
+#endif
+#include "port/pg_crc32c.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/tuplestore.h"
+
+#include "pg_binmapper.h"
 
 PG_MODULE_MAGIC;
 
+/* Запись layout_cache; сам layout живёт в собственном контексте */
 typedef struct {
     Oid relid;
-    TupleDesc tupdesc;
-    int *offsets;
-    int total_binary_size;
-    bool is_valid;
-} TableBinaryLayout;
+    TableBinaryLayout *layout;
+} BinLayoutCacheEntry;
 
 static HTAB *layout_cache = NULL;
+static BinMapperCounters bin_counters;
+
+/*
+ * У каждого layout свой контекст "pg_binmapper layout" с именем таблицы
+ * в качестве идентификатора, дочерний к bin_layout_cxt; их видно в
+ * pg_backend_memory_contexts. Сброшенный layout может ещё держать
+ * текущий оператор, поэтому инвалидация не удаляет контекст сразу, а
+ * переносит его в bin_retired_cxt, который чистится в конце транзакции.
+ */
+static MemoryContext bin_layout_cxt = NULL;
+static MemoryContext bin_retired_cxt = NULL;
+
+/* Растёт на каждой инвалидации; layout, при сборке которого она пришла, не кэшируется */
+static uint64 bin_layout_inval_count = 0;
+
+/* pg_binmapper.trace_sample: писать в лог каждую N-ю запись, 0 - выключено */
+static int bin_trace_sample = 0;
+
+bool bin_track_timing = false;
+
+bool bin_track_latency = false;
 
+/* Убирает layout из кэша. Не выделяет память: вызывается из callback-а */
+static void
+retire_layout(BinLayoutCacheEntry *entry)
+{
+    MemoryContextSetParent(entry->layout->cxt, bin_retired_cxt);
+    hash_search(layout_cache, &entry->relid, HASH_REMOVE, NULL);
+}
+
+/*
+ * relcache callback. InvalidOid приходит при сбросе всего relcache
+ * (например, после переполнения очереди инвалидаций), тогда сбрасываются
+ * все layout.
+ */
 static void invalidate_layout_cache(Datum arg, Oid relid) {
-    if (layout_cache) hash_search(layout_cache, &relid, HASH_REMOVE, NULL);
+    BinLayoutCacheEntry *entry;
+
+    bin_layout_inval_count++;
+
+    if (layout_cache) {
+        if (OidIsValid(relid)) {
+            entry = (BinLayoutCacheEntry *) hash_search(layout_cache, &relid, HASH_FIND, NULL);
+            if (entry)
+                retire_layout(entry);
+        } else {
+            HASH_SEQ_STATUS status;
+
+            hash_seq_init(&status, layout_cache);
+            while ((entry = (BinLayoutCacheEntry *) hash_seq_search(&status)) != NULL)
+                retire_layout(entry);
+        }
+    }
+    bin_registry_invalidate(relid);
+}
+
+/* Освобождает сброшенные layout, когда на них гарантированно никто не ссылается */
+static void
+bin_layout_xact_callback(XactEvent event, void *arg)
+{
+    switch (event) {
+        case XACT_EVENT_COMMIT:
+        case XACT_EVENT_PARALLEL_COMMIT:
+        case XACT_EVENT_ABORT:
+        case XACT_EVENT_PARALLEL_ABORT:
+        case XACT_EVENT_PREPARE:
+            MemoryContextDeleteChildren(bin_retired_cxt);
+            break;
+        default:
+            break;
+    }
 }
 
 void _PG_init(void) {
     HASHCTL ctl;
     memset(&ctl, 0, sizeof(ctl));
     ctl.keysize = sizeof(Oid);
-    ctl.entrysize = sizeof(TableBinaryLayout);
-    layout_cache = hash_create("BinMapperCache", 1024, &ctl, HASH_ELEM | HASH_BLOBS);
+    ctl.entrysize = sizeof(BinLayoutCacheEntry);
+
+    bin_layout_cxt = AllocSetContextCreate(TopMemoryContext,
+                                           "pg_binmapper layouts",
+                                           ALLOCSET_DEFAULT_SIZES);
+    bin_retired_cxt = AllocSetContextCreate(bin_layout_cxt,
+                                            "pg_binmapper retired layouts",
+                                            ALLOCSET_SMALL_SIZES);
+    ctl.hcxt = bin_layout_cxt;
+    layout_cache = hash_create("BinMapperCache", 1024, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
     CacheRegisterRelcacheCallback(invalidate_layout_cache, (Datum) 0);
+    RegisterXactCallback(bin_layout_xact_callback, NULL);
+
+    DefineCustomIntVariable("pg_binmapper.trace_sample",
+                            "Logs one of every N parsed records.",
+                            "Zero disables tracing.",
+                            &bin_trace_sample,
+                            0, 0, INT_MAX,
+                            PGC_SUSET, 0,
+                            NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("pg_binmapper.track_timing",
+                             "Collects time spent decoding into pg_stat_binmapper.",
+                             NULL,
+                             &bin_track_timing,
+                             false,
+                             PGC_SUSET, 0,
+                             NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("pg_binmapper.track_latency",
+                             "Collects per-stage latency histograms into pg_stat_binmapper_latency.",
+                             NULL,
+                             &bin_track_latency,
+                             false,
+                             PGC_SUSET, 0,
+                             NULL, NULL, NULL);
+
+    bin_stats_init();
+    bin_registry_init();
+    bin_copy_init();
+    bin_compress_init();
+    bin_trigger_init();
+    bin_prewarm_init();
+    bin_listener_init();
+    bin_simd_init();
+
+    MarkGUCPrefixReserved("pg_binmapper");
+}
+
+/*
+ * Операция для varlena-колонки или -1, если тип не поддерживается.
+ */
+static int
+varlena_opcode(Oid typid)
+{
+    switch (typid) {
+        case TEXTOID:
+        case VARCHAROID:
+            return BIN_OP_TEXT;
+        case BYTEAOID:
+            return BIN_OP_BYTEA;
+        case NUMERICOID:
+            return BIN_OP_VAR_INPUT;
+        default:
+            return -1;
+    }
+}
+
+/*
+ * Компилирует offsets/tupdesc в плотный массив операций. Вызывается
+ * в контексте, где должна жить программа (layout->cxt).
+ */
+static void
+compile_decode_program(TableBinaryLayout *layout)
+{
+    int natts = layout->tupdesc->natts;
+    bool swap = (layout->little_endian != BIN_HOST_LITTLE_ENDIAN);
+    int i;
+
+    layout->ops = (BinDecodeOp *) palloc0(Max(natts, 1) * sizeof(BinDecodeOp));
+    layout->null_template = (bool *) palloc0(Max(natts, 1) * sizeof(bool));
+    layout->nops = 0;
+
+    for (i = 0; i < natts; i++) {
+        Form_pg_attribute attr = TupleDescAttr(layout->tupdesc, i);
+        BinDecodeOp *op;
+
+        if (layout->offsets[i] == -1) {
+            layout->null_template[i] = true;
+            continue;
+        }
+
+        op = &layout->ops[layout->nops++];
+        op->attnum = i;
+        op->offset = layout->offsets[i];
+        op->len = attr->attlen;
+
+        if (layout->columns && layout->columns[i].converted) {
+            op->opcode = layout->columns[i].opcode;
+            op->len = layout->columns[i].len;
+            op->arg = layout->columns[i].arg;
+        }
+        else if (attr->attlen == -1) {
+            op->opcode = varlena_opcode(attr->atttypid);
+            op->len = BIN_VARLENA_PAIR_SIZE;
+        }
+        else if (!attr->attbyval && attr->attalign == TYPALIGN_CHAR) op->opcode = BIN_OP_REF_INPLACE;
+        else if (!attr->attbyval) op->opcode = BIN_OP_COPY_BYREF;
+        else if (attr->attlen == 8) op->opcode = swap ? BIN_OP_BSWAP64 : BIN_OP_LOAD64;
+        else if (attr->attlen == 4) op->opcode = swap ? BIN_OP_BSWAP32 : BIN_OP_LOAD32;
+        else if (attr->attlen == 2) op->opcode = swap ? BIN_OP_BSWAP16 : BIN_OP_LOAD16;
+        else op->opcode = BIN_OP_COPY8;
+    }
+}
+
+/*
+ * Для layout без удалённых колонок и NULL данные heap-кортежа - это
+ * те же поля, что и в записи, только с выравниванием по typalign.
+ * Считает смещение каждого поля в кортеже, чтобы bin_form_tuple
+ * писал поля сразу на место, минуя values/nulls и heap_fill_tuple.
+ * Иначе оставляет direct_form выключенным.
+ */
+static void
+prepare_direct_form(TableBinaryLayout *layout)
+{
+    TupleDesc tupdesc = layout->tupdesc;
+    Size off = 0;
+    int i;
+
+    layout->direct_form = false;
+    if (layout->nops != tupdesc->natts)
+        return;
+
+    for (i = 0; i < layout->nops; i++) {
+        BinDecodeOp *op = &layout->ops[i];
+        Form_pg_attribute attr = TupleDescAttr(tupdesc, op->attnum);
+
+        if (attr->attlen <= 0)
+            return;
+        off = att_align_nominal(off, attr->attalign);
+        op->heap_offset = (int32) off;
+        off += attr->attlen;
+    }
+
+    layout->heap_data_len = (int) off;
+    layout->direct_form = true;
+
+    /*
+     * Соседние поля одной ширины, идущие подряд и в записи, и в кортеже,
+     * сливаются в один участок: его переставляет векторное ядро, а
+     * копируемые как есть поля - один memcpy.
+     */
+    layout->heap_ops = (BinDecodeOp *) MemoryContextAlloc(layout->cxt,
+                                                          layout->nops * sizeof(BinDecodeOp));
+    layout->nheap_ops = 0;
+
+    for (i = 0; i < layout->nops; i++) {
+        BinDecodeOp run = layout->ops[i];
+        BinDecodeOp *prev;
+        int width;
+
+        switch (run.opcode) {
+            case BIN_OP_BSWAP32:
+                run.opcode = BIN_OP_BSWAP32_RUN;
+                run.len = 1;
+                width = 4;
+                break;
+            case BIN_OP_BSWAP64:
+                run.opcode = BIN_OP_BSWAP64_RUN;
+                run.len = 1;
+                width = 8;
+                break;
+            case BIN_OP_COPY8:
+            case BIN_OP_LOAD16:
+            case BIN_OP_LOAD32:
+            case BIN_OP_LOAD64:
+            case BIN_OP_COPY_BYREF:
+            case BIN_OP_REF_INPLACE:
+                run.opcode = BIN_OP_COPY_BYREF;
+                run.len = TupleDescAttr(tupdesc, run.attnum)->attlen;
+                width = 1;
+                break;
+            default:
+                layout->heap_ops[layout->nheap_ops++] = run;
+                continue;
+        }
+
+        prev = layout->nheap_ops > 0 ? &layout->heap_ops[layout->nheap_ops - 1] : NULL;
+        if (prev && prev->opcode == run.opcode &&
+            prev->offset + prev->len * width == run.offset &&
+            prev->heap_offset + prev->len * width == run.heap_offset)
+            prev->len += run.len;
+        else
+            layout->heap_ops[layout->nheap_ops++] = run;
+    }
+
+    bin_shape_select(layout);
+}
+
+/*
+ * Раскладывает живые колонки таблицы подряд, без выравнивания:
+ * сначала фиксированные, затем trailer с парами varlena-колонок.
+ * При неподдерживаемом типе освобождает layout и бросает ERROR.
+ */
+static void
+build_layout_offsets(TableBinaryLayout *layout, Relation rel)
+{
+    int natts = layout->tupdesc->natts;
+    int i;
+
+    layout->nvarlena = 0;
+    layout->total_binary_size = layout->bitmap_size;
+
+    for (i = 0; i < natts; i++) {
+        Form_pg_attribute attr = TupleDescAttr(layout->tupdesc, i);
+        int col_len = 0;
+
+        if (attr->attisdropped || attr->attnum <= 0) {
+            layout->offsets[i] = -1;
+            continue;
+        }
+
+        if (layout->columns && layout->columns[i].converted) col_len = layout->columns[i].len;
+        else if (attr->attlen > 0) col_len = attr->attlen;
+        else if (attr->atttypid == 2950) col_len = UUID_LEN; /* UUIDOID */
+        else if (attr->attlen == -1 && varlena_opcode(attr->atttypid) >= 0) {
+            /* место в trailer назначается во втором проходе */
+            layout->nvarlena++;
+            continue;
+        }
+        else {
+            Oid typid = attr->atttypid;
+
+            /* layout ещё не в кэше: его контекст уйдёт вместе с контекстом вызова */
+            table_close(rel, AccessShareLock);
+            elog(ERROR, "Unsupported type OID %u", typid);
+			
+        }
+
+        layout->offsets[i] = layout->total_binary_size;
+        layout->total_binary_size += col_len;
+    }
+
+    if (layout->nvarlena == 0)
+        return;
+
+    for (i = 0; i < natts; i++) {
+        Form_pg_attribute attr = TupleDescAttr(layout->tupdesc, i);
+
+        if (attr->attisdropped || attr->attnum <= 0 || attr->attlen != -1 ||
+            (layout->columns && layout->columns[i].converted))
+            continue;
+
+        layout->offsets[i] = layout->total_binary_size;
+        layout->total_binary_size += BIN_VARLENA_PAIR_SIZE;
+    }
+}
+
+/*
+ * Готовит функции ввода для BIN_OP_VAR_INPUT. Вызывается и для layout,
+ * взятого из реестра: FmgrInfo в shared memory не переносится.
+ */
+static void
+prepare_var_input(TableBinaryLayout *layout)
+{
+    int natts = layout->tupdesc->natts;
+    int i;
+
+    if (layout->nvarlena == 0)
+        return;
+
+    layout->var_finfo = (FmgrInfo *) MemoryContextAllocZero(layout->cxt,
+                                                            natts * sizeof(FmgrInfo));
+    layout->var_ioparams = (Oid *) MemoryContextAllocZero(layout->cxt,
+                                                          natts * sizeof(Oid));
+
+    for (i = 0; i < layout->nops; i++) {
+        BinDecodeOp *op = &layout->ops[i];
+        Oid typinput;
+
+        if (op->opcode != BIN_OP_VAR_INPUT)
+            continue;
+
+        getTypeInputInfo(TupleDescAttr(layout->tupdesc, op->attnum)->atttypid,
+                         &typinput, &layout->var_ioparams[op->attnum]);
+        fmgr_info_cxt(typinput, &layout->var_finfo[op->attnum], layout->cxt);
+    }
 }
 
-static TableBinaryLayout*
+TableBinaryLayout*
 get_or_create_layout(Oid relid) {
-	TableBinaryLayout *layout_from_cache;
+    BinLayoutCacheEntry *entry;
 	TupleDesc res_tupdesc;
     bool found;
 	TableBinaryLayout *layout;
-    layout_from_cache = (TableBinaryLayout *) hash_search(layout_cache, &relid, HASH_FIND, &found);
+    MemoryContext cxt;
+    instr_time start_time;
+    instr_time build_time;
+    uint64 generation;
+    uint64 inval_count;
+    entry = (BinLayoutCacheEntry *) hash_search(layout_cache, &relid, HASH_FIND, NULL);
 
-    if (found && layout_from_cache->is_valid) {
-        return layout_from_cache;
+    if (entry) {
+        bin_counters.cache_hits++;
+        return entry->layout;
     }
 
-    Relation rel = table_open(relid, AccessExclusiveLock);
+    bin_counters.cache_misses++;
+    BIN_PROBE1(layout__miss, relid);
+    INSTR_TIME_SET_CURRENT(start_time);
+
+    /*
+     * Для чтения описания таблицы достаточно AccessShareLock: он
+     * не конфликтует ни с чтением, ни с записью, но не даёт выполнить
+     * ALTER TABLE, пока мы строим layout. Последующий ALTER всё равно
+     * сбросит кэш через relcache callback.
+     */
+    Relation rel = table_open(relid, AccessShareLock);
 	
-    layout_from_cache = (TableBinaryLayout *) hash_search(layout_cache, &relid, HASH_FIND, &found);
+    entry = (BinLayoutCacheEntry *) hash_search(layout_cache, &relid, HASH_FIND, NULL);
 
-    if (found && layout_from_cache->is_valid) {
-		table_close(rel, AccessExclusiveLock);
-        return layout_from_cache;
+    if (entry) {
+		table_close(rel, AccessShareLock);
+        return entry->layout;
     }
-	
-	layout = palloc0( sizeof(TableBinaryLayout));
+
+    /* Поколение реестра читаем после table_open: инвалидации уже приняты */
+    generation = bin_registry_generation(relid);
+    inval_count = bin_layout_inval_count;
+
+    /*
+     * Пока layout строится, его контекст висит на контексте вызова и
+     * переезжает в bin_layout_cxt только готовым: ошибка посреди сборки
+     * освобождает его вместе с вызовом.
+     */
+    cxt = AllocSetContextCreate(CurrentMemoryContext,
+                                "pg_binmapper layout",
+                                ALLOCSET_SMALL_SIZES);
+    MemoryContextCopyAndSetIdentifier(cxt, RelationGetRelationName(rel));
+
+	layout = (TableBinaryLayout *) MemoryContextAllocZero(cxt, sizeof(TableBinaryLayout));
+    layout->cxt = cxt;
 	
     res_tupdesc = RelationGetDescr(rel);
     int natts = res_tupdesc->natts;
-    int i;
 
-    /* ВАЖНО: Переключаемся в TopMemoryContext перед копированием */
-    MemoryContext oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+    MemoryContext oldcxt = MemoryContextSwitchTo(cxt);
 
     /* Глубокое копирование дескриптора, который выживет после table_close */
     layout->tupdesc = CreateTupleDescCopy(res_tupdesc);
-    
-    /* Выделяем оффсеты тоже в TopMemoryContext */
     layout->offsets = (int *) palloc0(natts * sizeof(int));
     
     /* Возвращаемся в контекст функции */
@@ -79,136 +469,1709 @@ get_or_create_layout(Oid relid) {
 
     layout->relid = relid;
     layout->total_binary_size = 0;
+    layout->stats = bin_stats_get_entry(relid);
+    bin_config_load(layout);
+    if (layout->null_bitmap) {
+        int nlive = 0;
+        int i;
 
-    for (i = 0; i < natts; i++) {
-        Form_pg_attribute attr = TupleDescAttr(layout->tupdesc, i);
-        int col_len = 0;
+        for (i = 0; i < natts; i++) {
+            Form_pg_attribute attr = TupleDescAttr(layout->tupdesc, i);
 
-        if (attr->attisdropped || attr->attnum <= 0) {
-            layout->offsets[i] = -1;
+            if (!attr->attisdropped && attr->attnum > 0)
+                nlive++;
+        }
+        layout->bitmap_size = (nlive + 7) / 8;
+    }
+
+    if (!bin_registry_attach(layout)) {
+        build_layout_offsets(layout, rel);
+
+        oldcxt = MemoryContextSwitchTo(cxt);
+        compile_decode_program(layout);
+        MemoryContextSwitchTo(oldcxt);
+
+        bin_registry_publish(layout, generation);
+        if (layout->stats) pg_atomic_fetch_add_u64(&layout->stats->layout_builds, 1);
+    }
+
+    /*
+     * Всё, что раньше делалось на каждом вызове: рабочие массивы,
+     * регистрация дескриптора и тип строки для заголовка кортежа.
+     */
+    oldcxt = MemoryContextSwitchTo(cxt);
+    layout->values = (Datum *) palloc0(Max(natts, 1) * sizeof(Datum));
+    layout->nulls = (bool *) palloc0(Max(natts, 1) * sizeof(bool));
+    MemoryContextSwitchTo(oldcxt);
+    BlessTupleDesc(layout->tupdesc);
+    layout->reltype = rel->rd_rel->reltype;
+    prepare_direct_form(layout);
+    prepare_var_input(layout);
+    bin_prepare_encodings(layout);
+
+    if (bin_layout_inval_count == inval_count) {
+        entry = (BinLayoutCacheEntry *) hash_search(layout_cache, &relid, HASH_ENTER, &found);
+        entry->layout = layout;
+        MemoryContextSetParent(cxt, bin_layout_cxt);
+    } else {
+        /* Пока строили, пришла инвалидация: layout годится только до конца транзакции */
+        MemoryContextSetParent(cxt, bin_retired_cxt);
+    }
+
+    table_close(rel, AccessShareLock);
+
+    INSTR_TIME_SET_CURRENT(build_time);
+    INSTR_TIME_SUBTRACT(build_time, start_time);
+    bin_counters.layout_build_ns += BIN_INSTR_TIME_GET_NANOSEC(build_time);
+    
+    return layout;
+}
+
+
+/*
+ * Полная длина записи по raw_ptr, avail - сколько байт доступно.
+ * Для layout без varlena это total_binary_size. Иначе длина берётся из
+ * trailer; если доступна не вся фиксированная часть с trailer,
+ * возвращает -1. Результат может быть больше avail: запись обрезана.
+ */
+int64
+bin_record_size(TableBinaryLayout *layout, const char *raw_ptr, Size avail)
+{
+    const char *pair;
+    uint64 var_end = 0;
+    int k;
+
+    if (layout->nvarlena == 0)
+        return layout->total_binary_size;
+    if (avail < (Size) layout->total_binary_size)
+        return -1;
+
+    pair = raw_ptr + layout->total_binary_size - layout->nvarlena * BIN_VARLENA_PAIR_SIZE;
+    for (k = 0; k < layout->nvarlena; k++, pair += BIN_VARLENA_PAIR_SIZE) {
+        uint64 end = (uint64) bin_read_uint32(layout, pair) + bin_read_uint32(layout, pair + 4);
+
+        var_end = Max(var_end, end);
+    }
+
+    if (var_end > MaxAllocSize)
+        ereport(ERROR,
+                (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                 errmsg("SIZE ERROR: variable-length area of " UINT64_FORMAT " bytes is too large",
+                        var_end)));
+
+    return layout->total_binary_size + (int64) var_end;
+}
+
+/* varchar(n): как и varchar_input, лишние символы - ошибка */
+static bool
+varchar_too_long(Form_pg_attribute attr, const char *ptr, uint32 len)
+{
+    return attr->atttypmod >= (int32) VARHDRSZ &&
+        pg_mbstrlen_with_len(ptr, len) > attr->atttypmod - (int32) VARHDRSZ;
+}
+
+/*
+ * Значение varlena-колонки. Границы пары уже проверены
+ * bin_record_size. Данные копируются одним memcpy за заголовок varlena.
+ */
+static Datum
+decode_varlena_field(TableBinaryLayout *layout, const BinDecodeOp *op, const char *raw_ptr)
+{
+    Form_pg_attribute attr = TupleDescAttr(layout->tupdesc, op->attnum);
+    uint32 var_off = bin_read_uint32(layout, raw_ptr + op->offset);
+    uint32 var_len = bin_read_uint32(layout, raw_ptr + op->offset + 4);
+    const char *var_ptr = raw_ptr + layout->total_binary_size + var_off;
+
+    if (op->opcode == BIN_OP_VAR_INPUT) {
+        char *str = pnstrdup(var_ptr, var_len);
+
+        return InputFunctionCall(&layout->var_finfo[op->attnum], str,
+                                 layout->var_ioparams[op->attnum], attr->atttypmod);
+    }
+
+    if (op->opcode == BIN_OP_TEXT) {
+        pg_verifymbstr(var_ptr, var_len, false);
+        if (varchar_too_long(attr, var_ptr, var_len))
+            ereport(ERROR,
+                    (errcode(ERRCODE_STRING_DATA_RIGHT_TRUNCATION),
+                     errmsg("value too long for type character varying(%d)",
+                            attr->atttypmod - (int32) VARHDRSZ)));
+    }
+
+    {
+        bytea *result = (bytea *) palloc(var_len + VARHDRSZ);
+
+        SET_VARSIZE(result, var_len + VARHDRSZ);
+        memcpy(VARDATA(result), var_ptr, var_len);
+        return PointerGetDatum(result);
+    }
+}
+
+/*
+ * Проверяет значения записи, на которых разбор может упасть посреди
+ * пачки: кодировку и длину text/varchar и текст numeric. Возвращает
+ * NULL или текст ошибки. Нужна только при on_error, отличном от abort.
+ * Мягкая проверка ввода numeric есть только с PG 16; на PG 15 ошибка в
+ * numeric по-прежнему прерывает пачку.
+ */
+char *
+bin_record_check(TableBinaryLayout *layout, const char *raw_ptr)
+{
+    const BinDecodeOp *op = layout->ops;
+    const BinDecodeOp *end = op + layout->nops;
+    const uint8 *bitmap = NULL;
+
+    if (layout->nvarlena == 0 && !layout->record_checks)
+        return NULL;
+    if (bin_record_has_nulls(layout, raw_ptr))
+        bitmap = (const uint8 *) raw_ptr;
+
+    for (; op < end; op++) {
+        Form_pg_attribute attr;
+        const char *var_ptr;
+        uint32 var_len;
+
+        if (op->opcode != BIN_OP_TEXT && op->opcode != BIN_OP_VAR_INPUT &&
+            !BIN_OP_IS_CONVERSION(op->opcode))
+            continue;
+        if (bitmap && bin_bitmap_isnull(bitmap, op - layout->ops))
+            continue;
+
+        if (BIN_OP_IS_CONVERSION(op->opcode)) {
+            char *reason = bin_check_converted(layout, op, raw_ptr + op->offset);
+
+            if (reason != NULL)
+                return reason;
             continue;
         }
 
-        if (attr->attlen > 0) col_len = attr->attlen;
-        else if (attr->atttypid == 2950) col_len = UUID_LEN; /* UUIDOID */
-        else {
-            table_close(rel, AccessExclusiveLock);
-			layout->is_valid = false;
-            if (layout->tupdesc) FreeTupleDesc(layout->tupdesc);
-	        if (layout->offsets) pfree(layout->offsets);    
-            pfree(layout); 
-			
-            elog(ERROR, "Unsupported type OID %u", attr->atttypid);
-			
+        attr = TupleDescAttr(layout->tupdesc, op->attnum);
+        var_ptr = raw_ptr + layout->total_binary_size + bin_read_uint32(layout, raw_ptr + op->offset);
+        var_len = bin_read_uint32(layout, raw_ptr + op->offset + 4);
+
+        if (op->opcode == BIN_OP_TEXT) {
+            if (!pg_verifymbstr(var_ptr, var_len, true))
+                return psprintf("invalid byte sequence for encoding \"%s\" in column \"%s\"",
+                                GetDatabaseEncodingName(), NameStr(attr->attname));
+            if (varchar_too_long(attr, var_ptr, var_len))
+                return psprintf("value too long for type character varying(%d) in column \"%s\"",
+                                attr->atttypmod - (int32) VARHDRSZ, NameStr(attr->attname));
         }
+#if PG_VERSION_NUM >= 160000
+        else {
+            ErrorSaveContext escontext = {T_ErrorSaveContext};
+            Datum value;
 
-        layout->offsets[i] = layout->total_binary_size;
-        layout->total_binary_size += col_len;
+            escontext.details_wanted = true;
+            if (!InputFunctionCallSafe(&layout->var_finfo[op->attnum], pnstrdup(var_ptr, var_len),
+                                       layout->var_ioparams[op->attnum], attr->atttypmod,
+                                       (Node *) &escontext, &value))
+                return psprintf("%s in column \"%s\"", escontext.error_data->message,
+                                NameStr(attr->attname));
+        }
+#endif
     }
 
-    layout->is_valid = true;
-	
-    layout_from_cache = (TableBinaryLayout *) hash_search(layout_cache, &relid, HASH_ENTER, &found);
-	layout_from_cache->is_valid=0;
-	memcpy(layout_from_cache,layout,sizeof(TableBinaryLayout));
-	
-	
-    table_close(rel, AccessExclusiveLock);
-	
-	pfree(layout);
-    
-    return layout_from_cache;
+    return NULL;
 }
 
+/*
+ * Значение поля одной операции программы. Память под by-reference
+ * значения выделяется в текущем контексте.
+ */
+static inline Datum
+decode_op(TableBinaryLayout *layout, const BinDecodeOp *op, const char *raw_ptr, bool inplace)
+{
+    const char *field_ptr = raw_ptr + op->offset;
 
-PG_FUNCTION_INFO_V1(parse_binary_payload);
+    switch (op->opcode) {
+        case BIN_OP_BSWAP64: {
+            uint64 v;
+            memcpy(&v, field_ptr, 8);
+            return Int64GetDatum((int64) pg_bswap64(v));
+        }
+        case BIN_OP_BSWAP32: {
+            uint32 v;
+            memcpy(&v, field_ptr, 4);
+            return Int32GetDatum((int32) pg_bswap32(v));
+        }
+        case BIN_OP_BSWAP16: {
+            uint16 v;
+            memcpy(&v, field_ptr, 2);
+            return Int16GetDatum((int16) pg_bswap16(v));
+        }
+        case BIN_OP_LOAD64: {
+            int64 v;
+            memcpy(&v, field_ptr, 8);
+            return Int64GetDatum(v);
+        }
+        case BIN_OP_LOAD32: {
+            int32 v;
+            memcpy(&v, field_ptr, 4);
+            return Int32GetDatum(v);
+        }
+        case BIN_OP_LOAD16: {
+            int16 v;
+            memcpy(&v, field_ptr, 2);
+            return Int16GetDatum(v);
+        }
+        case BIN_OP_COPY8:
+            return (Datum) *(const uint8 *) field_ptr;
+        case BIN_OP_TEXT:
+        case BIN_OP_BYTEA:
+        case BIN_OP_VAR_INPUT:
+            return decode_varlena_field(layout, op, raw_ptr);
+        case BIN_OP_REF_INPLACE:
+            if (inplace)
+                return PointerGetDatum(field_ptr);
+            /* FALLTHROUGH */
+        case BIN_OP_COPY_BYREF: {
+            char *copy = (char *) palloc(op->len);
+            memcpy(copy, field_ptr, op->len);
+            return PointerGetDatum(copy);
+        }
+        default:
+            return bin_decode_converted(layout, op, field_ptr);
+    }
+}
+
+/*
+ * Раскладывает одну упакованную запись в массивы values/nulls,
+ * исполняя скомпилированную программу layout->ops.
+ * Память под by-reference значения выделяется в текущем контексте.
+ * При inplace значения без выравнивания (uuid) не копируются, а
+ * указывают прямо в raw_ptr: так можно, только если payload живёт
+ * дольше, чем values (heap_form_tuple, tuplestore_putvalues).
+ */
+void
+bin_decode_record(TableBinaryLayout *layout, const char *raw_ptr, Datum *values, bool *nulls,
+                  bool inplace)
+{
+    const BinDecodeOp *op = layout->ops;
+    const BinDecodeOp *end = op + layout->nops;
+    const uint8 *bitmap = NULL;
+
+    memcpy(nulls, layout->null_template, layout->tupdesc->natts * sizeof(bool));
+
+    /* Без единого NULL карта не читается на каждом поле */
+    if (bin_record_has_nulls(layout, raw_ptr))
+        bitmap = (const uint8 *) raw_ptr;
+
+    for (; op < end; op++) {
+        if (bitmap && bin_bitmap_isnull(bitmap, op - layout->ops)) {
+            nulls[op->attnum] = true;
+            continue;
+        }
+        values[op->attnum] = decode_op(layout, op, raw_ptr, inplace);
+    }
+}
 
+/*
+ * Значение одной колонки записи без разбора остальных; opno - номер
+ * операции в layout->ops. by-reference значения копируются.
+ */
 Datum
-parse_binary_payload(PG_FUNCTION_ARGS)
+bin_decode_column(TableBinaryLayout *layout, const char *raw_ptr, int opno, bool *isnull)
 {
-    Oid table_oid = PG_GETARG_OID(0);
-    bytea *payload = PG_GETARG_BYTEA_P(1);
-    char *raw_ptr = VARDATA_ANY(payload);
-    int input_size = VARSIZE_ANY_EXHDR(payload);
+    *isnull = bin_record_has_nulls(layout, raw_ptr) &&
+        bin_bitmap_isnull((const uint8 *) raw_ptr, opno);
+    if (*isnull)
+        return (Datum) 0;
+    return decode_op(layout, &layout->ops[opno], raw_ptr, false);
+}
 
-    TableBinaryLayout *layout;
-    Datum *values;
-    bool *nulls;
+/*
+ * Собирает heap-кортеж из одной записи в текущем контексте.
+ * Для direct_form заголовок заполняется так же, как в heap_form_tuple,
+ * а поля пишутся сразу по heap_offset; иначе запись идёт через
+ * layout->values/nulls (с inplace, так что raw_ptr должен быть жив
+ * до возврата).
+ */
+/*
+ * Пустой кортеж direct_form: заголовок как у heap_form_tuple, данные
+ * обнулены и ждут заполнения по heap_offset.
+ */
+static HeapTuple
+alloc_direct_tuple(TableBinaryLayout *layout)
+{
+    Size hoff = MAXALIGN(SizeofHeapTupleHeader);
+    Size len = hoff + layout->heap_data_len;
     HeapTuple tuple;
-    Datum result_datum;
-    int i;
+    HeapTupleHeader td;
 
-    layout = get_or_create_layout(table_oid);
+    tuple = (HeapTuple) palloc0(HEAPTUPLESIZE + len);
+    tuple->t_data = td = (HeapTupleHeader) ((char *) tuple + HEAPTUPLESIZE);
+    tuple->t_len = len;
+    ItemPointerSetInvalid(&(tuple->t_self));
+    tuple->t_tableOid = InvalidOid;
+
+    HeapTupleHeaderSetDatumLength(td, len);
+    HeapTupleHeaderSetTypeId(td, layout->tupdesc->tdtypeid);
+    HeapTupleHeaderSetTypMod(td, layout->tupdesc->tdtypmod);
+    HeapTupleHeaderSetNatts(td, layout->tupdesc->natts);
+    td->t_hoff = hoff;
 
-    elog(LOG, "[BINMAPPER] Start: TableOID=%u, InputSize=%d, ExpectedSize=%d", 
-         table_oid, input_size, layout->total_binary_size);
+    return tuple;
+}
+
+/* Значение by-value преобразования прямо в данные кортежа */
+static inline void
+store_converted(TableBinaryLayout *layout, const BinDecodeOp *op, const char *field_ptr,
+                char *dst)
+{
+    Datum value = bin_decode_converted(layout, op, field_ptr);
 
-    if (input_size != layout->total_binary_size) {
-        ereport(ERROR, (errmsg("SIZE ERROR: expected %d, got %d", 
-                layout->total_binary_size, input_size)));
+    if (op->len == 8) {
+        int64 v = DatumGetInt64(value);
+        memcpy(dst, &v, 8);
+    } else {
+        int32 v = DatumGetInt32(value);
+        memcpy(dst, &v, 4);
     }
+}
 
-    elog(LOG, "[BINMAPPER] Trying alloc size %d",layout->tupdesc->natts * sizeof(Datum));
-    values = (Datum *) palloc0(layout->tupdesc->natts * sizeof(Datum));
-    nulls = (bool *) palloc0(layout->tupdesc->natts * sizeof(bool));
+HeapTuple
+bin_form_tuple(TableBinaryLayout *layout, const char *raw_ptr)
+{
+    const BinDecodeOp *op = layout->heap_ops;
+    const BinDecodeOp *end = op + layout->nheap_ops;
+    HeapTuple tuple;
+    char *data;
 
-    for (i = 0; i < layout->tupdesc->natts; i++) {
-        Form_pg_attribute attr = TupleDescAttr(layout->tupdesc, i);
-        char *field_ptr;
-        int len;
+    /* Кортеж с NULL нужен с битовой картой, его собирает heap_form_tuple */
+    if (!layout->direct_form || bin_record_has_nulls(layout, raw_ptr)) {
+        bin_decode_record(layout, raw_ptr, layout->values, layout->nulls, true);
+        return heap_form_tuple(layout->tupdesc, layout->values, layout->nulls);
+    }
 
-        if (layout->offsets[i] == -1) {
-            nulls[i] = true;
-            continue;
+    tuple = alloc_direct_tuple(layout);
+    data = (char *) tuple->t_data + tuple->t_data->t_hoff;
+
+    if (layout->form_shape) {
+        layout->form_shape(data, raw_ptr + layout->shape_offset);
+        return tuple;
+    }
+
+    for (; op < end; op++) {
+        const char *field_ptr = raw_ptr + op->offset;
+        char *dst = data + op->heap_offset;
+
+        switch (op->opcode) {
+            case BIN_OP_BSWAP64_RUN:
+                if (op->len == 1) {
+                    uint64 v;
+                    memcpy(&v, field_ptr, 8);
+                    v = pg_bswap64(v);
+                    memcpy(dst, &v, 8);
+                } else {
+                    bin_bswap64_run(dst, field_ptr, op->len);
+                }
+                break;
+            case BIN_OP_BSWAP32_RUN:
+                if (op->len == 1) {
+                    uint32 v;
+                    memcpy(&v, field_ptr, 4);
+                    v = pg_bswap32(v);
+                    memcpy(dst, &v, 4);
+                } else {
+                    bin_bswap32_run(dst, field_ptr, op->len);
+                }
+                break;
+            case BIN_OP_BSWAP16: {
+                uint16 v;
+                memcpy(&v, field_ptr, 2);
+                v = pg_bswap16(v);
+                memcpy(dst, &v, 2);
+                break;
+            }
+            case BIN_OP_COPY_BYREF:
+                memcpy(dst, field_ptr, op->len);
+                break;
+            default:
+                /* unix_days, unix_*: by-value, ширина поля та же, что в кортеже */
+                store_converted(layout, op, field_ptr, dst);
+                break;
         }
+    }
+
+    return tuple;
+}
+
+
+/*
+ * Собирает запись r колоночного тела обратно в строку row. Битовая
+ * карта NULL в колоночном теле - первая "колонка" шириной bitmap_size.
+ */
+static void
+gather_columnar_record(TableBinaryLayout *layout, const char *data, uint32 nrecords,
+                       uint32 r, char *row)
+{
+    const BinDecodeOp *op;
+
+    if (layout->bitmap_size > 0)
+        memcpy(row, data + (Size) r * layout->bitmap_size, layout->bitmap_size);
+
+    for (op = layout->ops; op < layout->ops + layout->nops; op++)
+        memcpy(row + op->offset,
+               data + (Size) nrecords * op->offset + (Size) r * op->len,
+               op->len);
+}
 
-        field_ptr = raw_ptr + layout->offsets[i];
-        len = (attr->attlen > 0) ? attr->attlen : 16;
+/*
+ * Собирает кортежи записей [first, first + n) колоночного payload, где
+ * поле записи r лежит по data + nrecords * op->offset + r * op->len.
+ * Только для direct_form без битовой карты NULL: каждая колонка переставляется одним векторным
+ * проходом во временный буфер и раскладывается по кортежам. Остальные
+ * layout идут построчно через BinBatch.
+ */
+void
+bin_form_columnar(TableBinaryLayout *layout, const char *data, uint32 nrecords,
+                  uint32 first, int n, HeapTuple *tuples)
+{
+    const BinDecodeOp *op = layout->ops;
+    const BinDecodeOp *end = op + layout->nops;
+    char *swapped;
+    int r;
+
+    Assert(layout->direct_form && layout->bitmap_size == 0);
+
+    swapped = (char *) palloc(n * sizeof(uint64));
+
+    for (r = 0; r < n; r++)
+        tuples[r] = alloc_direct_tuple(layout);
 
-        if (attr->attbyval) {
-            uint64 raw_val = 0;
-            memcpy(&raw_val, field_ptr, (len <= 8) ? len : 8);
+    for (; op < end; op++) {
+        const char *src = data + (Size) nrecords * op->offset + (Size) first * op->len;
 
-            if (len == 8) raw_val = pg_bswap64(raw_val);
-            else if (len == 4) raw_val = (uint64)pg_bswap32((uint32)raw_val);
-            else if (len == 2) raw_val = (uint64)pg_bswap16((uint16)raw_val);
+        if (op->opcode == BIN_OP_BSWAP64)
+            bin_bswap64_run(swapped, src, n);
+        else if (op->opcode == BIN_OP_BSWAP32)
+            bin_bswap32_run(swapped, src, n);
 
-            if (attr->atttypid == FLOAT4OID) {
-                union { uint32 i; float4 f; } u;
-                u.i = (uint32)raw_val;
-                values[i] = Float4GetDatum(u.f);
-                elog(DEBUG1, "[BINMAPPER] Col %d (float4): %f", i, u.f);
-            } else {
-                values[i] = (Datum)raw_val;
-                elog(DEBUG1, "[BINMAPPER] Col %d (int/long): %ld", i, (long)raw_val);
+        for (r = 0; r < n; r++) {
+            HeapTupleHeader td = tuples[r]->t_data;
+            char *dst = (char *) td + td->t_hoff + op->heap_offset;
+
+            switch (op->opcode) {
+                case BIN_OP_BSWAP64:
+                case BIN_OP_BSWAP32:
+                    memcpy(dst, swapped + r * op->len, op->len);
+                    break;
+                case BIN_OP_BSWAP16: {
+                    uint16 v;
+                    memcpy(&v, src + r * 2, 2);
+                    v = pg_bswap16(v);
+                    memcpy(dst, &v, 2);
+                    break;
+                }
+                case BIN_OP_UNIX_DAYS:
+                case BIN_OP_UNIX_MS:
+                case BIN_OP_UNIX_US:
+                case BIN_OP_UNIX_NS:
+                    store_converted(layout, op, src + (Size) r * op->len, dst);
+                    break;
+                default:
+                    memcpy(dst, src + (Size) r * op->len, op->len);
+                    break;
             }
-        } else {
-            pg_uuid_t *uuid = (pg_uuid_t *) palloc(sizeof(pg_uuid_t));
-            memcpy(uuid->data, field_ptr, 16);
-            values[i] = UUIDPGetDatum(uuid);
-            elog(DEBUG1, "[BINMAPPER] Col %d (uuid) mapped", i);
         }
     }
 
-    elog(LOG, "[BINMAPPER] Forming tuple and blessing descriptor");
-    
-    /* 
-     * BlessTupleDesc регистрирует структуру RECORD в системе.
-     * Это критично для функций, возвращающих анонимные рекорды.
-     */
-    BlessTupleDesc(layout->tupdesc);
-    tuple = heap_form_tuple(layout->tupdesc, values, nulls);
-    
-    /* Устанавливаем метаданные типа */
-    HeapTupleHeaderSetTypeId(tuple->t_data, get_rel_type_id(table_oid));
-    HeapTupleHeaderSetTypMod(tuple->t_data, -1);
+    pfree(swapped);
+}
 
-    elog(LOG, "[BINMAPPER] Returning HeapTupleHeader as Datum");
+/*
+ * Разбирает заголовок кадра пачки. Возвращает false, если payload не
+ * начинается с BIN_FRAME_MAGIC (старый формат: записи подряд) или layout
+ * зарегистрирован с framing = 'never'. С framing = 'always' такой payload
+ * отвергается целиком: тогда в *reason текст ошибки, иначе там NULL.
+ * Версию и флаги кадра проверяет здесь же; тело проверяет batch_check.
+ */
+bool
+bin_frame_parse(TableBinaryLayout *layout, const char *payload, Size len, BinFrame *frame,
+                char **reason)
+{
+    uint32 nrecords;
+    uint16 reserved;
 
-    /* 
-     * ВНИМАНИЕ: Мы НЕ делаем heap_freetuple(tuple) и pfree(values).
+    *reason = NULL;
+    if (layout->framing == BIN_FRAMING_NEVER)
+        return false;
+    if (len < BIN_FRAME_HEADER_SIZE || memcmp(payload, BIN_FRAME_MAGIC, 4) != 0) {
+        if (layout->framing == BIN_FRAMING_ALWAYS)
+            *reason = pstrdup("FRAME ERROR: batch has no frame header, "
+                              "but the table is registered with framing => 'always'");
+        return false;
+    }
+
+    frame->version = (uint8) payload[4];
+    frame->flags = (uint8) payload[5];
+    memcpy(&reserved, payload + 6, 2);
+    memcpy(&nrecords, payload + 8, 4);
+    frame->nrecords = pg_ntoh32(nrecords);
+    frame->crc = 0;
+    frame->data = payload + BIN_FRAME_HEADER_SIZE;
+    frame->data_len = len - BIN_FRAME_HEADER_SIZE;
+
+    if (frame->version != BIN_FRAME_VERSION)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                 errmsg("unsupported batch frame version %d", frame->version)));
+    if ((frame->flags & ~BIN_FRAME_KNOWN_FLAGS) != 0 || reserved != 0 ||
+        (frame->flags & BIN_FRAME_COMPRESSION) == BIN_FRAME_COMPRESSION)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                 errmsg("unsupported batch frame flags 0x%02X", frame->flags)));
+
+    if (frame->flags & BIN_FRAME_CRC32C) {
+        uint32 crc;
+
+        if (frame->data_len < BIN_FRAME_CRC_SIZE)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                     errmsg("SIZE ERROR: batch frame ends before its checksum")));
+        memcpy(&crc, frame->data, BIN_FRAME_CRC_SIZE);
+        frame->crc = pg_ntoh32(crc);
+        frame->data += BIN_FRAME_CRC_SIZE;
+        frame->data_len -= BIN_FRAME_CRC_SIZE;
+    }
+
+    if (layout->total_binary_size == 0)
+        ereport(ERROR, (errmsg("table %u has no columns to map", layout->relid)));
+
+    /* Длины записей varlena известны только по trailer, их проверит BinBatch */
+    if (layout->nvarlena > 0 && (frame->flags & BIN_FRAME_COLUMNAR))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("columnar frames are not supported for tables with variable-length columns")));
+
+    return true;
+}
+
+/*
+ * Длина тела из записей фиксированной длины: ровно nrecords записей в
+ * кадре или целое их число без кадра. Возвращает NULL или текст ошибки.
+ */
+static char *
+batch_check_size(TableBinaryLayout *layout, bool framed, uint32 nrecords, Size len)
+{
+    if (framed) {
+        if (len != (Size) nrecords * layout->total_binary_size)
+            return psprintf("SIZE ERROR: frame of %u records expects %zu bytes, got %zu",
+                            nrecords, (Size) nrecords * layout->total_binary_size, len);
+    } else if (len % layout->total_binary_size != 0) {
+        return psprintf("SIZE ERROR: batch of %zu bytes is not a multiple of record size %d",
+                        len, layout->total_binary_size);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Проверяет, что payload - ровно одна запись layout.
+ */
+void
+bin_check_record_size(TableBinaryLayout *layout, const char *raw_ptr, int input_size)
+{
+    int64 record_size = bin_record_size(layout, raw_ptr, input_size);
+
+    if (record_size != input_size) {
+        bin_counters.size_errors++;
+        bin_stats_count_error(layout);
+        ereport(ERROR, (errmsg("SIZE ERROR: expected " INT64_FORMAT ", got %d", 
+                record_size < 0 ? (int64) layout->total_binary_size : record_size,
+                input_size)));
+    }
+}
+
+
+PG_FUNCTION_INFO_V1(parse_binary_payload);
+
+Datum
+parse_binary_payload(PG_FUNCTION_ARGS)
+{
+    Oid table_oid = PG_GETARG_OID(0);
+    bytea *payload;
+    char *raw_ptr;
+    int input_size;
+
+    TableBinaryLayout *layout;
+    HeapTuple tuple;
+    instr_time start_time;
+    instr_time call_start;
+    instr_time mark;
+
+    BIN_PROBE1(parse__start, table_oid);
+    bin_latency_mark(&call_start);
+    mark = call_start;
+
+    layout = get_or_create_layout(table_oid);
+    bin_stats_count_stage(layout, BIN_STAGE_LOOKUP, &mark);
+
+    payload = PG_GETARG_BYTEA_PP(1);
+    raw_ptr = VARDATA_ANY(payload);
+    input_size = VARSIZE_ANY_EXHDR(payload);
+    bin_stats_count_stage(layout, BIN_STAGE_DETOAST, &mark);
+
+    bin_check_record_size(layout, raw_ptr, input_size);
+
+    INSTR_TIME_SET_ZERO(start_time);
+    if (bin_track_timing) INSTR_TIME_SET_CURRENT(start_time);
+
+    /* 
+     * Дескриптор зарегистрирован (BlessTupleDesc) при построении layout.
+     * bin_form_tuple копирует в кортеж и uuid, указывающие в payload.
+     */
+    tuple = bin_form_tuple(layout, raw_ptr);
+
+    if (bin_track_timing) bin_stats_count_decode_time(layout, start_time);
+    bin_stats_count_stage(layout, BIN_STAGE_DECODE, &mark);
+
+    bin_counters.rows_parsed++;
+    bin_counters.bytes_parsed += input_size;
+    bin_stats_count_rows(layout, 1, input_size);
+    if (bin_trace_sample > 0 && bin_counters.rows_parsed % bin_trace_sample == 0)
+        elog(LOG, "[BINMAPPER] TableOID=%u, InputSize=%d, RowsParsed=" UINT64_FORMAT,
+             table_oid, input_size, bin_counters.rows_parsed);
+    
+    /* Устанавливаем метаданные типа */
+    HeapTupleHeaderSetTypeId(tuple->t_data, layout->reltype);
+    HeapTupleHeaderSetTypMod(tuple->t_data, -1);
+
+    bin_stats_count_stage(layout, BIN_STAGE_TOTAL, &call_start);
+    BIN_PROBE2(parse__done, table_oid, input_size);
+
+    /* 
+     * ВНИМАНИЕ: Мы НЕ делаем heap_freetuple(tuple).
      * Postgres сам очистит MemoryContext функции после выполнения INSERT.
      * Если мы удалим это сейчас, Postgres получит битый указатель (Segmentation Fault).
      */
     PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
 }
+
+
+/*
+ * Обход записей пачки в любом из форматов: записи подряд или кадр,
+ * фиксированной или переменной длины, по строкам или по колонкам.
+ */
+typedef struct {
+    TableBinaryLayout *layout;
+    const char *data;       /* тело пачки без заголовка кадра */
+    Size len;
+    Size pos;               /* для записей переменной длины */
+    bool framed;
+    bool columnar;
+    uint32 nrecords;        /* заранее известно для кадра и fixed layout */
+    uint32 next;            /* номер следующей записи */
+    uint32 base;            /* номер записи в начале data, если прочитан только диапазон */
+    char *row;              /* запись, собранная из колоночного тела */
+    bool has_crc;
+    uint32 crc;
+} BinBatch;
+
+/*
+ * Целостность тела пачки: CRC-32C кадра, длина для записей фиксированной
+ * длины и, если walk, границы и число записей переменной длины (иначе
+ * их по ходу проверяет batch_next). Возвращает NULL или текст ошибки.
+ */
+static char *
+batch_check(BinBatch *batch, bool walk)
+{
+    TableBinaryLayout *layout = batch->layout;
+    Size pos = 0;
+    uint32 n = 0;
+
+    if (batch->has_crc) {
+        pg_crc32c crc;
+
+        INIT_CRC32C(crc);
+        COMP_CRC32C(crc, batch->data, batch->len);
+        FIN_CRC32C(crc);
+        if (crc != batch->crc)
+            return psprintf("CRC ERROR: batch body checksum is %08X, frame declares %08X",
+                            crc, batch->crc);
+    }
+
+    if (layout->nvarlena == 0)
+        return batch_check_size(layout, batch->framed, batch->nrecords, batch->len);
+
+    if (!walk)
+        return NULL;
+
+    while (pos < batch->len) {
+        int64 size = bin_record_size(layout, batch->data + pos, batch->len - pos);
+
+        if (size < 0 || (Size) size > batch->len - pos)
+            return psprintf("SIZE ERROR: batch ends in the middle of record %u", n);
+        pos += size;
+        n++;
+    }
+    if (batch->framed && n != batch->nrecords)
+        return psprintf("SIZE ERROR: frame declares %u records, body holds %u",
+                        batch->nrecords, n);
+
+    return NULL;
+}
+
+/*
+ * Начинает обход пачки. Нарушение целостности при on_error = abort -
+ * ERROR; иначе пачка целиком уходит в rj и обход сразу заканчивается.
+ */
+static void
+batch_begin(BinBatch *batch, TableBinaryLayout *layout, const char *payload, Size input_size,
+            BinRejects *rj)
+{
+    BinFrame frame;
+    bool framed;
+    char *reason;
+
+    memset(batch, 0, sizeof(*batch));
+    batch->layout = layout;
+
+    framed = bin_frame_parse(layout, payload, input_size, &frame, &reason);
+    if (reason != NULL) {
+        bin_counters.size_errors++;
+        if (rj->on_error == BIN_ON_ERROR_ABORT) {
+            bin_stats_count_error(layout);
+            ereport(ERROR, (errmsg("%s", reason)));
+        }
+        bin_reject_batch(rj, reason, payload, input_size);
+        return;
+    }
+
+    if (framed) {
+        /* Сюда сжатое тело доходит только тогда, когда его нельзя разбирать потоком */
+        if (frame.flags & BIN_FRAME_COMPRESSION) {
+            reason = bin_decompress_frame(layout, &frame);
+            if (reason != NULL) {
+                bin_counters.size_errors++;
+                if (rj->on_error == BIN_ON_ERROR_ABORT) {
+                    bin_stats_count_error(layout);
+                    ereport(ERROR, (errmsg("%s", reason)));
+                }
+                bin_reject_batch(rj, reason, payload, input_size);
+                return;
+            }
+        }
+
+        batch->framed = true;
+        batch->columnar = (frame.flags & BIN_FRAME_COLUMNAR) != 0;
+        batch->has_crc = (frame.flags & BIN_FRAME_CRC32C) != 0;
+        batch->crc = frame.crc;
+        batch->data = frame.data;
+        batch->len = frame.data_len;
+        batch->nrecords = frame.nrecords;
+        /* Вне контекста записи: batch_next вызывают и из короткоживущих */
+        if (batch->columnar)
+            batch->row = (char *) palloc(layout->total_binary_size);
+    } else {
+        batch->data = payload;
+        batch->len = input_size;
+        if (layout->total_binary_size == 0)
+            ereport(ERROR, (errmsg("table %u has no columns to map", layout->relid)));
+    }
+
+    reason = batch_check(batch, rj->on_error != BIN_ON_ERROR_ABORT);
+    if (reason != NULL) {
+        bin_counters.size_errors++;
+        if (rj->on_error == BIN_ON_ERROR_ABORT) {
+            bin_stats_count_error(layout);
+            ereport(ERROR, (errmsg("%s", reason)));
+        }
+
+        bin_reject_batch(rj, reason, payload, input_size);
+        batch->columnar = false;
+        batch->len = 0;
+        batch->nrecords = 0;
+        return;
+    }
+
+    if (!batch->framed && layout->nvarlena == 0)
+        batch->nrecords = batch->len / layout->total_binary_size;
+}
+
+/*
+ * Следующая запись в строковом виде или NULL в конце пачки. Запись
+ * колоночного тела собирается в batch->row и живёт до следующего вызова.
+ */
+static const char *
+batch_next(BinBatch *batch)
+{
+    TableBinaryLayout *layout = batch->layout;
+    const char *rec;
+    int64 size;
+
+    if (batch->columnar) {
+        if (batch->next == batch->nrecords)
+            return NULL;
+        gather_columnar_record(layout, batch->data, batch->nrecords, batch->next++, batch->row);
+        return batch->row;
+    }
+
+    if (layout->nvarlena == 0) {
+        if (batch->next == batch->nrecords)
+            return NULL;
+        return batch->data + (Size) (batch->next++ - batch->base) * layout->total_binary_size;
+    }
+
+    if (batch->pos == batch->len) {
+        if (batch->framed && batch->next != batch->nrecords) {
+            bin_counters.size_errors++;
+            bin_stats_count_error(layout);
+            ereport(ERROR, (errmsg("SIZE ERROR: frame declares %u records, body holds %u",
+                    batch->nrecords, batch->next)));
+        }
+        batch->nrecords = batch->next;
+        return NULL;
+    }
+
+    rec = batch->data + batch->pos;
+    size = bin_record_size(layout, rec, batch->len - batch->pos);
+    if (size < 0 || (Size) size > batch->len - batch->pos) {
+        bin_counters.size_errors++;
+        bin_stats_count_error(layout);
+        ereport(ERROR, (errmsg("SIZE ERROR: batch ends in the middle of record %u", batch->next)));
+    }
+
+    batch->pos += size;
+    batch->next++;
+    return rec;
+}
+
+/*
+ * Пропускает записи до номера first (с нуля), не раскладывая их. Записи
+ * фиксированной длины и колоночного тела адресуются прямо, границы
+ * записей переменной длины приходится пройти.
+ */
+static void
+batch_skip(BinBatch *batch, uint32 first)
+{
+    if (batch->columnar || batch->layout->nvarlena == 0) {
+        batch->next = Min(first, batch->nrecords);
+        return;
+    }
+
+    while (batch->next < first && batch_next(batch) != NULL)
+        ;
+}
+
+/*
+ * Форма с диапазоном для пачки в TOAST или сжатой inline: из значения
+ * читаются только заголовок кадра и записи [first, last), так что
+ * каждый из N процессов, делящих пачку, не разворачивает её целиком.
+ * Годится только для записей фиксированной длины без CRC, сжатия и
+ * колоночного тела: там нужно всё тело сразу. Длина тела проверяется по
+ * размеру значения. Возвращает false, если пачка не такая или не прошла
+ * проверку при on_error, отличном от abort (тогда её отвергнет
+ * batch_begin по развёрнутому значению).
+ */
+static bool
+batch_begin_range(BinBatch *batch, TableBinaryLayout *layout, struct varlena *attr,
+                  BinOnError on_error, uint32 first, uint32 last)
+{
+    struct varlena *slice;
+    BinFrame frame;
+    bool framed;
+    char *reason;
+    Size total;
+    Size offset = 0;
+    uint32 nrecords;
+    uint32 end;
+
+    if (layout->nvarlena > 0 || layout->total_binary_size == 0)
+        return false;
+    if (!VARATT_IS_EXTERNAL_ONDISK(attr) && !VARATT_IS_COMPRESSED(attr))
+        return false;
+
+    total = toast_raw_datum_size(PointerGetDatum(attr)) - VARHDRSZ;
+    slice = detoast_attr_slice(attr, 0, BIN_FRAME_HEADER_SIZE + BIN_FRAME_CRC_SIZE);
+    framed = bin_frame_parse(layout, VARDATA(slice), total, &frame, &reason);
+    pfree(slice);
+    if (reason != NULL ||
+        (framed && (frame.flags & (BIN_FRAME_COLUMNAR | BIN_FRAME_COMPRESSION | BIN_FRAME_CRC32C))))
+        return false;
+
+    reason = framed ? batch_check_size(layout, true, frame.nrecords, frame.data_len) :
+        batch_check_size(layout, false, 0, total);
+    if (reason != NULL) {
+        if (on_error != BIN_ON_ERROR_ABORT)
+            return false;
+        bin_counters.size_errors++;
+        bin_stats_count_error(layout);
+        ereport(ERROR, (errmsg("%s", reason)));
+    }
+
+    if (framed) {
+        offset = total - frame.data_len;
+        nrecords = frame.nrecords;
+    } else
+        nrecords = (uint32) (total / layout->total_binary_size);
+
+    first = Min(first, nrecords);
+    end = Min(last, nrecords);
+
+    memset(batch, 0, sizeof(*batch));
+    batch->layout = layout;
+    batch->framed = framed;
+    batch->base = first;
+    batch->next = first;
+    batch->nrecords = end;
+    if (end > first) {
+        batch->len = (Size) (end - first) * layout->total_binary_size;
+        slice = detoast_attr_slice(attr, (int32) (offset + (Size) first * layout->total_binary_size),
+                                   (int32) batch->len);
+        batch->data = VARDATA(slice);
+    }
+    return true;
+}
+
+/* Порция чтения пачки из TOAST */
+#define BIN_TOAST_SLICE (1024 * 1024)
+
+/*
+ * Пачка, лежащая в TOAST несжатой, читается порциями по BIN_TOAST_SLICE
+ * и режется на записи потоком, так что в памяти не собирается целиком.
+ * Возвращает false, если значение не такое (inline, сжатое, короткое)
+ * или это колоночный кадр, которому нужно всё тело сразу: тогда
+ * вызывающий разворачивает его как обычно. Так же и при on_error,
+ * отличном от abort, если пачку нужно проверить целиком до первой
+ * записи (CRC, записи переменной длины) или она не прошла проверку
+ * длины. В *nrecords и *nbytes возвращаются число записей и размер пачки.
+ */
+static bool
+batch_stream_toast(TableBinaryLayout *layout, struct varlena *attr, BinOnError on_error,
+                   BinRecordCallback callback, void *callback_arg,
+                   uint64 *nrecords, Size *nbytes)
+{
+    struct varatt_external toast_pointer;
+    struct varlena *slice;
+    BinRecordStream stream;
+    BinFrame frame;
+    bool framed;
+    bool has_crc;
+    pg_crc32c crc;
+    char *reason = NULL;
+    Size total;
+    Size pos = 0;
+
+    if (!VARATT_IS_EXTERNAL_ONDISK(attr))
+        return false;
+    VARATT_EXTERNAL_GET_POINTER(toast_pointer, attr);
+    if (VARATT_EXTERNAL_IS_COMPRESSED(toast_pointer))
+        return false;
+    total = VARATT_EXTERNAL_GET_EXTSIZE(toast_pointer);
+    if (total <= BIN_TOAST_SLICE)
+        return false;
+
+    /* По заголовку кадра видно, можно ли идти потоком; длину тела он считает по total */
+    slice = detoast_attr_slice(attr, 0, BIN_FRAME_HEADER_SIZE + BIN_FRAME_CRC_SIZE);
+    framed = bin_frame_parse(layout, VARDATA(slice), total, &frame, &reason);
+    pfree(slice);
+    if (reason != NULL || (framed && (frame.flags & (BIN_FRAME_COLUMNAR | BIN_FRAME_COMPRESSION))))
+        return false;
+    has_crc = framed && (frame.flags & BIN_FRAME_CRC32C);
+    if (on_error != BIN_ON_ERROR_ABORT && (has_crc || layout->nvarlena > 0))
+        return false;
+
+    if (layout->nvarlena == 0)
+        reason = framed ? batch_check_size(layout, true, frame.nrecords, frame.data_len) :
+            batch_check_size(layout, false, 0, total);
+    if (reason != NULL) {
+        if (on_error != BIN_ON_ERROR_ABORT)
+            return false;
+        bin_counters.size_errors++;
+        bin_stats_count_error(layout);
+        ereport(ERROR, (errmsg("%s", reason)));
+    }
+
+    if (framed)
+        pos = total - frame.data_len;
+
+    /* CRC тела считается по ходу; при abort запоздалая ошибка откатит и вставленное */
+    INIT_CRC32C(crc);
+    bin_stream_init(&stream, layout, callback, callback_arg);
+    while (pos < total) {
+        int32 n = (int32) Min((Size) BIN_TOAST_SLICE, total - pos);
+
+        slice = detoast_attr_slice(attr, (int32) pos, n);
+        if (has_crc)
+            COMP_CRC32C(crc, VARDATA(slice), VARSIZE(slice) - VARHDRSZ);
+        bin_stream_feed(&stream, VARDATA(slice), VARSIZE(slice) - VARHDRSZ);
+        pfree(slice);
+        pos += n;
+    }
+    bin_stream_finish(&stream);
+    FIN_CRC32C(crc);
+
+    if (has_crc && crc != frame.crc) {
+        bin_counters.size_errors++;
+        bin_stats_count_error(layout);
+        ereport(ERROR, (errmsg("CRC ERROR: batch body checksum is %08X, frame declares %08X",
+                crc, frame.crc)));
+    }
+
+    if (framed && stream.nrecords != frame.nrecords) {
+        bin_counters.size_errors++;
+        bin_stats_count_error(layout);
+        ereport(ERROR, (errmsg("SIZE ERROR: frame declares %u records, body holds " UINT64_FORMAT,
+                frame.nrecords, stream.nrecords)));
+    }
+
+    *nrecords = stream.nrecords;
+    *nbytes = total;
+    return true;
+}
+
+/*
+ * Сжатый кадр в строковом виде распаковывается порциями по целому
+ * числу записей в один переиспользуемый буфер, и каждая порция сразу
+ * режется на записи. Только при on_error = abort: целостность тела
+ * видна лишь после распаковки, а записи к тому времени уже отданы.
+ * Возвращает false, если payload не такой; тогда batch_begin
+ * распакует тело целиком. В *nbytes - размер распакованного тела.
+ */
+static bool
+batch_stream_compressed(TableBinaryLayout *layout, const char *payload, Size len,
+                        BinOnError on_error, BinRecordCallback callback, void *callback_arg,
+                        uint64 *nrecords, Size *nbytes)
+{
+    BinRecordStream stream;
+    BinDecompress *dc;
+    BinFrame frame;
+    pg_crc32c crc;
+    char *buf;
+    char *reason = NULL;
+    Size cap;
+    Size total = 0;
+
+    if (on_error != BIN_ON_ERROR_ABORT || !bin_frame_parse(layout, payload, len, &frame, &reason) ||
+        (frame.flags & BIN_FRAME_COMPRESSION) == 0 || (frame.flags & BIN_FRAME_COLUMNAR))
+        return false;
+
+    cap = Max(BIN_DECOMPRESS_CHUNK / layout->total_binary_size, 1) * layout->total_binary_size;
+    buf = (char *) palloc(cap);
+
+    INIT_CRC32C(crc);
+    dc = bin_decompress_begin(frame.flags & BIN_FRAME_COMPRESSION, frame.data, frame.data_len,
+                              bin_decompress_limit(layout, &frame));
+    bin_stream_init(&stream, layout, callback, callback_arg);
+    while (!bin_decompress_finished(dc)) {
+        Size n;
+
+        CHECK_FOR_INTERRUPTS();
+
+        reason = bin_decompress_read(dc, buf, cap, &n);
+        if (reason != NULL)
+            break;
+        if (frame.flags & BIN_FRAME_CRC32C)
+            COMP_CRC32C(crc, buf, n);
+        bin_stream_feed(&stream, buf, n);
+        total += n;
+    }
+    bin_decompress_end(dc);
+    FIN_CRC32C(crc);
+    pfree(buf);
+    if (reason == NULL)
+        bin_stream_finish(&stream);
+
+    if (reason == NULL && (frame.flags & BIN_FRAME_CRC32C) && crc != frame.crc)
+        reason = psprintf("CRC ERROR: batch body checksum is %08X, frame declares %08X",
+                          crc, frame.crc);
+    if (reason == NULL && stream.nrecords != frame.nrecords)
+        reason = psprintf("SIZE ERROR: frame declares %u records, body holds " UINT64_FORMAT,
+                          frame.nrecords, stream.nrecords);
+    if (reason != NULL) {
+        bin_counters.size_errors++;
+        bin_stats_count_error(layout);
+        ereport(ERROR, (errmsg("%s", reason)));
+    }
+
+    *nrecords = stream.nrecords;
+    *nbytes = total;
+    return true;
+}
+
+/*
+ * Потоковые пути bin_parse_batch и bin_copy_into: пачка из TOAST или
+ * сжатый кадр. Возвращает false, если пачку нужно разбирать через
+ * BinBatch; *attr тогда может быть уже развёрнут из TOAST.
+ */
+static bool
+batch_stream(TableBinaryLayout *layout, struct varlena **attr, BinOnError on_error,
+             BinRecordCallback callback, void *callback_arg,
+             uint64 *nrecords, Size *nbytes)
+{
+    if (batch_stream_toast(layout, *attr, on_error, callback, callback_arg, nrecords, nbytes))
+        return true;
+
+    *attr = (struct varlena *) PG_DETOAST_DATUM_PACKED(PointerGetDatum(*attr));
+    return batch_stream_compressed(layout, VARDATA_ANY(*attr), VARSIZE_ANY_EXHDR(*attr),
+                                   on_error, callback, callback_arg, nrecords, nbytes);
+}
+
+/*
+ * Учитывает пачку в счётчиках backend-а и shared memory.
+ */
+void
+bin_count_parsed(TableBinaryLayout *layout, uint64 nrecords, uint64 nbytes)
+{
+    /* Пачка попадает в трассировку, если пересекла очередную кратную N запись */
+    if (bin_trace_sample > 0 &&
+        bin_counters.rows_parsed / bin_trace_sample !=
+        (bin_counters.rows_parsed + nrecords) / bin_trace_sample)
+        elog(LOG, "[BINMAPPER] TableOID=%u, BatchSize=" UINT64_FORMAT ", Records=" UINT64_FORMAT
+             ", RowsParsed=" UINT64_FORMAT,
+             layout->relid, nbytes, nrecords, bin_counters.rows_parsed + nrecords);
+
+    bin_counters.rows_parsed += nrecords;
+    bin_counters.bytes_parsed += nbytes;
+    bin_stats_count_rows(layout, nrecords, nbytes);
+}
+
+
+/* Состояние bin_parse_batch для batch_put_record */
+typedef struct {
+    TableBinaryLayout *layout;
+    Tuplestorestate *tupstore;
+    MemoryContext rec_cxt;      /* кортеж записи живёт только до tuplestore_puttuple */
+} BinBatchResult;
+
+static void
+batch_put_record(void *arg, const char *raw_ptr)
+{
+    BinBatchResult *res = (BinBatchResult *) arg;
+    MemoryContext oldcxt;
+    HeapTuple tuple;
+
+    oldcxt = MemoryContextSwitchTo(res->rec_cxt);
+    tuple = bin_form_tuple(res->layout, raw_ptr);
+    MemoryContextSwitchTo(oldcxt);
+
+    /* tuplestore копирует кортеж в свой контекст */
+    tuplestore_puttuple(res->tupstore, tuple);
+    MemoryContextReset(res->rec_cxt);
+}
+
+/*
+ * Общая часть bin_parse_batch и его формы с диапазоном: раскладывает
+ * записи [first, last) пачки из аргумента 1 в tuplestore. Без диапазона
+ * (ranged = false) пачка из TOAST может читаться порциями.
+ */
+static Datum
+parse_batch_records(FunctionCallInfo fcinfo, BinOnError on_error, bool ranged,
+                    uint32 first, uint32 last)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    Oid table_oid = PG_GETARG_OID(0);
+    struct varlena *attr = PG_GETARG_RAW_VARLENA_P(1);
+
+    TableBinaryLayout *layout;
+    TupleDesc tupdesc;
+    Tuplestorestate *tupstore;
+    MemoryContext oldcxt;
+    BinBatchResult res;
+    BinRejects rj;
+    BinBatch batch;
+    const char *rec;
+    uint64 nrecords;
+    Size input_size;
+    instr_time start_time;
+    instr_time call_start;
+    instr_time mark;
+
+    if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("set-valued function called in context that cannot accept a set")));
+    if (!(rsinfo->allowedModes & SFRM_Materialize))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("materialize mode required, but it is not allowed in this context")));
+
+    BIN_PROBE1(batch__start, table_oid);
+    bin_latency_mark(&call_start);
+    mark = call_start;
+
+    layout = get_or_create_layout(table_oid);
+    bin_stats_count_stage(layout, BIN_STAGE_LOOKUP, &mark);
+    bin_rejects_init(&rj, layout, on_error);
+
+    /* Tuplestore и его дескриптор должны пережить вызов функции */
+    oldcxt = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+    tupdesc = CreateTupleDescCopy(layout->tupdesc);
+    tupstore = tuplestore_begin_heap(rsinfo->allowedModes & SFRM_Materialize_Random,
+                                     false, work_mem);
+    MemoryContextSwitchTo(oldcxt);
+
+    res.layout = layout;
+    res.tupstore = tupstore;
+    res.rec_cxt = AllocSetContextCreate(CurrentMemoryContext,
+                                        "bin_parse_batch record",
+                                        ALLOCSET_SMALL_SIZES);
+
+    INSTR_TIME_SET_ZERO(start_time);
+    if (bin_track_timing) INSTR_TIME_SET_CURRENT(start_time);
+    bin_latency_mark(&mark);
+
+    /* У пачки, читаемой потоком, detoast идёт порциями и входит в decode */
+    if (ranged || !batch_stream(layout, &attr, on_error, batch_put_record, &res,
+                                &nrecords, &input_size)) {
+        Size pos;
+
+        if (!ranged || !batch_begin_range(&batch, layout, attr, on_error, first, last)) {
+            attr = (struct varlena *) PG_DETOAST_DATUM_PACKED(PointerGetDatum(attr));
+            input_size = VARSIZE_ANY_EXHDR(attr);
+            batch_begin(&batch, layout, VARDATA_ANY(attr), input_size, &rj);
+        }
+        bin_stats_count_stage(layout, BIN_STAGE_DETOAST, &mark);
+        batch_skip(&batch, first);
+        first = batch.next;
+        pos = batch.pos;
+
+        /*
+         * Колонки сразу в кортежи. bin_form_columnar не проверяет значения,
+         * так что при on_error, отличном от abort, layout с проверяемыми
+         * преобразованиями (unix_*, fixed) идёт по записям через batch_next.
+         */
+        if (batch.columnar && layout->direct_form && layout->bitmap_size == 0 &&
+            (on_error == BIN_ON_ERROR_ABORT || !layout->record_checks)) {
+            HeapTuple *tuples = (HeapTuple *) palloc(BIN_COLUMNAR_CHUNK * sizeof(HeapTuple));
+            uint32 end = Min(batch.nrecords, last);
+            uint32 r;
+
+            /* Порциями, чтобы участок каждой колонки оставался в кэше */
+            for (r = first; r < end; r += BIN_COLUMNAR_CHUNK) {
+                int n = (int) Min(BIN_COLUMNAR_CHUNK, end - r);
+                int i;
+
+                CHECK_FOR_INTERRUPTS();
+
+                oldcxt = MemoryContextSwitchTo(res.rec_cxt);
+                bin_form_columnar(layout, batch.data, batch.nrecords, r, n, tuples);
+                MemoryContextSwitchTo(oldcxt);
+
+                for (i = 0; i < n; i++)
+                    tuplestore_puttuple(tupstore, tuples[i]);
+                MemoryContextReset(res.rec_cxt);
+            }
+            batch.next = Max(end, first);
+            pfree(tuples);
+        } else {
+            while (batch.next < last && (rec = batch_next(&batch)) != NULL) {
+                CHECK_FOR_INTERRUPTS();
+                if (!bin_reject_record(&rj, rec, batch.next))
+                    batch_put_record(&res, rec);
+            }
+        }
+        nrecords = batch.next - first - rj.nrejected;
+
+        /* В статистику попадает только разобранный диапазон */
+        if (ranged)
+            input_size = layout->nvarlena == 0 ?
+                (Size) (batch.next - first) * layout->total_binary_size : batch.pos - pos;
+    }
+
+    MemoryContextDelete(res.rec_cxt);
+
+    if (bin_track_timing) bin_stats_count_decode_time(layout, start_time);
+    bin_stats_count_stage(layout, BIN_STAGE_DECODE, &mark);
+
+    bin_count_parsed(layout, nrecords, input_size);
+    bin_rejects_report(&rj);
+
+    bin_stats_count_stage(layout, BIN_STAGE_TOTAL, &call_start);
+    BIN_PROBE2(batch__done, table_oid, nrecords);
+
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupstore;
+    rsinfo->setDesc = tupdesc;
+
+    return (Datum) 0;
+}
+
+/*
+ * Диапазон записей [start_rec, start_rec + n_rec) из аргументов формы
+ * с диапазоном; номера записей в пачке - uint32.
+ */
+static void
+batch_range_args(FunctionCallInfo fcinfo, int argno, uint32 *first, uint32 *last)
+{
+    int64 start_rec = PG_GETARG_INT64(argno);
+    int64 n_rec = PG_GETARG_INT64(argno + 1);
+
+    if (start_rec < 0 || n_rec < 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("start_rec and n_rec must not be negative")));
+
+    *first = (uint32) Min(start_rec, (int64) PG_UINT32_MAX);
+    *last = n_rec > (int64) (PG_UINT32_MAX - *first) ? PG_UINT32_MAX : *first + (uint32) n_rec;
+}
+
+PG_FUNCTION_INFO_V1(parse_binary_batch);
+
+/*
+ * bin_parse_batch(regclass, bytea, on_error text) returns setof record
+ *
+ * Payload — это записи по total_binary_size байт, идущие подряд без
+ * разделителей, либо кадр с заголовком BinFrame, в том числе
+ * колоночный (BIN_FRAME_COLUMNAR). Все записи раскладываются за один вызов и отдаются
+ * в режиме SFRM_Materialize, так что поиск layout в кэше и служебные
+ * аллокации выполняются один раз на пачку, а не на строку.
+ *
+ * Payload не копируется: короткий или inline bytea читается на месте,
+ * большая несжатая пачка из TOAST - порциями (batch_stream_toast),
+ * сжатый кадр распаковывается по частям (batch_stream_compressed).
+ * on_error задаёт, что делать с пачкой или записью, не прошедшей
+ * проверку (см. BinOnError).
+ */
+Datum
+parse_binary_batch(PG_FUNCTION_ARGS)
+{
+    BinOnError on_error = bin_on_error_parse(text_to_cstring(PG_GETARG_TEXT_PP(2)));
+
+    return parse_batch_records(fcinfo, on_error, false, 0, PG_UINT32_MAX);
+}
+
+PG_FUNCTION_INFO_V1(parse_binary_batch_range);
+
+/*
+ * bin_parse_batch(regclass, bytea, start_rec, n_rec, on_error text)
+ *
+ * Только записи [start_rec, start_rec + n_rec) пачки, чтобы большую
+ * пачку могли поделить между собой процессы параллельного запроса или
+ * несколько сессий. Целостность (CRC, длина) проверяется по всей пачке.
+ */
+Datum
+parse_binary_batch_range(PG_FUNCTION_ARGS)
+{
+    BinOnError on_error = bin_on_error_parse(text_to_cstring(PG_GETARG_TEXT_PP(4)));
+    uint32 first;
+    uint32 last;
+
+    batch_range_args(fcinfo, 2, &first, &last);
+
+    return parse_batch_records(fcinfo, on_error, true, first, last);
+}
+
+static void
+batch_bulk_add_record(void *arg, const char *raw_ptr)
+{
+    bin_bulk_add_record((BinBulkInsert *) arg, raw_ptr);
+}
+
+/*
+ * Общая часть bin_copy_into и его формы с диапазоном: вставляет записи
+ * [first, last) пачки attr в таблицу table_oid и возвращает их число.
+ */
+static uint64
+copy_batch_records(Oid table_oid, struct varlena *attr, BinOnError on_error, bool ranged,
+                   uint32 first, uint32 last)
+{
+    Relation rel;
+    BinBulkInsert *bi;
+    TableBinaryLayout *layout;
+    BinRejects rj;
+    BinBatch batch;
+    const char *rec;
+    uint64 nrecords;
+    Size input_size;
+    uint64 processed;
+    instr_time start_time;
+    instr_time call_start;
+    instr_time mark;
+
+    BIN_PROBE1(copy__start, table_oid);
+    bin_latency_mark(&call_start);
+
+    rel = table_open(table_oid, RowExclusiveLock);
+
+    /* До bin_bulk_begin, чтобы построение layout попало в lookup */
+    bin_latency_mark(&mark);
+    layout = get_or_create_layout(table_oid);
+    bin_stats_count_stage(layout, BIN_STAGE_LOOKUP, &mark);
+
+    bi = bin_bulk_begin(rel);
+    bin_rejects_init(&rj, layout, on_error);
+
+    INSTR_TIME_SET_ZERO(start_time);
+    if (bin_track_timing) INSTR_TIME_SET_CURRENT(start_time);
+    bin_latency_mark(&mark);
+
+    /* Поток из TOAST или чтение на месте, как в bin_parse_batch */
+    if (ranged || !batch_stream(layout, &attr, on_error, batch_bulk_add_record, bi,
+                                &nrecords, &input_size)) {
+        Size pos;
+
+        if (!ranged || !batch_begin_range(&batch, layout, attr, on_error, first, last)) {
+            attr = (struct varlena *) PG_DETOAST_DATUM_PACKED(PointerGetDatum(attr));
+            input_size = VARSIZE_ANY_EXHDR(attr);
+            batch_begin(&batch, layout, VARDATA_ANY(attr), input_size, &rj);
+        }
+        bin_stats_count_stage(layout, BIN_STAGE_DETOAST, &mark);
+        batch_skip(&batch, first);
+        first = batch.next;
+        pos = batch.pos;
+
+        /* bin_bulk_add_record копирует запись, так что batch.row можно переиспользовать */
+        while (batch.next < last && (rec = batch_next(&batch)) != NULL) {
+            CHECK_FOR_INTERRUPTS();
+            if (!bin_reject_record(&rj, rec, batch.next))
+                bin_bulk_add_record(bi, rec);
+        }
+        nrecords = batch.next - first - rj.nrejected;
+
+        if (ranged)
+            input_size = layout->nvarlena == 0 ?
+                (Size) (batch.next - first) * layout->total_binary_size : batch.pos - pos;
+    }
+
+    /* Сбросы буферов уже посчитаны в insert, decode - остальное время цикла */
+    if (!INSTR_TIME_IS_ZERO(mark)) {
+        instr_time elapsed;
+        uint64 ns;
+
+        INSTR_TIME_SET_CURRENT(elapsed);
+        INSTR_TIME_SUBTRACT(elapsed, mark);
+        ns = BIN_INSTR_TIME_GET_NANOSEC(elapsed);
+        bin_stats_count_latency(layout, BIN_STAGE_DECODE, ns - Min(ns, bin_bulk_insert_ns(bi)));
+    }
+
+    processed = bin_bulk_finish(bi);
+
+    if (bin_track_timing) bin_stats_count_decode_time(layout, start_time);
+
+    bin_count_parsed(layout, nrecords, input_size);
+    bin_rejects_report(&rj);
+
+    table_close(rel, NoLock);
+
+    bin_stats_count_stage(layout, BIN_STAGE_TOTAL, &call_start);
+    BIN_PROBE2(copy__done, table_oid, processed);
+
+    return processed;
+}
+
+PG_FUNCTION_INFO_V1(copy_binary_batch);
+
+/*
+ * bin_copy_into(regclass, bytea, on_error text) returns bigint
+ *
+ * Та же пачка записей, что и у bin_parse_batch, но строки сразу пишутся
+ * в таблицу через table_multi_insert, минуя executor и RECORD.
+ * Возвращает число вставленных строк, как COPY FROM.
+ */
+Datum
+copy_binary_batch(PG_FUNCTION_ARGS)
+{
+    BinOnError on_error = bin_on_error_parse(text_to_cstring(PG_GETARG_TEXT_PP(2)));
+
+    PG_RETURN_INT64((int64) copy_batch_records(PG_GETARG_OID(0), PG_GETARG_RAW_VARLENA_P(1),
+                                               on_error, false, 0, PG_UINT32_MAX));
+}
+
+PG_FUNCTION_INFO_V1(copy_binary_batch_range);
+
+/*
+ * bin_copy_into(regclass, bytea, start_rec, n_rec, on_error text)
+ *
+ * Вставляет только записи [start_rec, start_rec + n_rec): большую пачку
+ * могут параллельно загрузить несколько сессий, каждая свой диапазон.
+ */
+Datum
+copy_binary_batch_range(PG_FUNCTION_ARGS)
+{
+    BinOnError on_error = bin_on_error_parse(text_to_cstring(PG_GETARG_TEXT_PP(4)));
+    uint32 first;
+    uint32 last;
+
+    batch_range_args(fcinfo, 2, &first, &last);
+
+    PG_RETURN_INT64((int64) copy_batch_records(PG_GETARG_OID(0), PG_GETARG_RAW_VARLENA_P(1),
+                                               on_error, true, first, last));
+}
+
+/*
+ * То же, что bin_copy_into(relid, payload), для вызова из C
+ * (binmapper_listener.c). payload - varlena с пачкой или кадром.
+ */
+uint64
+bin_copy_batch(Oid relid, struct varlena *payload, BinOnError on_error)
+{
+    return copy_batch_records(relid, payload, on_error, false, 0, PG_UINT32_MAX);
+}
+
+
+PG_FUNCTION_INFO_V1(shard_split_batch);
+
+/*
+ * bin_shard_split(regclass, bytea) returns setof (shardid, shard_name,
+ * nodename, nodeport, nrecords, batch)
+ *
+ * Раскладывает пачку по шардам hash-распределённой таблицы Citus. Из
+ * каждой записи читается только колонка распределения; сами записи
+ * копируются как есть, и на каждый непустой шард получается одна
+ * пачка в строковом виде, которую можно отдать bin_copy_into на узле
+ * размещения. Если таблица не зарегистрирована с framing = 'never',
+ * пачка получает заголовок кадра без флагов: иначе её отверг бы шард с
+ * framing = 'always', а при 'auto' первая запись могла бы начаться с
+ * BIN_FRAME_MAGIC.
+ */
+Datum
+shard_split_batch(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    Oid table_oid = PG_GETARG_OID(0);
+    bytea *payload = PG_GETARG_BYTEA_PP(1);
+
+    TableBinaryLayout *layout;
+    BinShardMap *map;
+    TupleDesc tupdesc;
+    Tuplestorestate *tupstore;
+    MemoryContext oldcxt;
+    MemoryContext rec_cxt;
+    StringInfoData *groups;
+    uint64 *counts;
+    BinRejects rj;
+    BinBatch batch;
+    const char *rec;
+    int opno;
+    bool framed;
+    char header[BIN_FRAME_HEADER_SIZE];
+    int i;
+
+    if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("set-valued function called in context that cannot accept a set")));
+    if (!(rsinfo->allowedModes & SFRM_Materialize))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("materialize mode required, but it is not allowed in this context")));
+
+    layout = get_or_create_layout(table_oid);
+    map = bin_shard_map_load(table_oid);
+    framed = (layout->framing != BIN_FRAMING_NEVER);
+    memset(header, 0, sizeof(header));
+    memcpy(header, BIN_FRAME_MAGIC, 4);
+    header[4] = BIN_FRAME_VERSION;
+
+    for (opno = 0; opno < layout->nops; opno++)
+        if (layout->ops[opno].attnum == map->distattno)
+            break;
+    if (opno == layout->nops)
+        elog(ERROR, "[BINMAPPER] distribution column of table %u is not in the layout", table_oid);
+
+    oldcxt = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+    tupstore = tuplestore_begin_heap(rsinfo->allowedModes & SFRM_Materialize_Random,
+                                     false, work_mem);
+    MemoryContextSwitchTo(oldcxt);
+
+    /* Под заголовок bytea и кадра в начале каждой группы оставлено место */
+    groups = (StringInfoData *) palloc0(map->nshards * sizeof(StringInfoData));
+    counts = (uint64 *) palloc0(map->nshards * sizeof(uint64));
+    rec_cxt = AllocSetContextCreate(CurrentMemoryContext,
+                                    "bin_shard_split record",
+                                    ALLOCSET_SMALL_SIZES);
+
+    bin_rejects_init(&rj, layout, BIN_ON_ERROR_ABORT);
+    batch_begin(&batch, layout, VARDATA_ANY(payload), VARSIZE_ANY_EXHDR(payload), &rj);
+
+    while ((rec = batch_next(&batch)) != NULL) {
+        Datum value;
+        bool isnull;
+        int shard;
+
+        CHECK_FOR_INTERRUPTS();
+
+        oldcxt = MemoryContextSwitchTo(rec_cxt);
+        value = bin_decode_column(layout, rec, opno, &isnull);
+        if (isnull)
+            ereport(ERROR,
+                    (errcode(ERRCODE_NOT_NULL_VIOLATION),
+                     errmsg("record %u has NULL in distribution column \"%s\"", batch.next,
+                            NameStr(TupleDescAttr(layout->tupdesc, map->distattno)->attname))));
+        shard = bin_shard_map_find(map, value);
+        MemoryContextSwitchTo(oldcxt);
+        MemoryContextReset(rec_cxt);
+
+        if (shard < 0)
+            ereport(ERROR,
+                    (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                     errmsg("record %u does not belong to any shard of table \"%s\"",
+                            batch.next, get_rel_name(table_oid))));
+
+        if (counts[shard]++ == 0) {
+            initStringInfo(&groups[shard]);
+            appendStringInfoSpaces(&groups[shard], VARHDRSZ);
+            /* nrecords заголовка заполняется, когда группа собрана */
+            if (framed)
+                appendBinaryStringInfo(&groups[shard], header, BIN_FRAME_HEADER_SIZE);
+        }
+        appendBinaryStringInfo(&groups[shard], rec, (int) bin_record_size(layout, rec, MaxAllocSize));
+    }
+
+    for (i = 0; i < map->nshards; i++) {
+        BinShardInterval *shard = &map->shards[i];
+        Datum values[6];
+        bool nulls[6];
+
+        if (counts[i] == 0)
+            continue;
+
+        if (framed) {
+            uint32 nrecords = pg_hton32((uint32) counts[i]);
+
+            memcpy(groups[i].data + VARHDRSZ + 8, &nrecords, 4);
+        }
+        SET_VARSIZE(groups[i].data, groups[i].len);
+        memset(nulls, 0, sizeof(nulls));
+        values[0] = Int64GetDatum(shard->shardid);
+        values[1] = CStringGetTextDatum(shard->shard_name);
+        values[2] = CStringGetTextDatum(shard->nodename);
+        values[3] = Int32GetDatum(shard->nodeport);
+        values[4] = Int64GetDatum((int64) counts[i]);
+        values[5] = PointerGetDatum(groups[i].data);
+
+        tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+        pfree(groups[i].data);
+    }
+
+    MemoryContextDelete(rec_cxt);
+
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupstore;
+    rsinfo->setDesc = tupdesc;
+
+    return (Datum) 0;
+}
+
+
+PG_FUNCTION_INFO_V1(binmapper_backend_stats);
+
+/*
+ * bin_stats() - счётчики текущего backend.
+ */
+Datum
+binmapper_backend_stats(PG_FUNCTION_ARGS)
+{
+    TupleDesc tupdesc;
+    Datum values[6];
+    bool nulls[6];
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
+    memset(nulls, 0, sizeof(nulls));
+    values[0] = Int64GetDatum((int64) bin_counters.rows_parsed);
+    values[1] = Int64GetDatum((int64) bin_counters.bytes_parsed);
+    values[2] = Int64GetDatum((int64) bin_counters.size_errors);
+    values[3] = Int64GetDatum((int64) bin_counters.cache_hits);
+    values[4] = Int64GetDatum((int64) bin_counters.cache_misses);
+    values[5] = Int64GetDatum((int64) bin_counters.layout_build_ns);
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
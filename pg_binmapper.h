@@ -0,0 +1,498 @@
+/*
+ * pg_binmapper.h
+ *		Общие определения модулей pg_binmapper.
+ */
+#ifndef PG_BINMAPPER_H
+#define PG_BINMAPPER_H
+
+#include "access/htup.h"
+#include "access/tupdesc.h"
+#include "fmgr.h"
+#include "lib/stringinfo.h"
+#include "port/atomics.h"
+#include "port/pg_bswap.h"
+#include "portability/instr_time.h"
+#include "nodes/execnodes.h"
+#include "utils/relcache.h"
+
+/*
+ * Операции программы декодирования. Программа компилируется один раз
+ * при построении layout, так что на каждой строке не нужно заново
+ * смотреть в attlen/attbyval/atttypid.
+ */
+typedef enum {
+    BIN_OP_COPY8,       /* 1 байт как есть: bool, "char" */
+    BIN_OP_BSWAP16,     /* int2 */
+    BIN_OP_LOAD16,      /* то же для записей в порядке байт хоста: без перестановки */
+    BIN_OP_LOAD32,
+    BIN_OP_LOAD64,
+    BIN_OP_BSWAP32,     /* int4, float4, date, oid: биты float4 совпадают с int32 */
+    BIN_OP_BSWAP64,     /* int8, float8, timestamp(tz) */
+    BIN_OP_COPY_BYREF,  /* fixed-length by-reference типы с выравниванием */
+    BIN_OP_REF_INPLACE, /* by-reference с typalign 'c' (uuid): Datum указывает в payload */
+    BIN_OP_TEXT,        /* text, varchar: данные из области varlena с проверкой кодировки */
+    BIN_OP_BYTEA,       /* bytea: данные как есть */
+    BIN_OP_VAR_INPUT,   /* numeric: текстовое представление через функцию ввода типа */
+    /* Преобразования из bin_column_config (binmapper_encodings.c) */
+    BIN_OP_UNIX_DAYS,   /* date из int4 дней от 1970-01-01 */
+    BIN_OP_UNIX_MS,     /* timestamp(tz) из int8 Unix-времени в милли-, */
+    BIN_OP_UNIX_US,     /* микро- */
+    BIN_OP_UNIX_NS,     /* и наносекундах */
+    BIN_OP_SCALED,      /* numeric из int8, делённого на 10^arg */
+    BIN_OP_FIXED_TEXT,  /* text, varchar, char(n) из поля в len байт, хвостовые NUL отбрасываются */
+    BIN_OP_FIXED_BYTEA, /* bytea из поля в len байт */
+    BIN_OP_ARRAY,       /* одномерный массив из arg элементов по len / arg байт */
+    BIN_OP_BSWAP32_RUN, /* только в heap_ops: len подряд идущих 4-байтных полей */
+    BIN_OP_BSWAP64_RUN  /* только в heap_ops: len подряд идущих 8-байтных полей */
+} BinDecodeOpCode;
+
+#define BIN_OP_IS_CONVERSION(opcode) ((opcode) >= BIN_OP_UNIX_DAYS && (opcode) <= BIN_OP_ARRAY)
+
+typedef struct {
+    uint8 opcode;
+    int16 attnum;       /* индекс в values/nulls */
+    int32 len;          /* длина поля, используется только by-reference операциями */
+    int32 offset;       /* смещение поля в записи; для varlena - его пары в trailer */
+    int32 heap_offset;  /* смещение в данных heap-кортежа, если direct_form */
+    int32 arg;          /* параметр преобразования: масштаб или число элементов */
+} BinDecodeOp;
+
+/* Кодировка колонки из bin_column_config, нужна только при сборке layout */
+typedef struct {
+    bool converted;     /* false - тип передаётся как есть */
+    uint8 opcode;
+    int32 len;          /* ширина поля в фиксированной части записи */
+    int32 arg;
+} BinColumnConfig;
+
+/*
+ * Колонки переменной длины (text, varchar, bytea, numeric) не занимают
+ * места в фиксированной части записи. За ней идёт trailer из пар
+ * (offset u32, length u32), по одной на varlena-колонку в порядке
+ * attnum, и затем область данных. offset отсчитывается от начала
+ * области, сама область заканчивается на самом дальнем байте, на
+ * который ссылается trailer. Числа trailer - в порядке байт layout.
+ */
+#define BIN_VARLENA_PAIR_SIZE 8
+
+/*
+ * Как отличать кадр от старой пачки без заголовка. AUTO смотрит только
+ * на BIN_FRAME_MAGIC, поэтому старая пачка, первая запись которой
+ * начинается с байт "BMAP", принимается за кадр.
+ */
+typedef enum {
+    BIN_FRAMING_AUTO,   /* кадр, если payload начинается с BIN_FRAME_MAGIC */
+    BIN_FRAMING_ALWAYS, /* без заголовка кадра пачка отвергается */
+    BIN_FRAMING_NEVER   /* заголовок не ищется, payload - записи подряд */
+} BinFraming;
+
+/*
+ * С null_bitmap запись начинается с битовой карты: по биту на каждую
+ * живую колонку в порядке attnum, младший бит байта первым, 1 = NULL.
+ * Поле NULL-колонки остаётся на своём месте, его содержимое не читается.
+ */
+
+typedef struct {
+    Oid relid;
+    TupleDesc tupdesc;
+    int *offsets;
+    int total_binary_size;  /* фиксированная часть и trailer: минимальная длина записи */
+    int nvarlena;           /* сколько пар в trailer */
+    FmgrInfo *var_finfo;    /* функции ввода для BIN_OP_VAR_INPUT, по attnum */
+    Oid *var_ioparams;
+    Oid *elem_types;        /* типы элементов для BIN_OP_ARRAY, по attnum */
+    BinColumnConfig *columns;   /* по attnum; NULL, если в bin_column_config ничего нет */
+    bool record_checks;     /* есть преобразования, которые проверяет bin_record_check */
+    BinDecodeOp *ops;       /* только живые колонки, в порядке attnum */
+    int nops;
+    bool *null_template;    /* true для удалённых колонок */
+    Oid reltype;            /* тип строки таблицы для заголовка кортежа */
+    bool little_endian;     /* bin_layout_config.byte_order = 'little' */
+    bool null_bitmap;       /* bin_layout_config.null_bitmap */
+    BinFraming framing;     /* bin_layout_config.framing */
+    int bitmap_size;        /* байт битовой карты NULL в начале записи, 0 - без неё */
+    Datum *values;          /* рабочие массивы на natts элементов, */
+    bool *nulls;            /* переиспользуются между вызовами */
+    bool direct_form;       /* кортеж собирается прямо из записи, без values/nulls */
+    int heap_data_len;      /* длина данных такого кортежа с учётом выравнивания */
+    BinDecodeOp *heap_ops;  /* ops, слитые в участки для bin_form_tuple */
+    int nheap_ops;
+    void (*form_shape) (char *dst, const char *src);  /* развёрнутый сборщик или NULL */
+    int shape_offset;       /* откуда form_shape читает запись */
+    struct BinMapperTableStats *stats;  /* NULL, если нет shared memory */
+    MemoryContext cxt;      /* "pg_binmapper layout", в нём всё выше */
+} TableBinaryLayout;
+
+/*
+ * Счётчики текущего backend. Обновляются на горячем пути вместо
+ * elog(LOG), читаются через bin_stats().
+ */
+typedef struct {
+    uint64 rows_parsed;
+    uint64 bytes_parsed;
+    uint64 size_errors;
+    uint64 cache_hits;
+    uint64 cache_misses;
+    uint64 layout_build_ns;
+} BinMapperCounters;
+
+#ifdef WORDS_BIGENDIAN
+#define BIN_HOST_LITTLE_ENDIAN false
+#else
+#define BIN_HOST_LITTLE_ENDIAN true
+#endif
+
+#if PG_VERSION_NUM >= 160000
+#define BIN_INSTR_TIME_GET_NANOSEC(t) INSTR_TIME_GET_NANOSEC(t)
+#else
+#define BIN_INSTR_TIME_GET_NANOSEC(t) ((uint64) (INSTR_TIME_GET_DOUBLE(t) * 1000000000.0))
+#endif
+
+/*
+ * Этапы вызова для гистограмм задержек (pg_stat_binmapper_latency).
+ * Сборка кортежей входит в decode: в пачке она чередуется с разбором
+ * записей, и отдельный замер на каждой строке стоил бы дороже её самой.
+ */
+typedef enum {
+    BIN_STAGE_LOOKUP,   /* поиск или построение layout */
+    BIN_STAGE_DETOAST,  /* detoast payload */
+    BIN_STAGE_DECODE,   /* разбор записей и сборка кортежей */
+    BIN_STAGE_INSERT,   /* table_multi_insert и индексы в bin_copy_into */
+    BIN_STAGE_TOTAL,    /* весь вызов */
+    BIN_NSTAGES
+} BinStage;
+
+/*
+ * Корзина k гистограммы - длительности [2^k, 2^(k+1)) нс, корзина 0 -
+ * ещё и 0 нс; последняя собирает всё, что дольше 2^39 нс (~9 минут).
+ */
+#define BIN_LATENCY_BUCKETS 40
+
+/* Ключ объектов в shared memory: relid уникален только внутри базы */
+typedef struct {
+    Oid dbid;
+    Oid relid;
+} BinMapperSharedKey;
+
+/*
+ * Счётчики таблицы в shared memory (binmapper_stats.c). Записи никогда
+ * не удаляются, поэтому указатель можно держать в layout и обновлять
+ * счётчики атомиками без блокировок.
+ */
+typedef struct BinMapperTableStats {
+    BinMapperSharedKey key;
+    pg_atomic_uint64 rows;
+    pg_atomic_uint64 bytes;
+    pg_atomic_uint64 errors;
+    pg_atomic_uint64 decode_ns;
+    pg_atomic_uint64 layout_builds;
+    pg_atomic_uint64 latency[BIN_NSTAGES][BIN_LATENCY_BUCKETS];
+    pg_atomic_uint64 latency_ns[BIN_NSTAGES];
+} BinMapperTableStats;
+
+/* pg_binmapper.track_timing */
+extern bool bin_track_timing;
+
+/* pg_binmapper.track_latency */
+extern bool bin_track_latency;
+
+/*
+ * Точки USDT провайдера binmapper для perf, bpftrace и systemtap. Есть,
+ * только если сам PostgreSQL собран с --enable-dtrace (см. Makefile);
+ * без подключённого трассировщика точка стоит один nop.
+ */
+#ifdef BIN_USE_SDT
+#include <sys/sdt.h>
+#define BIN_PROBE1(name, a) DTRACE_PROBE1(binmapper, name, a)
+#define BIN_PROBE2(name, a, b) DTRACE_PROBE2(binmapper, name, a, b)
+#define BIN_PROBE3(name, a, b, c) DTRACE_PROBE3(binmapper, name, a, b, c)
+#else
+#define BIN_PROBE1(name, a) ((void) 0)
+#define BIN_PROBE2(name, a, b) ((void) 0)
+#define BIN_PROBE3(name, a, b, c) ((void) 0)
+#endif
+
+/*
+ * Кадр пачки: необязательный заголовок перед записями.
+ *   magic "BMAP" | version u8 | flags u8 | reserved u16 = 0 | nrecords u32 BE
+ * С BIN_FRAME_COLUMNAR тело идёт по колонкам: nrecords значений колонки
+ * 0, затем колонки 1 и т.д., каждое в той же кодировке, что и в записи.
+ * С BIN_FRAME_CRC32C за заголовком идёт CRC-32C тела (u32 BE).
+ * С BIN_FRAME_LZ4 или BIN_FRAME_ZSTD тело сжато (binmapper_compress.c);
+ * nrecords и CRC относятся к распакованному телу.
+ */
+#define BIN_FRAME_MAGIC         "BMAP"
+#define BIN_FRAME_VERSION       1
+#define BIN_FRAME_HEADER_SIZE   12
+
+#define BIN_FRAME_COLUMNAR      0x01
+#define BIN_FRAME_CRC32C        0x02
+#define BIN_FRAME_LZ4           0x04
+#define BIN_FRAME_ZSTD          0x08
+#define BIN_FRAME_COMPRESSION   (BIN_FRAME_LZ4 | BIN_FRAME_ZSTD)
+#define BIN_FRAME_KNOWN_FLAGS   (BIN_FRAME_COLUMNAR | BIN_FRAME_CRC32C | BIN_FRAME_COMPRESSION)
+#define BIN_FRAME_CRC_SIZE      4
+
+/* Сколько записей колоночного кадра собирается за один проход */
+#define BIN_COLUMNAR_CHUNK      256
+
+typedef struct {
+    uint8 version;
+    uint8 flags;
+    uint32 nrecords;
+    uint32 crc;             /* при BIN_FRAME_CRC32C */
+    const char *data;       /* тело кадра сразу после заголовка и CRC */
+    Size data_len;
+} BinFrame;
+
+/*
+ * Что делать с пачкой или записью, не прошедшей проверку (on_error).
+ * Нарушение целостности (CRC, длина, число записей) отвергает всю
+ * пачку, ошибка в значении - только эту запись.
+ */
+typedef enum {
+    BIN_ON_ERROR_ABORT,         /* ERROR, как раньше */
+    BIN_ON_ERROR_SKIP,          /* WARNING и пропуск */
+    BIN_ON_ERROR_DEAD_LETTER    /* пропуск и копия в bin_dead_letter */
+} BinOnError;
+
+typedef struct {
+    TableBinaryLayout *layout;
+    BinOnError on_error;
+    uint64 nrejected;           /* отвергнутых записей */
+    bool batch_rejected;
+    char *first_reason;         /* для WARNING в конце пачки */
+    MemoryContext cxt;          /* где живёт first_reason */
+} BinRejects;
+
+/* pg_binmapper.c */
+extern TableBinaryLayout *get_or_create_layout(Oid relid);
+extern void bin_decode_record(TableBinaryLayout *layout, const char *raw_ptr,
+                              Datum *values, bool *nulls, bool inplace);
+extern int64 bin_record_size(TableBinaryLayout *layout, const char *raw_ptr, Size avail);
+extern void bin_check_record_size(TableBinaryLayout *layout, const char *raw_ptr, int input_size);
+extern HeapTuple bin_form_tuple(TableBinaryLayout *layout, const char *raw_ptr);
+extern void bin_form_columnar(TableBinaryLayout *layout, const char *data, uint32 nrecords,
+                              uint32 first, int n, HeapTuple *tuples);
+extern bool bin_frame_parse(TableBinaryLayout *layout, const char *payload, Size len,
+                            BinFrame *frame, char **reason);
+extern char *bin_record_check(TableBinaryLayout *layout, const char *raw_ptr);
+extern Datum bin_decode_column(TableBinaryLayout *layout, const char *raw_ptr, int opno,
+                               bool *isnull);
+extern void bin_count_parsed(TableBinaryLayout *layout, uint64 nrecords, uint64 nbytes);
+extern uint64 bin_copy_batch(Oid relid, struct varlena *payload, BinOnError on_error);
+
+/* binmapper_insert.c */
+typedef struct BinBulkInsert BinBulkInsert;
+
+extern void bin_target_check(Relation rel, bool allow_partitioned);
+extern bool bin_target_direct(Relation rel, TableBinaryLayout *layout);
+extern EState *bin_target_estate(Relation rel, CommandId mycid, ResultRelInfo **resultRelInfo);
+extern BinBulkInsert *bin_bulk_begin(Relation rel);
+extern void bin_bulk_add_record(BinBulkInsert *bi, const char *raw_ptr);
+extern uint64 bin_bulk_finish(BinBulkInsert *bi);
+extern uint64 bin_bulk_insert_ns(BinBulkInsert *bi);
+
+/*
+ * Нарезка непрерывного потока байт на записи (binmapper_copy.c).
+ * Хвост, не дотянувший до целой записи, копится в carry до следующей
+ * порции данных.
+ */
+typedef void (*BinRecordCallback) (void *arg, const char *raw_ptr);
+
+typedef struct {
+    TableBinaryLayout *layout;
+    BinRecordCallback callback;
+    void *callback_arg;
+    StringInfoData carry;
+    uint64 nrecords;
+    uint64 nbytes;
+} BinRecordStream;
+
+extern void bin_copy_init(void);
+extern void bin_stream_init(BinRecordStream *stream, TableBinaryLayout *layout,
+                            BinRecordCallback callback, void *callback_arg);
+extern void bin_stream_feed(BinRecordStream *stream, const char *data, Size len);
+extern void bin_stream_finish(BinRecordStream *stream);
+
+/* binmapper_trigger.c */
+extern void bin_trigger_init(void);
+extern void bin_trigger_release_targets(void);
+
+/*
+ * Шарды hash-распределённой таблицы Citus (binmapper_shard.c). Интервалы
+ * хэшей включают обе границы и отсортированы по minvalue.
+ */
+typedef struct {
+    int64 shardid;
+    int32 minvalue;
+    int32 maxvalue;
+    char *shard_name;           /* как вернул shard_name(), с кавычками и схемой */
+    char *nodename;             /* узел активного размещения */
+    int32 nodeport;
+} BinShardInterval;
+
+typedef struct {
+    int distattno;              /* индекс колонки распределения в tupdesc */
+    FmgrInfo hash_finfo;
+    Oid collation;
+    int nshards;
+    BinShardInterval *shards;
+} BinShardMap;
+
+extern BinShardMap *bin_shard_map_load(Oid relid);
+extern int bin_shard_map_find(BinShardMap *map, Datum value);
+
+/* binmapper_config.c */
+extern void bin_config_load(TableBinaryLayout *layout);
+extern Oid bin_extension_namespace(void);
+
+/* binmapper_encodings.c */
+extern void bin_column_encoding(Form_pg_attribute attr, const char *encoding, int32 param,
+                                bool param_isnull, BinColumnConfig *config);
+extern void bin_prepare_encodings(TableBinaryLayout *layout);
+extern Datum bin_decode_converted(TableBinaryLayout *layout, const BinDecodeOp *op,
+                                  const char *field_ptr);
+extern char *bin_check_converted(TableBinaryLayout *layout, const BinDecodeOp *op,
+                                 const char *field_ptr);
+
+/* binmapper_reject.c */
+extern BinOnError bin_on_error_parse(const char *value);
+extern void bin_rejects_init(BinRejects *rj, TableBinaryLayout *layout, BinOnError on_error);
+extern bool bin_reject_record(BinRejects *rj, const char *raw_ptr, uint64 record_no);
+extern void bin_reject_batch(BinRejects *rj, const char *reason, const char *payload, Size len);
+extern void bin_rejects_report(BinRejects *rj);
+
+/* binmapper_simd.c */
+typedef void (*BinBswapRunFunc) (char *dst, const char *src, int n);
+
+extern BinBswapRunFunc bin_bswap32_run;
+extern BinBswapRunFunc bin_bswap64_run;
+extern void bin_simd_init(void);
+
+/* binmapper_compress.c */
+/* Порция распаковки; буфер потоковой распаковки - целое число записей около неё */
+#define BIN_DECOMPRESS_CHUNK    (256 * 1024)
+
+typedef struct BinDecompress BinDecompress;
+
+extern int bin_max_decompressed_size;
+extern void bin_compress_init(void);
+extern Size bin_decompress_limit(TableBinaryLayout *layout, const BinFrame *frame);
+extern BinDecompress *bin_decompress_begin(uint8 method, const char *src, Size len, Size limit);
+extern bool bin_decompress_finished(BinDecompress *dc);
+extern char *bin_decompress_read(BinDecompress *dc, char *dst, Size cap, Size *produced);
+extern void bin_decompress_end(BinDecompress *dc);
+extern char *bin_decompress_frame(TableBinaryLayout *layout, BinFrame *frame);
+
+/* binmapper_prewarm.c */
+extern void bin_prewarm_init(void);
+extern PGDLLEXPORT void bin_prewarm_main(Datum main_arg);
+
+/* binmapper_listener.c */
+extern void bin_listener_init(void);
+extern PGDLLEXPORT void bin_listener_main(Datum main_arg);
+
+/* binmapper_shapes.c */
+typedef void (*BinFormShapeFunc) (char *dst, const char *src);
+
+extern void bin_shape_select(TableBinaryLayout *layout);
+
+/* binmapper_stats.c */
+extern int bin_max_tables;
+extern void bin_stats_init(void);
+extern BinMapperTableStats *bin_stats_get_entry(Oid relid);
+extern void bin_stats_count_latency(TableBinaryLayout *layout, BinStage stage, uint64 ns);
+
+/* binmapper_registry.c */
+extern void bin_registry_init(void);
+extern uint64 bin_registry_generation(Oid relid);
+extern bool bin_registry_attach(TableBinaryLayout *layout);
+extern void bin_registry_publish(TableBinaryLayout *layout, uint64 generation);
+extern void bin_registry_invalidate(Oid relid);
+
+/* Есть ли в записи хоть один NULL; без битовой карты - никогда */
+static inline bool
+bin_record_has_nulls(TableBinaryLayout *layout, const char *raw_ptr)
+{
+    int i;
+
+    for (i = 0; i < layout->bitmap_size; i++)
+        if (raw_ptr[i] != 0)
+            return true;
+    return false;
+}
+
+/* Бит k битовой карты NULL */
+static inline bool
+bin_bitmap_isnull(const uint8 *bitmap, int k)
+{
+    return (bitmap[k >> 3] & (1 << (k & 7))) != 0;
+}
+
+/* Служебные u32 записи (trailer) читаются в порядке байт layout */
+static inline uint32
+bin_read_uint32(TableBinaryLayout *layout, const char *ptr)
+{
+    uint32 v;
+
+    memcpy(&v, ptr, 4);
+    return (layout->little_endian == BIN_HOST_LITTLE_ENDIAN) ? v : pg_bswap32(v);
+}
+
+static inline void
+bin_stats_count_rows(TableBinaryLayout *layout, uint64 rows, uint64 bytes)
+{
+    if (layout->stats) {
+        pg_atomic_fetch_add_u64(&layout->stats->rows, rows);
+        pg_atomic_fetch_add_u64(&layout->stats->bytes, bytes);
+    }
+}
+
+static inline void
+bin_stats_count_error(TableBinaryLayout *layout)
+{
+    if (layout->stats) pg_atomic_fetch_add_u64(&layout->stats->errors, 1);
+}
+
+static inline void
+bin_stats_count_decode_time(TableBinaryLayout *layout, instr_time start_time)
+{
+    instr_time elapsed;
+
+    if (layout->stats == NULL) return;
+    INSTR_TIME_SET_CURRENT(elapsed);
+    INSTR_TIME_SUBTRACT(elapsed, start_time);
+    pg_atomic_fetch_add_u64(&layout->stats->decode_ns, BIN_INSTR_TIME_GET_NANOSEC(elapsed));
+}
+
+/* Начало отсчёта этапа; нулевая отметка, если track_latency выключен */
+static inline void
+bin_latency_mark(instr_time *mark)
+{
+    if (bin_track_latency)
+        INSTR_TIME_SET_CURRENT(*mark);
+    else
+        INSTR_TIME_SET_ZERO(*mark);
+}
+
+/*
+ * Время с *mark - в гистограмму этапа stage; *mark сдвигается на
+ * текущий момент, так что следующий этап отсчитывается от конца этого.
+ * С нулевой отметкой ничего не делает.
+ */
+static inline void
+bin_stats_count_stage(TableBinaryLayout *layout, BinStage stage, instr_time *mark)
+{
+    instr_time now;
+    instr_time elapsed;
+
+    if (INSTR_TIME_IS_ZERO(*mark) || layout->stats == NULL) return;
+    INSTR_TIME_SET_CURRENT(now);
+    elapsed = now;
+    INSTR_TIME_SUBTRACT(elapsed, *mark);
+    *mark = now;
+    bin_stats_count_latency(layout, stage, BIN_INSTR_TIME_GET_NANOSEC(elapsed));
+}
+
+#endif							/* PG_BINMAPPER_H */
@@ -0,0 +1,37 @@
+-- zstd-compressed frames; relies on tables from binmapper_decode.
+-- The body is a zstd frame with one raw block: 1 | 10 | 2 | 20.
+CREATE FUNCTION zstd_body(p_crc bool DEFAULT false) RETURNS bytea LANGUAGE sql AS $$
+    SELECT CASE WHEN p_crc THEN '\x517dde01'::bytea ELSE ''::bytea END
+        || '\x28b52ffd2018c10000'::bytea
+        || int4send(1) || int8send(10) || int4send(2) || int8send(20)
+$$;
+
+SELECT * FROM bin_parse_batch('narrow', '\x424d415001080000'::bytea || int4send(2) || zstd_body())
+    AS r(a int4, b int8);
+SELECT * FROM bin_parse_batch('narrow', '\x424d4150010a0000'::bytea || int4send(2) || zstd_body(true))
+    AS r(a int4, b int8);
+SELECT * FROM bin_parse_batch('narrow', '\x424d415001080000'::bytea || int4send(2) || zstd_body(),
+    on_error => 'skip') AS r(a int4, b int8);
+SELECT * FROM bin_parse_batch('narrow', '\x424d415001080000'::bytea || int4send(2) || zstd_body(), 1, 1)
+    AS r(a int4, b int8);
+
+-- truncated and inconsistent bodies
+SELECT * FROM bin_parse_batch('narrow',
+    '\x424d415001080000'::bytea || int4send(2) || substr(zstd_body(), 1, 32)) AS r(a int4, b int8);
+SELECT * FROM bin_parse_batch('narrow',
+    '\x424d415001080000'::bytea || int4send(2) || substr(zstd_body(), 1, 32),
+    on_error => 'skip') AS r(a int4, b int8);
+SELECT * FROM bin_parse_batch('narrow', '\x424d415001080000'::bytea || int4send(3) || zstd_body())
+    AS r(a int4, b int8);
+SELECT * FROM bin_parse_batch('narrow', '\x424d4150010c0000'::bytea || int4send(2) || zstd_body())
+    AS r(a int4, b int8);
+
+-- a body longer than the header allows is cut off at nrecords * record size
+SELECT * FROM bin_parse_batch('narrow', '\x424d415001080000'::bytea || int4send(1) || zstd_body())
+    AS r(a int4, b int8);
+SELECT * FROM bin_parse_batch('narrow', '\x424d415001080000'::bytea || int4send(1) || zstd_body(),
+    on_error => 'skip') AS r(a int4, b int8);
+
+TRUNCATE sink;
+SELECT bin_copy_into('sink', '\x424d415001080000'::bytea || int4send(2) || zstd_body());
+SELECT count(*), sum(a), sum(b) FROM sink;
@@ -0,0 +1,37 @@
+-- COPY ... FROM a server-side file WITH (FORMAT 'binmapper'); the files are
+-- written with lo_export
+LOAD 'pg_binmapper';
+CREATE TABLE copied (a int4, b int8);
+SELECT lo_from_bytea(0, (SELECT string_agg(int4send(i) || int8send(i * 10), ''::bytea ORDER BY i)
+                           FROM generate_series(1, 1000) i)) AS lo \gset
+SELECT lo_export(:lo, 'binmapper_copy.bin');
+SELECT lo_put(:lo, 12000, '\x00'::bytea);
+SELECT lo_export(:lo, 'binmapper_copy_cut.bin');
+SELECT lo_unlink(:lo);
+
+COPY copied FROM 'binmapper_copy.bin' WITH (FORMAT 'binmapper');
+SELECT count(*), sum(a), sum(b) FROM copied;
+COPY copied FROM 'binmapper_copy.bin' WITH (FORMAT 'binmapper', ON_ERROR 'skip');
+SELECT count(*), sum(a), sum(b) FROM copied;
+
+-- a record cut short at the end of the data aborts the whole COPY
+COPY copied FROM 'binmapper_copy_cut.bin' WITH (FORMAT 'binmapper');
+SELECT count(*) FROM copied;
+
+-- unsupported forms and options
+COPY copied TO STDOUT WITH (FORMAT 'binmapper');
+COPY copied (a) FROM 'binmapper_copy.bin' WITH (FORMAT 'binmapper');
+COPY copied FROM 'binmapper_copy.bin' WITH (FORMAT 'binmapper') WHERE a > 1;
+COPY copied FROM PROGRAM 'cat binmapper_copy.bin' WITH (FORMAT 'binmapper');
+COPY copied FROM 'binmapper_copy.bin' WITH (FORMAT 'binmapper', HEADER);
+COPY copied FROM 'binmapper_copy.bin' WITH (FORMAT 'binmapper', ON_ERROR 'bogus');
+
+-- reading a server-side file needs pg_read_server_files
+CREATE ROLE regress_bin_copier;
+GRANT INSERT ON copied TO regress_bin_copier;
+SET ROLE regress_bin_copier;
+COPY copied FROM 'binmapper_copy.bin' WITH (FORMAT 'binmapper');
+RESET ROLE;
+
+DROP TABLE copied;
+DROP ROLE regress_bin_copier;
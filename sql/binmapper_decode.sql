@@ -0,0 +1,204 @@
+CREATE EXTENSION pg_binmapper;
+
+CREATE TABLE narrow (a int4 NOT NULL, b int8 NOT NULL);
+
+-- one record per call
+SELECT * FROM bin_parse('narrow', int4send(7) || int8send(42)) AS r(a int4, b int8);
+SELECT * FROM bin_parse('narrow', int4send(7) || int4send(42)) AS r(a int4, b int8);
+
+-- back-to-back records
+SELECT * FROM bin_parse_batch('narrow',
+    (SELECT string_agg(int4send(i) || int8send(i * 1000), ''::bytea ORDER BY i)
+       FROM generate_series(1, 3) i)) AS r(a int4, b int8);
+SELECT * FROM bin_parse_batch('narrow', int4send(1) || int8send(1) || '\x00'::bytea)
+    AS r(a int4, b int8);
+
+-- framed and columnar batches
+SELECT * FROM bin_parse_batch('narrow',
+    '\x424d415001000000'::bytea || int4send(2)
+    || int4send(1) || int8send(10) || int4send(2) || int8send(20)) AS r(a int4, b int8);
+SELECT * FROM bin_parse_batch('narrow',
+    '\x424d415001010000'::bytea || int4send(2)
+    || int4send(1) || int4send(2) || int8send(10) || int8send(20)) AS r(a int4, b int8);
+SELECT * FROM bin_parse_batch('narrow',
+    '\x424d415001000000'::bytea || int4send(3)
+    || int4send(1) || int8send(10) || int4send(2) || int8send(20)) AS r(a int4, b int8);
+SELECT * FROM bin_parse_batch('narrow', '\x424d415002000000'::bytea || int4send(0))
+    AS r(a int4, b int8);
+
+-- mixed fixed-size types
+CREATE TABLE mixed (id int8, flag bool, small int2, value float8, device uuid);
+SELECT * FROM bin_parse_batch('mixed',
+    int8send(1) || boolsend(true) || int2send(-5) || float8send(2.5)
+    || uuid_send('a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'))
+    AS r(id int8, flag bool, small int2, value float8, device uuid);
+
+-- little-endian producer
+SELECT bin_register_layout('narrow', byte_order => 'little');
+SELECT * FROM bin_parse('narrow', '\x070000002a00000000000000'::bytea) AS r(a int4, b int8);
+SELECT bin_register_layout('narrow');
+SELECT * FROM bin_parse('narrow', int4send(7) || int8send(42)) AS r(a int4, b int8);
+
+-- an unframed batch whose first bytes are 'BMAP' (0x424D4150)
+SELECT * FROM bin_parse_batch('narrow', int4send(1112359248) || int8send(1)) AS r(a int4, b int8);
+SELECT bin_register_layout('narrow', framing => 'never');
+SELECT * FROM bin_parse_batch('narrow', int4send(1112359248) || int8send(1)) AS r(a int4, b int8);
+SELECT bin_register_layout('narrow', framing => 'always');
+SELECT * FROM bin_parse_batch('narrow', int4send(7) || int8send(42)) AS r(a int4, b int8);
+SELECT * FROM bin_parse_batch('narrow', int4send(7) || int8send(42), on_error => 'skip')
+    AS r(a int4, b int8);
+SELECT bin_copy_into('narrow', int4send(7) || int8send(42), on_error => 'dead_letter');
+SELECT record_no, reason, length(payload) AS len FROM bin_dead_letter
+ WHERE relid = 'narrow'::regclass;
+DELETE FROM bin_dead_letter WHERE relid = 'narrow'::regclass;
+SELECT * FROM bin_parse_batch('narrow',
+    '\x424d415001000000'::bytea || int4send(1) || int4send(1112359248) || int8send(1))
+    AS r(a int4, b int8);
+SELECT bin_register_layout('narrow');
+
+-- variable-length columns
+CREATE TABLE events (id int4, name text, note varchar(5), price numeric, blob bytea);
+CREATE FUNCTION pack_event(p_id int4, p_name text, p_note text, p_price text, p_blob bytea)
+RETURNS bytea LANGUAGE sql AS $$
+    SELECT int4send(p_id)
+        || int4send(0) || int4send(octet_length(p_name))
+        || int4send(octet_length(p_name)) || int4send(octet_length(p_note))
+        || int4send(octet_length(p_name || p_note)) || int4send(octet_length(p_price))
+        || int4send(octet_length(p_name || p_note || p_price)) || int4send(length(p_blob))
+        || textsend(p_name || p_note || p_price) || p_blob
+$$;
+SELECT * FROM bin_parse_batch('events',
+    pack_event(1, 'alpha', 'short', '12.50', '\xdead')
+    || pack_event(2, 'b', '', '-1', '')) AS r(id int4, name text, note varchar(5), price numeric, blob bytea);
+SELECT * FROM bin_parse_batch('events', pack_event(1, 'alpha', 'toolong', '1', ''))
+    AS r(id int4, name text, note varchar(5), price numeric, blob bytea);
+SELECT * FROM bin_parse_batch('events', substr(pack_event(1, 'alpha', '', '1', ''), 1, 40))
+    AS r(id int4, name text, note varchar(5), price numeric, blob bytea);
+
+-- null bitmap
+SELECT bin_register_layout('events', null_bitmap => true);
+SELECT id, name IS NULL AS name_null, price FROM bin_parse_batch('events',
+    '\x00'::bytea || pack_event(1, 'x', 'y', '1', '')
+    || '\x0a'::bytea || pack_event(2, '', 'y', '', ''))
+    AS r(id int4, name text, note varchar(5), price numeric, blob bytea);
+SELECT bin_register_layout('events');
+
+-- direct bulk load
+CREATE TABLE sink (a int4, b int8);
+SELECT bin_copy_into('sink',
+    (SELECT string_agg(int4send(i) || int8send(i), ''::bytea)
+       FROM generate_series(1, 1500) i));
+SELECT count(*), sum(a), sum(b) FROM sink;
+
+-- record ranges
+SELECT * FROM bin_parse_batch('narrow',
+    (SELECT string_agg(int4send(i) || int8send(i * 1000), ''::bytea ORDER BY i)
+       FROM generate_series(1, 5) i), 1, 2) AS r(a int4, b int8);
+SELECT * FROM bin_parse_batch('narrow',
+    '\x424d415001010000'::bytea || int4send(3)
+    || int4send(1) || int4send(2) || int4send(3)
+    || int8send(10) || int8send(20) || int8send(30), 2, 10) AS r(a int4, b int8);
+SELECT id, name FROM bin_parse_batch('events',
+    pack_event(1, 'a', '', '1', '') || pack_event(2, 'bb', '', '2', '')
+    || pack_event(3, 'ccc', '', '3', ''), 1, 1)
+    AS r(id int4, name text, note varchar(5), price numeric, blob bytea);
+SELECT * FROM bin_parse_batch('narrow', int4send(1) || int8send(1), -1, 1) AS r(a int4, b int8);
+SELECT bin_copy_into('sink',
+    (SELECT string_agg(int4send(i) || int8send(i), ''::bytea ORDER BY i)
+       FROM generate_series(1, 1500) i), 1000, 1000);
+SELECT count(*), sum(a), sum(b) FROM sink;
+
+-- record ranges of batches stored out of line or compressed
+CREATE TABLE stored (plain bytea, packed bytea);
+ALTER TABLE stored ALTER COLUMN plain SET STORAGE EXTERNAL;
+INSERT INTO stored SELECT b, b FROM
+    (SELECT string_agg(int4send(i) || int8send(i * 10), ''::bytea ORDER BY i) AS b
+       FROM generate_series(1, 1500) i) s;
+INSERT INTO stored SELECT b, b FROM
+    (SELECT '\x424d415001000000'::bytea || int4send(1500)
+            || string_agg(int4send(i) || int8send(i * 10), ''::bytea ORDER BY i) AS b
+       FROM generate_series(1, 1500) i) s;
+INSERT INTO stored SELECT b, b FROM
+    (SELECT string_agg(int4send(i) || int8send(i * 10), ''::bytea ORDER BY i) || '\x00'::bytea AS b
+       FROM generate_series(1, 1500) i) s;
+SELECT count(*), min(a), max(a), sum(b)
+  FROM stored, bin_parse_batch('narrow', plain, 700, 100) AS r(a int4, b int8)
+ WHERE length(plain) % 12 = 0;
+SELECT count(*), min(a), max(a), sum(b)
+  FROM stored, bin_parse_batch('narrow', packed, 700, 100) AS r(a int4, b int8)
+ WHERE length(packed) % 12 = 0;
+SELECT count(*) FROM stored, bin_parse_batch('narrow', plain, 1490, 100) AS r(a int4, b int8)
+ WHERE length(plain) % 12 = 0;
+SELECT count(*) FROM stored, bin_parse_batch('narrow', plain, 0, 1) AS r(a int4, b int8)
+ WHERE length(plain) % 12 = 1;
+SELECT count(*) FROM stored, bin_parse_batch('narrow', plain, 0, 1, on_error => 'skip')
+    AS r(a int4, b int8)
+ WHERE length(plain) % 12 = 1;
+DROP TABLE stored;
+
+-- unrolled decoders for runs of 8-byte and 4-byte columns
+CREATE TABLE metrics (ts int8, v1 float8, v2 float8);
+SELECT * FROM bin_parse_batch('metrics',
+    int8send(1) || float8send(1.5) || float8send(-2)
+    || int8send(2) || float8send(0.25) || float8send(1e10)) AS r(ts int8, v1 float8, v2 float8);
+CREATE TABLE counters (a int4, b int4, c float4);
+SELECT * FROM bin_parse_batch('counters', int4send(1) || int4send(-1) || float4send(0.5))
+    AS r(a int4, b int4, c float4);
+
+-- prewarm
+SELECT bin_prewarm(ARRAY['narrow', 'metrics', NULL]::regclass[]);
+SELECT bin_prewarm();
+
+-- partitioned targets; readings_2 orders its columns differently
+CREATE TABLE readings (ts int8, dev int4, v float8) PARTITION BY RANGE (ts);
+CREATE TABLE readings_1 PARTITION OF readings FOR VALUES FROM (0) TO (100);
+CREATE TABLE readings_2 (v float8, dev int4, ts int8);
+ALTER TABLE readings ATTACH PARTITION readings_2 FOR VALUES FROM (100) TO (200);
+SELECT bin_copy_into('readings',
+    int8send(5) || int4send(1) || float8send(0.5)
+    || int8send(150) || int4send(2) || float8send(1.5)
+    || int8send(7) || int4send(3) || float8send(2.5));
+SELECT tableoid::regclass, * FROM readings ORDER BY ts;
+SELECT bin_copy_into('readings', int8send(300) || int4send(4) || float8send(3.5));
+-- more rows than one buffer flush, across both partitions
+SELECT bin_copy_into('readings',
+    (SELECT string_agg(int8send(i % 200) || int4send(i) || float8send(i), ''::bytea ORDER BY i)
+       FROM generate_series(1, 2500) i));
+SELECT tableoid::regclass, count(*), sum(dev) FROM readings GROUP BY 1 ORDER BY 1;
+
+-- column encodings
+CREATE TABLE conv (ts timestamptz, d date, amount numeric(12,2), code char(4), tag bytea,
+                   vals float8[], ids int4[]);
+SELECT bin_register_column('conv', 'ts', 'unix_ms');
+SELECT bin_register_column('conv', 'd', 'unix_days');
+SELECT bin_register_column('conv', 'amount', 'scaled', 2);
+SELECT bin_register_column('conv', 'code', 'fixed', 4);
+SELECT bin_register_column('conv', 'tag', 'fixed', 2);
+SELECT bin_register_column('conv', 'vals', 'array', 2);
+SELECT bin_register_column('conv', 'ids', 'array', 3);
+SELECT ts = '2023-11-14 22:13:20.123+00' AS ts_ok, d - '1970-01-01'::date AS days,
+       amount, code::text, tag, vals, ids
+  FROM bin_parse_batch('conv',
+    int8send(1700000000123) || int4send(19000) || int8send(-12345) || '\x41420000'::bytea
+    || '\xbeef'::bytea || float8send(1.5) || float8send(-2)
+    || int4send(1) || int4send(2) || int4send(3))
+  AS r(ts timestamptz, d date, amount numeric(12,2), code char(4), tag bytea,
+       vals float8[], ids int4[]);
+CREATE TABLE ticks (ts timestamp, n int8);
+SELECT bin_register_column('ticks', 'ts', 'unix_ns');
+SELECT ts = '1969-12-31 23:59:59.999999' AS ts_ok, n
+  FROM bin_parse_batch('ticks', int8send(-1) || int8send(5)) AS r(ts timestamp, n int8);
+CREATE TABLE stamps (ts timestamp, n int4);
+SELECT bin_register_column('stamps', 'ts', 'unix_ms');
+SELECT ts = '1970-01-01 00:00:00' AS ts_ok, n FROM bin_parse_batch('stamps',
+    '\x424d415001010000'::bytea || int4send(2)
+    || int8send(0) || int8send(9223372036854775807) || int4send(1) || int4send(2),
+    on_error => 'skip') AS r(ts timestamp, n int4);
+SELECT bin_register_column('conv', 'd', 'unix_ms');
+SELECT bin_register_column('conv', 'amount', 'scaled');
+SELECT bin_register_column('conv', 'nope', 'fixed', 2);
+-- latency tracking without shared_preload_libraries only costs the clock reads
+SET pg_binmapper.track_latency = on;
+SELECT * FROM bin_parse_batch('narrow', int4send(1) || int8send(2)) AS r(a int4, b int8);
+SELECT bin_copy_into('sink', int4send(9) || int8send(90));
+RESET pg_binmapper.track_latency;
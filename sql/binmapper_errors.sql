@@ -0,0 +1,46 @@
+-- on_error policies; relies on tables from binmapper_decode
+TRUNCATE sink;
+
+SELECT bin_copy_into('sink', int4send(1) || int8send(1) || '\x00'::bytea, on_error => 'skip');
+SELECT bin_copy_into('sink', int4send(1) || int8send(1) || '\x00'::bytea, on_error => 'dead_letter');
+SELECT bin_copy_into('sink', int4send(1) || int8send(1), on_error => 'bogus');
+
+-- CRC-32C frame
+SELECT bin_copy_into('sink',
+    '\x424d415001020000'::bytea || int4send(1) || '\xd0499860'::bytea
+    || int4send(5) || int8send(50));
+SELECT bin_copy_into('sink',
+    '\x424d415001020000'::bytea || int4send(1) || '\x00000000'::bytea
+    || int4send(5) || int8send(50));
+SELECT bin_copy_into('sink',
+    '\x424d415001020000'::bytea || int4send(1) || '\x00000000'::bytea
+    || int4send(5) || int8send(50), on_error => 'skip');
+SELECT count(*), sum(a), sum(b) FROM sink;
+
+-- a bad value rejects only its record
+SELECT id, note FROM bin_parse_batch('events',
+    pack_event(1, 'a', 'ok', '1', '') || pack_event(2, 'b', 'toolong', '1', '')
+    || pack_event(3, 'c', 'fine', '1', ''), on_error => 'dead_letter')
+    AS r(id int4, name text, note varchar(5), price numeric, blob bytea);
+
+SELECT relid, record_no, reason, length(payload) AS len FROM bin_dead_letter ORDER BY id;
+
+SELECT * FROM bin_shard_split('sink', int4send(1) || int8send(1));
+
+-- a table owner without superuser rights may register the table
+CREATE ROLE regress_bin_owner;
+CREATE ROLE regress_bin_other;
+CREATE TABLE owned (a int4, b int8);
+ALTER TABLE owned OWNER TO regress_bin_owner;
+SET ROLE regress_bin_owner;
+SELECT bin_register_layout('owned', byte_order => 'little');
+SELECT bin_register_column('owned', 'b', 'native');
+SELECT * FROM bin_parse('owned', '\x070000002a00000000000000'::bytea) AS r(a int4, b int8);
+SET ROLE regress_bin_other;
+SELECT bin_register_layout('owned');
+SELECT bin_register_column('owned', 'a', 'native');
+RESET ROLE;
+SELECT relid, byte_order FROM bin_layout_config WHERE relid = 'owned'::regclass;
+DROP TABLE owned;
+DROP ROLE regress_bin_owner;
+DROP ROLE regress_bin_other;
@@ -0,0 +1,45 @@
+-- bin_ingest_trigger; relies on tables from binmapper_decode
+TRUNCATE sink;
+CREATE VIEW sink_ingest AS SELECT NULL::bytea AS payload;
+CREATE TRIGGER sink_ingest INSTEAD OF INSERT ON sink_ingest
+    FOR EACH ROW EXECUTE FUNCTION bin_ingest_trigger('sink');
+
+INSERT INTO sink_ingest VALUES
+    (int4send(1) || int8send(10)), (int4send(2) || int8send(20)), (NULL);
+INSERT INTO sink_ingest VALUES (int4send(3));
+
+-- the target stays open for the rest of the transaction
+BEGIN;
+INSERT INTO sink_ingest VALUES (int4send(3) || int8send(30));
+SELECT count(*) FROM sink;
+INSERT INTO sink_ingest VALUES (int4send(4) || int8send(40));
+COMMIT;
+
+-- DDL on the target in the same transaction
+BEGIN;
+INSERT INTO sink_ingest VALUES (int4send(5) || int8send(50));
+ALTER TABLE sink ADD CHECK (b < 100);
+INSERT INTO sink_ingest VALUES (int4send(6) || int8send(600));
+ROLLBACK;
+
+SELECT a, b FROM sink ORDER BY a;
+
+CREATE VIEW sink_noarg AS SELECT NULL::bytea AS payload;
+CREATE TRIGGER sink_noarg INSTEAD OF INSERT ON sink_noarg
+    FOR EACH ROW EXECUTE FUNCTION bin_ingest_trigger();
+INSERT INTO sink_noarg VALUES (int4send(7) || int8send(70));
+
+-- statement-level trigger over a transition table
+TRUNCATE sink;
+CREATE TABLE sink_stage (payload bytea);
+CREATE TRIGGER sink_stage AFTER INSERT ON sink_stage
+    REFERENCING NEW TABLE AS new_rows
+    FOR EACH STATEMENT EXECUTE FUNCTION bin_ingest_trigger('sink');
+INSERT INTO sink_stage
+    SELECT int4send(i) || int8send(i * 10) FROM generate_series(1, 1500) i;
+INSERT INTO sink_stage VALUES (NULL), (int4send(1501) || int8send(15010));
+SELECT count(*), sum(a), sum(b) FROM sink;
+
+CREATE TRIGGER sink_stage_before BEFORE INSERT ON sink_stage
+    FOR EACH STATEMENT EXECUTE FUNCTION bin_ingest_trigger('sink');
+INSERT INTO sink_stage VALUES (int4send(1) || int8send(1));
@@ -0,0 +1,35 @@
+-- bin_shard_split on a single-node Citus cluster; runs only when citus is
+-- in shared_preload_libraries
+SELECT current_setting('shared_preload_libraries') NOT LIKE '%citus%' AS skip_test \gset
+\if :skip_test
+\quit
+\endif
+
+SET client_min_messages TO warning;
+CREATE EXTENSION citus;
+SELECT 1 FROM citus_add_node('localhost', current_setting('port')::int, groupid => 0);
+SET citus.shard_count TO 2;
+SET citus.shard_replication_factor TO 1;
+SET citus.next_shard_id TO 9100000;
+CREATE TABLE dist (id int4 NOT NULL, v int8 NOT NULL);
+SELECT create_distributed_table('dist', 'id');
+RESET client_min_messages;
+
+-- groups carry a frame header, so a shard registered with framing 'always'
+-- takes them back
+SELECT bin_register_layout('dist', framing => 'always');
+CREATE TEMP TABLE groups AS
+SELECT * FROM bin_shard_split('dist',
+    (SELECT string_agg(int4send(i) || int8send(i * 10), ''::bytea ORDER BY i)
+       FROM generate_series(1, 20) i));
+SELECT count(*), sum(nrecords),
+       bool_and(substr(batch, 1, 12) = '\x424d415001000000'::bytea || int4send(nrecords::int4))
+  FROM groups;
+SELECT bin_register_layout(shard_name::regclass, framing => 'always') FROM groups ORDER BY shardid;
+SET citus.enable_manual_changes_to_shards TO on;
+SELECT sum(bin_copy_into(shard_name::regclass, batch)) FROM groups;
+RESET citus.enable_manual_changes_to_shards;
+SELECT count(*), sum(id), sum(v) FROM dist;
+
+DROP TABLE groups;
+DROP TABLE dist;